@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+#define ACCESSLOG_RING_SIZE 1024        /* Records per thread; a power of 2. */
+#define ACCESSLOG_FLUSH_INTERVAL_MS 50
+#define ACCESSLOG_LINE_MAX 320
+#define ACCESSLOG_BATCH 64              /* Lines per writev(). */
+
+struct accesslog_record {
+  struct timespec start_wall;
+  uint64_t start;
+  uint64_t latency;
+  uint64_t upstream_time;
+  uint64_t bytes_sent;
+  struct in_addr client_address;
+  uint16_t client_port;
+  int16_t status_code;
+  int16_t status_override;      /* From accesslog_set_status(), if nonzero. */
+  char method[8];
+  char path[192];
+};
+
+/*
+ * A single-producer, single-consumer ring. HEAD is only written by the
+ * owning serving thread and TAIL only by the log thread.
+ */
+struct accesslog_ring {
+  struct accesslog_record records[ACCESSLOG_RING_SIZE];
+  unsigned long head;
+  unsigned long tail;
+  unsigned long dropped;
+  unsigned long dropped_reported;
+  struct accesslog_ring *next;
+};
+
+static int enabled;
+static char *log_path;
+static size_t log_max_size;
+static int log_fd = -1;
+static size_t log_size;
+
+static struct accesslog_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct accesslog_ring *own_ring;
+static __thread struct accesslog_record current;
+
+void *accesslog_request_state(void) {
+  return &current;
+}
+
+size_t accesslog_request_state_size(void) {
+  return sizeof(current);
+}
+
+uint64_t accesslog_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void accesslog_begin(int fd) {
+  if (!enabled)
+    return;
+
+  memset(&current, 0, sizeof(current));
+  clock_gettime(CLOCK_REALTIME, &current.start_wall);
+  current.start = accesslog_now();
+
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (getpeername(fd, (struct sockaddr *) &address, &length) == 0
+      && address.sin_family == AF_INET) {
+    current.client_address = address.sin_addr;
+    current.client_port = ntohs(address.sin_port);
+  }
+}
+
+void accesslog_set_request(char *method, char *path) {
+  if (!enabled)
+    return;
+  strncpy(current.method, method ? method : "-", sizeof(current.method) - 1);
+  strncpy(current.path, path ? path : "-", sizeof(current.path) - 1);
+}
+
+void accesslog_set_status(int status_code) {
+  current.status_override = status_code;
+}
+
+void accesslog_add_upstream_time(uint64_t nanoseconds) {
+  current.upstream_time += nanoseconds;
+}
+
+/* Registers a ring for the calling thread the first time it logs. */
+static struct accesslog_ring *accesslog_own_ring(void) {
+  if (own_ring)
+    return own_ring;
+
+  own_ring = calloc(1, sizeof(struct accesslog_ring));
+  if (!own_ring)
+    return NULL;
+
+  pthread_mutex_lock(&rings_lock);
+  own_ring->next = rings;
+  rings = own_ring;
+  pthread_mutex_unlock(&rings_lock);
+  return own_ring;
+}
+
+void accesslog_end(int status_code, size_t bytes_sent) {
+  if (!enabled)
+    return;
+
+  struct accesslog_ring *ring = accesslog_own_ring();
+  if (!ring)
+    return;
+
+  current.latency = accesslog_now() - current.start;
+  current.status_code = current.status_override ? current.status_override
+    : status_code;
+  current.bytes_sent = bytes_sent;
+  if (current.method[0] == '\0')
+    strcpy(current.method, "-");
+  if (current.path[0] == '\0')
+    strcpy(current.path, "-");
+
+  unsigned long head = ring->head;
+  unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == ACCESSLOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  ring->records[head & (ACCESSLOG_RING_SIZE - 1)] = current;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void accesslog_open(void) {
+  if (strcmp(log_path, "-") == 0) {
+    log_fd = STDOUT_FILENO;
+    return;
+  }
+
+  log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (log_fd == -1) {
+    perror("Failed to open access log");
+    exit(errno);
+  }
+
+  struct stat st;
+  log_size = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+}
+
+/* Shifts PATH.N to PATH.N+1, PATH to PATH.1, and reopens PATH. */
+static void accesslog_rotate(void) {
+  char from[PATH_MAX], to[PATH_MAX];
+  int i;
+
+  for (i = ACCESSLOG_KEEP - 1; i >= 1; i--) {
+    snprintf(from, sizeof(from), "%s.%d", log_path, i);
+    snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sizeof(to), "%s.1", log_path);
+  rename(log_path, to);
+
+  close(log_fd);
+  accesslog_open();
+}
+
+static void accesslog_write(struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(log_fd, iov, count);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) return;
+    log_size += written;
+
+    /* Skip past whatever was fully written; resume partial writes. */
+    while (count > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  if (log_max_size && log_fd != STDOUT_FILENO && log_size >= log_max_size)
+    accesslog_rotate();
+}
+
+/*
+ * One line per record:
+ *
+ *   client:port [time] "METHOD path" status bytes latency upstream_time
+ *
+ * Times are in seconds; upstream_time is "-" if no upstream was involved.
+ */
+static int accesslog_format(struct accesslog_record *record, char *line) {
+  char address[INET_ADDRSTRLEN], time_string[32], upstream[32];
+  struct tm tm;
+
+  inet_ntop(AF_INET, &record->client_address, address, sizeof(address));
+  gmtime_r(&record->start_wall.tv_sec, &tm);
+  strftime(time_string, sizeof(time_string), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+  if (record->upstream_time)
+    snprintf(upstream, sizeof(upstream), "%.6f", record->upstream_time / 1e9);
+  else
+    strcpy(upstream, "-");
+
+  int length = snprintf(line, ACCESSLOG_LINE_MAX,
+      "%s:%u [%s] \"%s %s\" %d %llu %.6f %s\n",
+      address, record->client_port, time_string, record->method, record->path,
+      record->status_code, (unsigned long long) record->bytes_sent,
+      record->latency / 1e9, upstream);
+  return length < ACCESSLOG_LINE_MAX ? length : ACCESSLOG_LINE_MAX - 1;
+}
+
+static void *accesslog_main(void *argument) {
+  static char lines[ACCESSLOG_BATCH][ACCESSLOG_LINE_MAX];
+  struct iovec iov[ACCESSLOG_BATCH];
+  struct timespec interval = {
+    .tv_sec = 0,
+    .tv_nsec = ACCESSLOG_FLUSH_INTERVAL_MS * 1000000L,
+  };
+
+  while (1) {
+    int count = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    struct accesslog_ring *ring = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    /* Rings are only ever prepended, so the list can be walked unlocked. */
+    for (; ring; ring = ring->next) {
+      unsigned long tail = ring->tail;
+      unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+      for (; tail != head; tail++) {
+        struct accesslog_record *record =
+          &ring->records[tail & (ACCESSLOG_RING_SIZE - 1)];
+        iov[count].iov_base = lines[count];
+        iov[count].iov_len = accesslog_format(record, lines[count]);
+        if (++count == ACCESSLOG_BATCH) {
+          /* Formatted copies are ours; hand the slots back before writing. */
+          __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+          accesslog_write(iov, count);
+          count = 0;
+        }
+      }
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+      unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      if (dropped != ring->dropped_reported) {
+        if (count == ACCESSLOG_BATCH) {
+          accesslog_write(iov, count);
+          count = 0;
+        }
+        iov[count].iov_base = lines[count];
+        iov[count].iov_len = snprintf(lines[count], ACCESSLOG_LINE_MAX,
+            "accesslog: dropped %lu records\n", dropped - ring->dropped_reported);
+        count++;
+        ring->dropped_reported = dropped;
+      }
+    }
+
+    if (count > 0)
+      accesslog_write(iov, count);
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
+
+void accesslog_init(char *path, size_t max_size) {
+  pthread_t thread;
+
+  log_path = path;
+  log_max_size = max_size;
+  accesslog_open();
+
+  int error = pthread_create(&thread, NULL, accesslog_main, NULL);
+  if (error) {
+    fprintf(stderr, "Failed to create access log thread: %s\n", strerror(error));
+    exit(error);
+  }
+  pthread_detach(thread);
+  enabled = 1;
+}
@@ -0,0 +1,62 @@
+/*
+ * An asynchronous access log.
+ *
+ * Every thread that serves requests fills in one fixed-size record per
+ * exchange and pushes it into its own single-producer ring, which costs no
+ * locks or system calls. A dedicated thread drains the rings, formats the
+ * records and appends them to the log file in batches with writev(), rotating
+ * the file when it grows past a size limit.
+ *
+ * Usage example, on a serving thread:
+ *
+ *     accesslog_begin(fd);
+ *     struct http_request *request = http_request_parse(fd);
+ *     accesslog_set_request(request->method, request->path);
+ *     ...
+ *     accesslog_end(200, bytes_sent);
+ *
+ * All functions are no-ops until accesslog_init() is called. If a ring is
+ * full its records are dropped, and the number dropped is logged later.
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rotated files are kept as PATH.1 (newest) to PATH.ACCESSLOG_KEEP. */
+#define ACCESSLOG_KEEP 5
+
+/*
+ * Starts the log thread writing to PATH ("-" for standard output, which is
+ * never rotated). MAX_SIZE is the size at which the file is rotated, or 0 to
+ * never rotate.
+ */
+void accesslog_init(char *path, size_t max_size);
+
+/* Starts a record for the connection FD on the calling thread. */
+void accesslog_begin(int fd);
+
+void accesslog_set_request(char *method, char *path);
+
+/* Overrides the status passed to accesslog_end(), e.g. for relayed responses. */
+void accesslog_set_status(int status_code);
+
+/* Adds time spent waiting on an upstream, in nanoseconds. */
+void accesslog_add_upstream_time(uint64_t nanoseconds);
+
+/* Finishes the calling thread's record and queues it for writing. */
+void accesslog_end(int status_code, size_t bytes_sent);
+
+/*
+ * The calling thread's in-progress record, for code that multiplexes several
+ * requests on one thread and must save and restore it (see coro.h).
+ */
+void *accesslog_request_state(void);
+size_t accesslog_request_state_size(void);
+
+/* Monotonic clock in nanoseconds (vDSO, no system call). */
+uint64_t accesslog_now(void);
+
+#endif
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+static int allowed_cpus[CPU_SETSIZE];
+static int allowed_cpus_count;
+
+void affinity_init(void) {
+  cpu_set_t set;
+  int cpu;
+
+  allowed_cpus_count = 0;
+  if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+    perror("Failed to read CPU affinity (assuming CPU 0 only)");
+    allowed_cpus[allowed_cpus_count++] = 0;
+    return;
+  }
+
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set))
+      allowed_cpus[allowed_cpus_count++] = cpu;
+}
+
+int affinity_num_cpus(void) {
+  return allowed_cpus_count;
+}
+
+int affinity_cpu_at(int index) {
+  return allowed_cpus[index % allowed_cpus_count];
+}
+
+int affinity_pin_self(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int affinity_current_node(void) {
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1)
+    return 0;
+  return node;
+}
+
+int affinity_bind_memory_local(void) {
+  unsigned long nodemask = 1UL << affinity_current_node();
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask,
+        sizeof(nodemask) * 8) == -1)
+    return -1;
+  return 0;
+}
+
+void *affinity_alloc_local(size_t size, int strict) {
+  void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+    return NULL;
+
+  if (strict) {
+    unsigned long nodemask = 1UL << affinity_current_node();
+    /* Not fatal: kernels built without NUMA reject mbind with ENOSYS. */
+    if (syscall(SYS_mbind, buffer, size, MPOL_BIND, &nodemask,
+          sizeof(nodemask) * 8, 0) == -1 && errno != ENOSYS)
+      perror("Failed to bind buffer to local NUMA node (ignoring)");
+  }
+
+  /* Fault every page in from this thread so it lands on our node. */
+  memset(buffer, 0, size);
+  return buffer;
+}
+
+void affinity_free_local(void *buffer, size_t size) {
+  if (buffer)
+    munmap(buffer, size);
+}
+
+int affinity_incoming_cpu(int fd) {
+  int cpu;
+  socklen_t length = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == -1)
+    return -1;
+  return cpu;
+}
@@ -0,0 +1,56 @@
+/*
+ * CPU and NUMA placement helpers.
+ *
+ * Usage example:
+ *
+ *     affinity_init();
+ *     int cpu = affinity_cpu_at(worker_index);
+ *     affinity_pin_self(cpu);
+ *     char *buffer = affinity_alloc_local(65536, 1);
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+
+/*
+ * Snapshots the set of CPUs this process is allowed to run on. Must be called
+ * before any of the other functions.
+ */
+void affinity_init(void);
+
+/* Number of CPUs in the allowed set. */
+int affinity_num_cpus(void);
+
+/* The INDEX-th allowed CPU, wrapping around when INDEX exceeds the count. */
+int affinity_cpu_at(int index);
+
+/* Pins the calling thread to CPU. Returns 0 on success, -1 on error. */
+int affinity_pin_self(int cpu);
+
+/* NUMA node the calling thread is currently running on (0 if unknown). */
+int affinity_current_node(void);
+
+/*
+ * Restricts future page allocations of the calling thread to its current NUMA
+ * node. Returns 0 on success, -1 if the kernel has no NUMA support.
+ */
+int affinity_bind_memory_local(void);
+
+/*
+ * Allocates SIZE bytes of page-aligned memory backed by the calling thread's
+ * NUMA node. The pages are touched before returning so that the first-touch
+ * policy places them locally; with STRICT set they are also mbind()'ed to the
+ * node. Returns NULL on failure. Release with affinity_free_local().
+ */
+void *affinity_alloc_local(size_t size, int strict);
+void affinity_free_local(void *buffer, size_t size);
+
+/*
+ * CPU that processed the receive path of the connected socket FD
+ * (SO_INCOMING_CPU), or -1 if the kernel can't tell.
+ */
+int affinity_incoming_cpu(int fd);
+
+#endif
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "libhttp.h"
+
+static int bundle_fd = -1;
+static char *bundle;
+static size_t bundle_size;
+static struct bundle_header *header;
+static struct bundle_entry *entries;
+static uint32_t *buckets;
+
+static void bundle_invalid(char *path, char *reason) {
+  fprintf(stderr, "Invalid bundle %s: %s\n", path, reason);
+  exit(EXIT_FAILURE);
+}
+
+/* Whether LENGTH bytes at OFFSET lie within the bundle. */
+static int bundle_contains(uint64_t offset, uint64_t length) {
+  return offset <= bundle_size && length <= bundle_size - offset;
+}
+
+void bundle_open(char *path) {
+  struct stat st;
+  uint32_t i;
+  int variant;
+
+  bundle_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (bundle_fd == -1 || fstat(bundle_fd, &st) == -1) {
+    fprintf(stderr, "Failed to open bundle %s: %s\n", path, strerror(errno));
+    exit(errno);
+  }
+  bundle_size = st.st_size;
+  if (bundle_size < sizeof(struct bundle_header))
+    bundle_invalid(path, "too short");
+
+  /* Bodies go out with sendfile(); only the index and heads are read here. */
+  bundle = mmap(NULL, bundle_size, PROT_READ, MAP_SHARED, bundle_fd, 0);
+  if (bundle == MAP_FAILED) {
+    perror("Failed to map bundle");
+    exit(errno);
+  }
+
+  header = (struct bundle_header *) bundle;
+  if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != BUNDLE_VERSION)
+    bundle_invalid(path, "not a bundle, or from another version of mkbundle");
+  if (header->num_buckets == 0
+      || (header->num_buckets & (header->num_buckets - 1)) != 0
+      || !bundle_contains(header->entries_offset,
+        (uint64_t) header->num_entries * sizeof(struct bundle_entry))
+      || !bundle_contains(header->buckets_offset,
+        (uint64_t) header->num_buckets * sizeof(uint32_t)))
+    bundle_invalid(path, "bad index");
+
+  entries = (struct bundle_entry *) (bundle + header->entries_offset);
+  buckets = (uint32_t *) (bundle + header->buckets_offset);
+
+  /* Check every offset once, so lookups can trust them. */
+  for (i = 0; i < header->num_entries; i++) {
+    struct bundle_entry *entry = &entries[i];
+    if (!bundle_contains(entry->path_offset, entry->path_length)
+        || entry->hash_next > header->num_entries)
+      bundle_invalid(path, "bad entry");
+    for (variant = BUNDLE_IDENTITY; variant <= BUNDLE_GZIP; variant++) {
+      struct bundle_variant *v = &entry->variants[variant];
+      if (!bundle_contains(v->head_offset, v->head_length)
+          || !bundle_contains(v->etag_offset, v->etag_length)
+          || !bundle_contains(v->body_offset, v->body_length))
+        bundle_invalid(path, "bad entry");
+    }
+  }
+  for (i = 0; i < header->num_buckets; i++)
+    if (buckets[i] > header->num_entries)
+      bundle_invalid(path, "bad bucket");
+
+  /* The index is hit on every request; keep it resident. */
+  madvise(bundle, header->buckets_offset
+      + header->num_buckets * sizeof(uint32_t), MADV_WILLNEED);
+}
+
+struct bundle_entry *bundle_lookup(char *path) {
+  size_t length = strlen(path);
+  uint32_t index = buckets[bundle_hash(path, length) & (header->num_buckets - 1)];
+  int steps = 0;
+
+  /* Bounded, in case a corrupt bundle links a chain into a cycle. */
+  while (index && steps++ < (int) header->num_entries) {
+    struct bundle_entry *entry = &entries[index - 1];
+    if (entry->path_length == length
+        && memcmp(bundle + entry->path_offset, path, length) == 0)
+      return entry;
+    index = entry->hash_next;
+  }
+  return NULL;
+}
+
+/*
+ * Whether the Accept-Encoding list VALUE allows gzip: a "gzip" (or "x-gzip")
+ * coding with a nonzero q-value, or failing that a "*" with one.
+ */
+static int bundle_accepts_gzip(char *value) {
+  double gzip = -1, any = -1;
+  char *cursor = value;
+
+  while (cursor && *cursor) {
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == ',') cursor++;
+    size_t length = strcspn(cursor, " \t;,");
+    char *next = strchr(cursor, ',');
+    double quality = 1;
+    char *parameter;
+    for (parameter = strchr(cursor, ';'); parameter && (!next || parameter < next);
+        parameter = strchr(parameter, ';')) {
+      parameter += 1 + strspn(parameter + 1, " \t");
+      if ((*parameter == 'q' || *parameter == 'Q') && parameter[1] == '=')
+        quality = strtod(parameter + 2, NULL);
+    }
+    if ((length == 4 && strncasecmp(cursor, "gzip", 4) == 0)
+        || (length == 6 && strncasecmp(cursor, "x-gzip", 6) == 0))
+      gzip = quality;
+    else if (length == 1 && *cursor == '*')
+      any = quality;
+    cursor = next;
+  }
+  return gzip >= 0 ? gzip > 0 : any > 0;
+}
+
+int bundle_choose_variant(struct bundle_entry *entry, char *accept_encoding) {
+  if (entry->variants[BUNDLE_GZIP].head_length && accept_encoding
+      && bundle_accepts_gzip(accept_encoding))
+    return BUNDLE_GZIP;
+  return BUNDLE_IDENTITY;
+}
+
+/* Whether the If-None-Match list VALUE names ETAG (or is exactly "*"). */
+static int bundle_etag_matches(char *value, char *etag, size_t etag_length) {
+  char *match = value + strspn(value, " \t");
+  if (*match == '*' && match[1 + strspn(match + 1, " \t")] == '\0')
+    return 1;
+  for (match = strstr(value, "\""); match; match = strstr(match + 1, "\""))
+    if (strncmp(match, etag, etag_length) == 0)
+      return 1;
+  return 0;
+}
+
+void bundle_send(int fd, struct bundle_entry *entry, int variant,
+    int head_only, char *if_none_match) {
+  struct bundle_variant *v = &entry->variants[variant];
+  char *etag = bundle + v->etag_offset;
+
+  if (if_none_match && bundle_etag_matches(if_none_match, etag, v->etag_length)) {
+    char etag_value[128];
+    snprintf(etag_value, sizeof(etag_value), "%.*s", (int) v->etag_length, etag);
+    http_start_response(fd, 304);
+    http_send_header(fd, "ETag", etag_value);
+    http_end_headers(fd);
+    return;
+  }
+
+  http_status_sent = 200;
+  http_send_data(fd, bundle + v->head_offset, v->head_length);
+  if (!head_only)
+    http_send_file(fd, bundle_fd, v->body_offset, v->body_length);
+}
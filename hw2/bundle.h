@@ -0,0 +1,100 @@
+/*
+ * A document root packed into a single file, for immutable deployments.
+ *
+ * mkbundle walks a directory ahead of time and writes every file (and a
+ * page for every directory: its index.html, or else a listing) as a ready
+ * response: a complete head with Content-Type, Content-Length and an ETag,
+ * and the body starting on a page boundary. With --gzip it also stores a
+ * gzip-compressed variant of text files that shrink. The server maps the
+ * file once and answers each request with a hash lookup, one write of the
+ * stored head and a sendfile() of the body, without touching the document
+ * root.
+ *
+ * Usage example:
+ *
+ *     ./mkbundle --gzip files/ files.bundle
+ *     ./httpserver --bundle files.bundle --port 8000
+ *
+ *     bundle_open("files.bundle");
+ *     struct bundle_entry *entry = bundle_lookup("my_documents/credit.txt");
+ *     if (entry)
+ *       bundle_send(fd, entry, BUNDLE_IDENTITY, 0, NULL);
+ *
+ * Keys are normalized paths as produced by fdcache_normalize_path().
+ */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "HTTPBNDL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGNMENT 4096
+
+#define BUNDLE_IDENTITY 0
+#define BUNDLE_GZIP 1
+
+/* Entry flags. */
+#define BUNDLE_DIRECTORY 1     /* Redirected to "PATH/" if requested without. */
+
+/*
+ * On-disk layout, in native byte order: the header, the entries, the hash
+ * buckets, the strings (paths, heads and ETags), then the page-aligned
+ * bodies. Offsets are from the start of the file.
+ */
+struct bundle_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_entries;
+  uint32_t num_buckets;         /* A power of 2. */
+  uint32_t reserved;
+  uint64_t entries_offset;
+  uint64_t buckets_offset;      /* uint32_t each: first entry index + 1, or 0. */
+};
+
+struct bundle_variant {
+  uint64_t head_offset;         /* Status line and headers, blank line included. */
+  uint64_t etag_offset;         /* Quoted, as sent. */
+  uint64_t body_offset;
+  uint64_t body_length;
+  uint32_t head_length;
+  uint32_t etag_length;
+};
+
+struct bundle_entry {
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t hash_next;           /* Next entry index + 1 in the bucket, or 0. */
+  uint32_t flags;
+  uint32_t reserved;
+  struct bundle_variant variants[2];  /* Identity, then gzip (if HEAD_LENGTH). */
+};
+
+/* FNV-1a, over the LENGTH bytes of a normalized path. */
+static inline uint32_t bundle_hash(const char *path, size_t length) {
+  uint32_t hash = 2166136261u;
+  while (length--)
+    hash = (hash ^ (unsigned char) *path++) * 16777619u;
+  return hash;
+}
+
+/* Maps the bundle at PATH. Exits if it can't be opened or is malformed. */
+void bundle_open(char *path);
+
+/* Returns the entry for PATH, a normalized path, or NULL. */
+struct bundle_entry *bundle_lookup(char *path);
+
+/* Returns BUNDLE_GZIP if ENTRY has a gzip variant and the client accepts it. */
+int bundle_choose_variant(struct bundle_entry *entry, char *accept_encoding);
+
+/*
+ * Sends the stored response for VARIANT of ENTRY, or just its head if
+ * HEAD_ONLY. Answers 304 instead if IF_NONE_MATCH (may be NULL) names the
+ * variant's ETag.
+ */
+void bundle_send(int fd, struct bundle_entry *entry, int variant,
+    int head_only, char *if_none_match);
+
+#endif
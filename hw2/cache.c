@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "utlist.h"
+
+#define CACHE_BUCKETS 4096
+
+/* Responses without explicit freshness stay fresh for 10% of their age... */
+#define CACHE_HEURISTIC_FRACTION 10
+/* ...but never longer than a day. */
+#define CACHE_HEURISTIC_MAX (24 * 60 * 60)
+
+static int enabled;
+static size_t memory_limit, memory_used;
+static size_t disk_limit, disk_used;
+static char *spill_directory;
+
+/*
+ * The hash table holds one reference to every entry it contains. Each entry
+ * also sits on exactly one of the two LRU lists, most recently used first.
+ */
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_entry *memory_lru, *disk_lru;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_init(size_t memory, size_t disk, char *directory) {
+  memory_limit = memory;
+  disk_limit = directory ? disk : 0;
+  spill_directory = directory;
+  enabled = 1;
+}
+
+int cache_enabled(void) {
+  return enabled;
+}
+
+size_t cache_object_limit(void) {
+  return memory_limit / 8;
+}
+
+static unsigned long cache_hash(char *key) {
+  unsigned long hash = 5381;
+  while (*key)
+    hash = hash * 33 + (unsigned char) *key++;
+  return hash % CACHE_BUCKETS;
+}
+
+/* Returns the value of directive NAME in a Cache-Control VALUE, or NULL. */
+static char *cache_control_directive(char *value, char *name) {
+  size_t length = strlen(name);
+  char *cursor = value;
+
+  while (cursor && *cursor) {
+    while (*cursor == ' ' || *cursor == ',') cursor++;
+    if (strncasecmp(cursor, name, length) == 0
+        && (cursor[length] == '\0' || cursor[length] == ','
+          || cursor[length] == '=' || cursor[length] == ' '))
+      return cursor + length;
+    cursor = strchr(cursor, ',');
+  }
+  return NULL;
+}
+
+static time_t cache_parse_date(char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (!value || !strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+    return -1;
+  return timegm(&tm);
+}
+
+/* Works out when RESPONSE, received at NOW, stops being fresh. */
+static time_t cache_expiration(struct http_response *response, time_t now) {
+  char *cache_control = http_response_get_header(response, "Cache-Control");
+  char *directive;
+
+  if (cache_control) {
+    if (cache_control_directive(cache_control, "no-cache"))
+      return now;
+    if ((directive = cache_control_directive(cache_control, "s-maxage"))
+        && *directive == '=')
+      return now + atol(directive + 1);
+    if ((directive = cache_control_directive(cache_control, "max-age"))
+        && *directive == '=')
+      return now + atol(directive + 1);
+  }
+
+  char *expires_header = http_response_get_header(response, "Expires");
+  if (expires_header) {
+    time_t expires = cache_parse_date(expires_header);
+    return expires < 0 ? now : expires;
+  }
+
+  time_t last_modified = cache_parse_date(
+      http_response_get_header(response, "Last-Modified"));
+  if (last_modified >= 0 && last_modified < now) {
+    time_t lifetime = (now - last_modified) / CACHE_HEURISTIC_FRACTION;
+    return now + (lifetime < CACHE_HEURISTIC_MAX ? lifetime : CACHE_HEURISTIC_MAX);
+  }
+  return now;
+}
+
+int cache_request_is_cacheable(struct http_request *request) {
+  if (strcmp(request->method, "GET") != 0)
+    return 0;
+  if (http_request_get_header(request, "Authorization"))
+    return 0;
+  char *cache_control = http_request_get_header(request, "Cache-Control");
+  return !cache_control || !cache_control_directive(cache_control, "no-store");
+}
+
+int cache_request_wants_revalidation(struct http_request *request) {
+  char *cache_control = http_request_get_header(request, "Cache-Control");
+  if (cache_control && (cache_control_directive(cache_control, "no-cache")
+        || cache_control_directive(cache_control, "max-age=0")))
+    return 1;
+  char *pragma = http_request_get_header(request, "Pragma");
+  return pragma && strcasecmp(pragma, "no-cache") == 0;
+}
+
+int cache_response_is_shareable(struct http_response *response) {
+  char *cache_control = http_response_get_header(response, "Cache-Control");
+  if (cache_control && (cache_control_directive(cache_control, "no-store")
+        || cache_control_directive(cache_control, "private")))
+    return 0;
+
+  /* We key on the path alone, so responses that vary can't be told apart. */
+  return !http_response_get_header(response, "Vary")
+    && !http_response_get_header(response, "Set-Cookie");
+}
+
+int cache_response_is_storable(struct http_response *response) {
+  if (response->status_code != 200 || !cache_response_is_shareable(response))
+    return 0;
+
+  /* Worth keeping only if it can be served fresh or revalidated cheaply. */
+  return cache_expiration(response, time(NULL)) > time(NULL)
+    || http_response_get_header(response, "ETag")
+    || http_response_get_header(response, "Last-Modified");
+}
+
+static void cache_entry_free(struct cache_entry *entry) {
+  free(entry->key);
+  free(entry->head);
+  free(entry->body);
+  if (entry->body_fd >= 0)
+    close(entry->body_fd);
+  free(entry->etag);
+  free(entry->last_modified);
+  free(entry);
+}
+
+/* Drops a reference. Caller holds cache_lock. */
+static void cache_unref(struct cache_entry *entry) {
+  if (--entry->refcount == 0)
+    cache_entry_free(entry);
+}
+
+/* Removes ENTRY from the table and its LRU list. Caller holds cache_lock. */
+static void cache_unlink(struct cache_entry *entry) {
+  struct cache_entry **link = &buckets[cache_hash(entry->key)];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+
+  if (entry->body) {
+    DL_DELETE(memory_lru, entry);
+    memory_used -= entry->head_length + entry->body_length;
+  } else {
+    DL_DELETE(disk_lru, entry);
+    disk_used -= entry->body_length;
+    memory_used -= entry->head_length;
+  }
+  cache_unref(entry);
+}
+
+/* Adds ENTRY to the table and the front of its LRU list. Caller holds cache_lock. */
+static void cache_link(struct cache_entry *entry) {
+  unsigned long bucket = cache_hash(entry->key);
+  entry->hash_next = buckets[bucket];
+  buckets[bucket] = entry;
+  entry->refcount++;
+
+  if (entry->body) {
+    DL_PREPEND(memory_lru, entry);
+    memory_used += entry->head_length + entry->body_length;
+  } else {
+    DL_PREPEND(disk_lru, entry);
+    disk_used += entry->body_length;
+    memory_used += entry->head_length;
+  }
+}
+
+/*
+ * Writes the body of ENTRY to a spill file and returns an on-disk copy of
+ * the entry, not yet in the table, or NULL on failure. Entries are
+ * otherwise immutable, so this needs no lock, and threads still sending
+ * the in-memory copy are unaffected.
+ */
+static struct cache_entry *cache_write_spill(struct cache_entry *entry) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/httpcache.XXXXXX", spill_directory);
+  int spill_fd = mkstemp(path);
+  if (spill_fd == -1) {
+    perror("Failed to create cache spill file (dropping entry)");
+    return NULL;
+  }
+  unlink(path); /* Nothing to clean up if we die. */
+
+  size_t written = 0;
+  while (written < entry->body_length) {
+    ssize_t bytes = write(spill_fd, entry->body + written,
+        entry->body_length - written);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) {
+      perror("Failed to write cache spill file (dropping entry)");
+      close(spill_fd);
+      return NULL;
+    }
+    written += bytes;
+  }
+
+  struct cache_entry *spilled = calloc(1, sizeof(struct cache_entry));
+  if (!spilled) {
+    close(spill_fd);
+    return NULL;
+  }
+  spilled->body_fd = spill_fd;
+  spilled->key = strdup(entry->key);
+  spilled->head = malloc(entry->head_length);
+  if (!spilled->key || !spilled->head) {
+    cache_entry_free(spilled);
+    return NULL;
+  }
+  memcpy(spilled->head, entry->head, entry->head_length);
+  spilled->head_length = entry->head_length;
+  spilled->body_length = entry->body_length;
+  spilled->stored = entry->stored;
+  spilled->expires = entry->expires;
+  spilled->etag = entry->etag ? strdup(entry->etag) : NULL;
+  spilled->last_modified = entry->last_modified
+    ? strdup(entry->last_modified) : NULL;
+  return spilled;
+}
+
+/*
+ * Moves the body of ENTRY, taken off the table by cache_shrink(), to a
+ * spill file, and puts the on-disk copy in the table unless KEY was stored
+ * again meanwhile. The file is written without holding cache_lock, which
+ * is only taken to link the copy in. Drops cache_shrink()'s reference.
+ */
+static void cache_spill(struct cache_entry *entry) {
+  struct cache_entry *spilled = cache_write_spill(entry);
+
+  pthread_mutex_lock(&cache_lock);
+  if (spilled) {
+    struct cache_entry *other;
+    for (other = buckets[cache_hash(spilled->key)]; other; other = other->hash_next)
+      if (strcmp(other->key, spilled->key) == 0)
+        break;
+    if (other) {
+      cache_entry_free(spilled);
+    } else {
+      while (disk_used + spilled->body_length > disk_limit && disk_lru)
+        cache_unlink(disk_lru->prev);
+      cache_link(spilled);
+      /* Heads of spilled entries stay in memory and count against the limit. */
+      while (memory_used > memory_limit && disk_lru)
+        cache_unlink(disk_lru->prev);
+    }
+  }
+  cache_unref(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Brings the memory tier back under its limit. Entries that can go to disk
+ * are taken off the table rather than dropped, and returned, chained by
+ * hash_next and each with a reference of its own, for cache_spill() to
+ * write out once cache_lock is released. Caller holds cache_lock.
+ */
+static struct cache_entry *cache_shrink(void) {
+  struct cache_entry *spills = NULL;
+  while (memory_used > memory_limit && memory_lru) {
+    struct cache_entry *entry = memory_lru->prev;
+    int spill = spill_directory && entry->body_length <= disk_limit;
+    if (spill)
+      entry->refcount++;
+    cache_unlink(entry);
+    if (spill) {
+      entry->hash_next = spills;
+      spills = entry;
+    }
+  }
+  /* Heads of spilled entries stay in memory and count against the limit. */
+  while (memory_used > memory_limit && disk_lru)
+    cache_unlink(disk_lru->prev);
+  return spills;
+}
+
+struct cache_entry *cache_lookup(char *key) {
+  struct cache_entry *entry;
+
+  pthread_mutex_lock(&cache_lock);
+  for (entry = buckets[cache_hash(key)]; entry; entry = entry->hash_next)
+    if (strcmp(entry->key, key) == 0)
+      break;
+
+  if (entry) {
+    entry->refcount++;
+    if (entry->body) {
+      DL_DELETE(memory_lru, entry);
+      DL_PREPEND(memory_lru, entry);
+    } else {
+      DL_DELETE(disk_lru, entry);
+      DL_PREPEND(disk_lru, entry);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+void cache_release(struct cache_entry *entry) {
+  pthread_mutex_lock(&cache_lock);
+  cache_unref(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_entry_is_fresh(struct cache_entry *entry) {
+  pthread_mutex_lock(&cache_lock);
+  int fresh = entry->expires > time(NULL);
+  pthread_mutex_unlock(&cache_lock);
+  return fresh;
+}
+
+void cache_entry_send(int fd, struct cache_entry *entry) {
+  /* Splice an Age header in front of the blank line that ends the head. */
+  size_t head_length = entry->head_length;
+  if (head_length >= 2 && entry->head[head_length - 2] == '\r')
+    head_length -= 2;
+  else
+    head_length -= 1;
+
+  char age[24];
+  snprintf(age, sizeof(age), "%ld", (long) (time(NULL) - entry->stored));
+  http_send_data(fd, entry->head, head_length);
+  http_send_header(fd, "Age", age);
+  http_end_headers(fd);
+
+  if (entry->body) {
+    http_send_data(fd, entry->body, entry->body_length);
+    return;
+  }
+
+  http_send_file(fd, entry->body_fd, 0, entry->body_length);
+}
+
+void cache_entry_revalidated(struct cache_entry *entry,
+    struct http_response *response) {
+  time_t now = time(NULL);
+  time_t expires = cache_expiration(response, now);
+
+  pthread_mutex_lock(&cache_lock);
+  entry->stored = now;
+  entry->expires = expires;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_store(char *key, char *data, size_t size,
+    struct http_response *response) {
+  if (size - response->header_length > cache_object_limit())
+    return;
+
+  struct cache_entry *entry = calloc(1, sizeof(struct cache_entry));
+  if (!entry) return;
+
+  entry->key = strdup(key);
+  entry->head_length = response->header_length;
+  entry->head = malloc(entry->head_length);
+  entry->body_length = size - response->header_length;
+  /* Always allocate, so an empty body still marks the entry as in memory. */
+  entry->body = malloc(entry->body_length + 1);
+  entry->body_fd = -1;
+  if (!entry->key || !entry->head || !entry->body) {
+    cache_entry_free(entry);
+    return;
+  }
+  memcpy(entry->head, data, entry->head_length);
+  memcpy(entry->body, data + entry->head_length, entry->body_length);
+
+  char *etag = http_response_get_header(response, "ETag");
+  char *last_modified = http_response_get_header(response, "Last-Modified");
+  entry->etag = etag ? strdup(etag) : NULL;
+  entry->last_modified = last_modified ? strdup(last_modified) : NULL;
+  entry->stored = time(NULL);
+  entry->expires = cache_expiration(response, entry->stored);
+
+  pthread_mutex_lock(&cache_lock);
+  struct cache_entry *old;
+  for (old = buckets[cache_hash(key)]; old; old = old->hash_next)
+    if (strcmp(old->key, key) == 0)
+      break;
+  if (old)
+    cache_unlink(old);
+  cache_link(entry);
+  struct cache_entry *spills = cache_shrink();
+  pthread_mutex_unlock(&cache_lock);
+
+  while (spills) {
+    struct cache_entry *next = spills->hash_next;
+    cache_spill(spills);
+    spills = next;
+  }
+}
@@ -0,0 +1,89 @@
+/*
+ * A shared HTTP response cache for proxy mode.
+ *
+ * Responses are kept whole (status line, headers and body) in a size-bounded
+ * memory tier. When the memory tier is full the least recently used entries
+ * spill to unlinked files in a spill directory, bounded by a second limit,
+ * before they are dropped altogether.
+ *
+ * Usage example:
+ *
+ *     struct cache_entry *entry = cache_lookup(request->path);
+ *     if (entry && cache_entry_is_fresh(entry)) {
+ *       cache_entry_send(fd, entry);
+ *       cache_release(entry);
+ *       return;
+ *     }
+ *
+ * Entries are reference counted; every entry returned by cache_lookup() must
+ * be handed back with cache_release(). All functions are thread-safe.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+struct cache_entry {
+  char *key;
+  char *head;                 /* Status line and headers, blank line included. */
+  size_t head_length;
+  char *body;                 /* NULL once the entry lives on disk. */
+  int body_fd;                /* Spill file holding the body, or -1. */
+  size_t body_length;
+  time_t stored;
+  time_t expires;
+  char *etag;
+  char *last_modified;
+  int refcount;
+  struct cache_entry *hash_next;
+  struct cache_entry *prev, *next;
+};
+
+/*
+ * Enables the cache. MEMORY_LIMIT and DISK_LIMIT bound the bytes kept in each
+ * tier; SPILL_DIRECTORY may be NULL to disable the disk tier.
+ */
+void cache_init(size_t memory_limit, size_t disk_limit, char *spill_directory);
+int cache_enabled(void);
+
+/* Largest response body the cache is willing to store. */
+size_t cache_object_limit(void);
+
+/* Policy: may REQUEST be answered from, or stored into, the cache? */
+int cache_request_is_cacheable(struct http_request *request);
+
+/* Policy: does REQUEST ask for a stored response to be revalidated first? */
+int cache_request_wants_revalidation(struct http_request *request);
+
+/*
+ * Policy: may RESPONSE, whatever its status, be given to clients other than
+ * the one it was fetched for? Not if it is private, sets a cookie or varies.
+ */
+int cache_response_is_shareable(struct http_response *response);
+
+/* Policy: may RESPONSE be stored? Only shareable 200s worth keeping are. */
+int cache_response_is_storable(struct http_response *response);
+
+struct cache_entry *cache_lookup(char *key);
+void cache_release(struct cache_entry *entry);
+int cache_entry_is_fresh(struct cache_entry *entry);
+
+/* Sends ENTRY to FD as a complete response, with an Age header added. */
+void cache_entry_send(int fd, struct cache_entry *entry);
+
+/* Refreshes ENTRY's lifetime from a 304 Not Modified RESPONSE. */
+void cache_entry_revalidated(struct cache_entry *entry,
+    struct http_response *response);
+
+/*
+ * Stores a copy of the complete response DATA (SIZE bytes) whose head was
+ * parsed into RESPONSE under KEY, replacing any previous entry.
+ */
+void cache_store(char *key, char *data, size_t size,
+    struct http_response *response);
+
+#endif
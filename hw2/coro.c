@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "coro.h"
+#include "utlist.h"
+
+#define CORO_MAX_LOCALS 8
+#define CORO_EVENTS 256
+
+/* Listening sockets per scheduler, and connections accepted per wakeup. */
+#define CORO_MAX_LISTENERS 8
+#define CORO_ACCEPT_BATCH 64
+
+struct coro {
+  int fd;                       /* The connection being served. */
+#if defined(__x86_64__)
+  void *sp;
+#else
+  ucontext_t context;
+#endif
+  char *stack;                  /* Mapping base; the lowest page is a guard. */
+  char *locals;                 /* Saved registered thread-locals. */
+  int ready;
+  int finished;
+  uint64_t deadline;            /* Of the current wait, in ms; 0 for none. */
+  struct coro *prev, *next;     /* Run queue or timer list. */
+};
+
+struct scheduler {
+  int index;
+  int epoll_fd;
+  int pipe_fds[2];              /* New connections arrive here as ints. */
+  int listen_fds[CORO_MAX_LISTENERS];   /* Accepted from directly; see coro_listen(). */
+  int num_listen_fds;
+  void *locals[CORO_MAX_LOCALS];
+  struct coro *run_queue;
+  struct coro *timers;          /* Ordered by deadline. */
+  char *stack_pool[CORO_STACK_POOL];
+  int stack_pool_size;
+#if defined(__x86_64__)
+  void *sp;
+#else
+  ucontext_t context;
+#endif
+  pthread_t thread;
+};
+
+static struct {
+  void *(*locate)(void);
+  size_t size;
+} locals[CORO_MAX_LOCALS];
+static int num_locals;
+static size_t locals_size;
+
+static struct scheduler *schedulers;
+static int num_schedulers;
+static void (*coro_handler)(int);
+static void (*thread_init)(int index);
+static int next_scheduler;
+
+static __thread struct scheduler *self;
+static __thread struct coro *running;
+
+static size_t page_size;
+
+#if defined(__x86_64__)
+/*
+ * coro_switch(&from->sp, to->sp): saves the callee-saved registers on the
+ * current stack, stores the stack pointer in *FROM and resumes the stack TO,
+ * which was saved the same way (or built by coro_stack_init()). Unlike
+ * swapcontext() this costs no system calls.
+ */
+void coro_switch(void **from, void *to);
+void coro_trampoline(void);
+
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".size coro_switch, .-coro_switch\n"
+    ".globl coro_trampoline\n"
+    ".type coro_trampoline, @function\n"
+    "coro_trampoline:\n"
+    "  movq %rbx, %rdi\n"
+    "  call coro_main\n"
+    "  ud2\n"
+    ".size coro_trampoline, .-coro_trampoline\n");
+#endif
+
+void coro_register_local(void *(*locate)(void), size_t size) {
+  if (num_locals == CORO_MAX_LOCALS) {
+    fprintf(stderr, "Too many coroutine-local registrations\n");
+    exit(EXIT_FAILURE);
+  }
+  locals[num_locals].locate = locate;
+  locals[num_locals].size = size;
+  num_locals++;
+  locals_size += size;
+}
+
+int coro_active(void) {
+  return running != NULL;
+}
+
+static uint64_t coro_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void coro_save_locals(struct coro *coro) {
+  char *cursor = coro->locals;
+  int i;
+  for (i = 0; i < num_locals; i++) {
+    memcpy(cursor, self->locals[i], locals[i].size);
+    cursor += locals[i].size;
+  }
+}
+
+static void coro_restore_locals(struct coro *coro) {
+  char *cursor = coro->locals;
+  int i;
+  for (i = 0; i < num_locals; i++) {
+    memcpy(self->locals[i], cursor, locals[i].size);
+    cursor += locals[i].size;
+  }
+}
+
+/* Returns a stack mapping, with its guard page in place. */
+static char *coro_stack_get(void) {
+  if (self->stack_pool_size > 0)
+    return self->stack_pool[--self->stack_pool_size];
+
+  char *stack = mmap(NULL, CORO_STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED)
+    return NULL;
+  /* Overflowing the stack faults here rather than corrupting a neighbor. */
+  mprotect(stack, page_size, PROT_NONE);
+  return stack;
+}
+
+static void coro_stack_put(char *stack) {
+  if (self->stack_pool_size < CORO_STACK_POOL) {
+    self->stack_pool[self->stack_pool_size++] = stack;
+    return;
+  }
+  munmap(stack, CORO_STACK_SIZE + page_size);
+}
+
+/* Switches from the running coroutine back to the scheduler. */
+static void coro_park(void) {
+  struct coro *coro = running;
+  coro_save_locals(coro);
+  running = NULL;
+#if defined(__x86_64__)
+  coro_switch(&coro->sp, self->sp);
+#else
+  swapcontext(&coro->context, &self->context);
+#endif
+}
+
+/* Switches from the scheduler into CORO until it parks or finishes. */
+static void coro_resume(struct coro *coro) {
+  running = coro;
+  coro_restore_locals(coro);
+#if defined(__x86_64__)
+  coro_switch(&self->sp, coro->sp);
+#else
+  swapcontext(&self->context, &coro->context);
+#endif
+}
+
+void coro_main(struct coro *coro) {
+  coro_handler(coro->fd);
+  coro->finished = 1;
+  coro_park();
+}
+
+#if !defined(__x86_64__)
+static void coro_main_ucontext(unsigned int high, unsigned int low) {
+  coro_main((struct coro *) (((uintptr_t) high << 32) | low));
+}
+#endif
+
+static void coro_spawn(int fd) {
+  struct coro *coro = calloc(1, sizeof(struct coro) + locals_size);
+  char *stack = coro ? coro_stack_get() : NULL;
+  if (!stack) {
+    fprintf(stderr, "Failed to allocate coroutine; dropping connection\n");
+    free(coro);
+    close(fd);
+    return;
+  }
+
+  coro->fd = fd;
+  coro->stack = stack;
+  coro->locals = (char *) (coro + 1);
+
+#if defined(__x86_64__)
+  /*
+   * Lay out what coro_switch() pops: six callee-saved registers, with RBX
+   * holding the coroutine, then the return address. Once those are popped the
+   * stack pointer is 16-byte aligned, as the ABI requires at a call.
+   */
+  uintptr_t top = ((uintptr_t) stack + page_size + CORO_STACK_SIZE - 64) & ~(uintptr_t) 15;
+  void **sp = (void **) (top - 7 * sizeof(void *));
+  memset(sp, 0, 7 * sizeof(void *));
+  sp[4] = coro;                       /* RBX */
+  sp[6] = (void *) coro_trampoline;   /* Return address. */
+  coro->sp = sp;
+#else
+  getcontext(&coro->context);
+  coro->context.uc_stack.ss_sp = stack + page_size;
+  coro->context.uc_stack.ss_size = CORO_STACK_SIZE;
+  coro->context.uc_link = NULL;
+  makecontext(&coro->context, (void (*)(void)) coro_main_ucontext, 2,
+      (unsigned int) ((uintptr_t) coro >> 32), (unsigned int) (uintptr_t) coro);
+#endif
+
+  coro->ready = 1;
+  DL_APPEND(self->run_queue, coro);
+}
+
+static void coro_make_ready(struct coro *coro) {
+  if (coro->ready)
+    return;
+  if (coro->deadline)
+    DL_DELETE(self->timers, coro);
+  coro->deadline = 0;
+  coro->ready = 1;
+  DL_APPEND(self->run_queue, coro);
+}
+
+static void coro_timer_insert(struct coro *coro) {
+  struct coro *other;
+  DL_FOREACH(self->timers, other)
+    if (other->deadline > coro->deadline)
+      break;
+  if (other)
+    DL_PREPEND_ELEM(self->timers, other, coro);
+  else
+    DL_APPEND(self->timers, coro);
+}
+
+int coro_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  if (!running)
+    return poll(fds, nfds, timeout);
+
+  int ready = poll(fds, nfds, 0);
+  if (ready != 0 || timeout == 0)
+    return ready;
+
+  struct coro *coro = running;
+  nfds_t i;
+  for (i = 0; i < nfds; i++) {
+    if (fds[i].fd < 0)
+      continue;
+    struct epoll_event event = {
+      .events = fds[i].events | EPOLLONESHOT,
+      .data.ptr = coro,
+    };
+    epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fds[i].fd, &event);
+  }
+
+  coro->ready = 0;
+  if (timeout > 0) {
+    coro->deadline = coro_now_ms() + timeout;
+    coro_timer_insert(coro);
+  }
+  coro_park();
+
+  for (i = 0; i < nfds; i++)
+    if (fds[i].fd >= 0)
+      epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+  return poll(fds, nfds, 0);
+}
+
+/* Parks the running coroutine until FD has one of EVENTS. */
+static void coro_wait_fd(int fd, short events) {
+  struct pollfd pollfd = { .fd = fd, .events = events };
+  coro_poll(&pollfd, 1, -1);
+}
+
+ssize_t coro_read(int fd, void *buffer, size_t size) {
+  if (!running)
+    return read(fd, buffer, size);
+
+  while (1) {
+    /* MSG_DONTWAIT works even on sockets left in blocking mode. */
+    ssize_t bytes = recv(fd, buffer, size, MSG_DONTWAIT);
+    if (bytes < 0 && errno == ENOTSOCK)
+      return read(fd, buffer, size);
+    if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return bytes;
+    coro_wait_fd(fd, POLLIN);
+  }
+}
+
+ssize_t coro_write(int fd, const void *buffer, size_t size) {
+  if (!running)
+    return write(fd, buffer, size);
+
+  while (1) {
+    ssize_t bytes = send(fd, buffer, size, MSG_DONTWAIT);
+    if (bytes < 0 && errno == ENOTSOCK)
+      return write(fd, buffer, size);
+    if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return bytes;
+    coro_wait_fd(fd, POLLOUT);
+  }
+}
+
+ssize_t coro_writev(int fd, const struct iovec *iov, int count) {
+  if (!running)
+    return writev(fd, iov, count);
+
+  struct msghdr message = { .msg_iov = (struct iovec *) iov, .msg_iovlen = count };
+  while (1) {
+    ssize_t bytes = sendmsg(fd, &message, MSG_DONTWAIT);
+    if (bytes < 0 && errno == ENOTSOCK)
+      return writev(fd, iov, count);
+    if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return bytes;
+    coro_wait_fd(fd, POLLOUT);
+  }
+}
+
+ssize_t coro_sendfile(int out_fd, int in_fd, off_t *offset, size_t size) {
+  while (1) {
+    /* Connections handed to coroutines are non-blocking, so this won't stall. */
+    ssize_t bytes = sendfile(out_fd, in_fd, offset, size);
+    if (!running || bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return bytes;
+    coro_wait_fd(out_fd, POLLOUT);
+  }
+}
+
+ssize_t coro_recv(int fd, void *buffer, size_t size, int flags) {
+  if (!running)
+    return recv(fd, buffer, size, flags);
+
+  while (1) {
+    ssize_t bytes = recv(fd, buffer, size, flags | MSG_DONTWAIT);
+    if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return bytes;
+    coro_wait_fd(fd, POLLIN);
+  }
+}
+
+/* Waits on IN_FD only: callers are expected to keep OUT_FD (a pipe) drained. */
+ssize_t coro_splice(int in_fd, int out_fd, size_t size, unsigned int flags) {
+  while (1) {
+    ssize_t bytes = splice(in_fd, NULL, out_fd, NULL, size, flags);
+    if (!running || bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return bytes;
+    coro_wait_fd(in_fd, POLLIN);
+  }
+}
+
+static void coro_accept_dispatched(void) {
+  int fds[64];
+  ssize_t bytes;
+  while ((bytes = read(self->pipe_fds[0], fds, sizeof(fds))) > 0) {
+    int i;
+    for (i = 0; i < bytes / (ssize_t) sizeof(int); i++)
+      coro_spawn(fds[i]);
+  }
+}
+
+/*
+ * Accepts what is queued on LISTEN_FD, up to a batch so that coroutines
+ * already running aren't starved; the rest is picked up on the next wakeup.
+ */
+static void coro_accept_listener(int listen_fd) {
+  int i;
+  for (i = 0; i < CORO_ACCEPT_BATCH; i++) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0) {
+      coro_spawn(fd);
+    } else if (errno != EINTR && errno != ECONNABORTED) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EBADF)
+        perror("Error accepting socket");
+      return;
+    }
+  }
+}
+
+static void *coro_scheduler_main(void *argument) {
+  struct epoll_event events[CORO_EVENTS];
+  int i;
+
+  self = argument;
+  for (i = 0; i < num_locals; i++)
+    self->locals[i] = locals[i].locate();
+  if (thread_init)
+    thread_init(self->index);
+
+  while (1) {
+    /* Run everything that is ready, including coroutines readied meanwhile. */
+    while (self->run_queue) {
+      struct coro *coro = self->run_queue;
+      DL_DELETE(self->run_queue, coro);
+      coro_resume(coro);
+      if (coro->finished) {
+        coro_stack_put(coro->stack);
+        free(coro);
+      }
+    }
+
+    int timeout = -1;
+    if (self->timers) {
+      uint64_t now = coro_now_ms();
+      timeout = self->timers->deadline > now ? self->timers->deadline - now : 0;
+    }
+
+    int count = epoll_wait(self->epoll_fd, events, CORO_EVENTS, timeout);
+    for (i = 0; i < count; i++) {
+      int *listen_fd = events[i].data.ptr;
+      if (events[i].data.ptr == self)
+        coro_accept_dispatched();
+      else if (listen_fd >= self->listen_fds
+          && listen_fd < self->listen_fds + CORO_MAX_LISTENERS)
+        coro_accept_listener(__atomic_load_n(listen_fd, __ATOMIC_ACQUIRE));
+      else
+        coro_make_ready(events[i].data.ptr);
+    }
+
+    uint64_t now = coro_now_ms();
+    while (self->timers && self->timers->deadline <= now)
+      coro_make_ready(self->timers);
+  }
+  return NULL;
+}
+
+void coro_runtime_start(int num_threads, void (*handler)(int)) {
+  int i;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  coro_handler = handler;
+  num_schedulers = num_threads;
+  schedulers = calloc(num_threads, sizeof(struct scheduler));
+  if (!schedulers) {
+    perror("Failed to allocate coroutine schedulers");
+    exit(errno);
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    struct scheduler *scheduler = &schedulers[i];
+    scheduler->index = i;
+    scheduler->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (scheduler->epoll_fd == -1
+        || pipe2(scheduler->pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+      perror("Failed to set up coroutine scheduler");
+      exit(errno);
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = scheduler };
+    epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, scheduler->pipe_fds[0], &event);
+
+    int error = pthread_create(&scheduler->thread, NULL, coro_scheduler_main,
+        scheduler);
+    if (error) {
+      fprintf(stderr, "Failed to create scheduler thread: %s\n", strerror(error));
+      exit(error);
+    }
+  }
+}
+
+void coro_dispatch(int fd) {
+  struct scheduler *scheduler = &schedulers[next_scheduler];
+  next_scheduler = (next_scheduler + 1) % num_schedulers;
+
+  /* Writes of an int to a pipe are atomic, so no locking is needed. */
+  while (write(scheduler->pipe_fds[1], &fd, sizeof(fd)) == -1) {
+    if (errno == EAGAIN) {
+      /* The scheduler is far behind; wait for it rather than drop. */
+      struct pollfd pollfd = { .fd = scheduler->pipe_fds[1], .events = POLLOUT };
+      poll(&pollfd, 1, -1);
+    } else if (errno != EINTR) {
+      perror("Failed to dispatch connection");
+      close(fd);
+      return;
+    }
+  }
+}
+
+void coro_set_thread_init(void (*init)(int index)) {
+  thread_init = init;
+}
+
+int coro_listen(int index, int fd) {
+  struct scheduler *scheduler = &schedulers[index];
+  if (scheduler->num_listen_fds == CORO_MAX_LISTENERS) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  int *slot = &scheduler->listen_fds[scheduler->num_listen_fds];
+  *slot = fd;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = slot };
+  if (epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    return -1;
+  scheduler->num_listen_fds++;
+  return 0;
+}
+
+void coro_stop_listening(void) {
+  int i, j;
+  for (i = 0; i < num_schedulers; i++) {
+    struct scheduler *scheduler = &schedulers[i];
+    for (j = 0; j < scheduler->num_listen_fds; j++) {
+      int fd = scheduler->listen_fds[j];
+      /* A scheduler already woken for it then gets EBADF from accept4(). */
+      __atomic_store_n(&scheduler->listen_fds[j], -1, __ATOMIC_RELEASE);
+      epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+  }
+}
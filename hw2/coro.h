@@ -0,0 +1,94 @@
+/*
+ * Stackful coroutines on top of a per-thread epoll loop.
+ *
+ * Each scheduler thread runs many request handlers as coroutines, each on its
+ * own guard-paged stack taken from a pool. Handlers keep their straight-line,
+ * blocking style: the coro_* I/O functions below park the calling coroutine
+ * until its descriptor is ready and let others run meanwhile. Outside of a
+ * coroutine they behave exactly like the system calls they wrap, so the same
+ * code also works on ordinary threads.
+ *
+ * Usage example:
+ *
+ *     coro_runtime_start(4, handle_connection);
+ *     while (1)
+ *       coro_dispatch(accept4(server_fd, NULL, NULL, SOCK_NONBLOCK));
+ *
+ * or, with a listener of its own for each scheduler:
+ *
+ *     coro_runtime_start(4, handle_connection);
+ *     for (i = 0; i < 4; i++)
+ *       coro_listen(i, listen_fds[i]);
+ *
+ * Thread-local variables are shared by every coroutine on a thread, so ones
+ * that hold per-request state must be registered with coro_register_local()
+ * before the runtime starts; they are saved and restored on every switch.
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Usable stack per coroutine; pages are only committed when touched. */
+#define CORO_STACK_SIZE (256 * 1024)
+
+/* Stacks kept per thread for reuse instead of being unmapped. */
+#define CORO_STACK_POOL 128
+
+/*
+ * Registers SIZE bytes of thread-local state that belong to the running
+ * coroutine. LOCATE returns the calling thread's copy.
+ */
+void coro_register_local(void *(*locate)(void), size_t size);
+
+/*
+ * Starts NUM_THREADS scheduler threads. Every descriptor later passed to
+ * coro_dispatch(), which must be non-blocking, is served by HANDLER in a new
+ * coroutine, which owns (and must close) the descriptor.
+ */
+void coro_runtime_start(int num_threads, void (*handler)(int));
+
+/* Hands FD to the next scheduler thread, round-robin. */
+void coro_dispatch(int fd);
+
+/*
+ * Has INIT run on every scheduler thread, with the scheduler's index, before
+ * it serves anything, e.g. to pin it to a CPU. Call before coro_runtime_start().
+ */
+void coro_set_thread_init(void (*init)(int index));
+
+/*
+ * Makes scheduler INDEX accept connections from the listening socket FD by
+ * itself, in its own event loop, rather than being handed them through
+ * coro_dispatch(). Returns -1 if it can't take another listener.
+ */
+int coro_listen(int index, int fd);
+
+/*
+ * Stops every scheduler accepting from its listeners, which the caller may
+ * then close. Needed because descriptors shared with another process (say,
+ * handed over in an upgrade) stay in the epoll sets even once closed.
+ */
+void coro_stop_listening(void);
+
+/* Whether the caller is running inside a coroutine. */
+int coro_active(void);
+
+/*
+ * Blocking-style I/O. In a coroutine these suspend only the coroutine while
+ * FD isn't ready; elsewhere they are read(), write(), writev(), sendfile(),
+ * recv(), splice() (without offsets) and poll().
+ */
+ssize_t coro_read(int fd, void *buffer, size_t size);
+ssize_t coro_write(int fd, const void *buffer, size_t size);
+ssize_t coro_writev(int fd, const struct iovec *iov, int count);
+ssize_t coro_sendfile(int out_fd, int in_fd, off_t *offset, size_t size);
+ssize_t coro_recv(int fd, void *buffer, size_t size, int flags);
+ssize_t coro_splice(int in_fd, int out_fd, size_t size, unsigned int flags);
+int coro_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#endif
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dirlist.h"
+
+/*
+ * Sorted entries are kept as records: a type byte ('d' for directories, 'f'
+ * for anything else), the name, and a NUL. A run holds at most this many.
+ */
+#define DIRLIST_RUN_RECORDS (DIRLIST_RUN_SIZE / 16)
+
+/* A sorted run being merged: one spilled to disk, or the last, in memory. */
+struct dirlist_source {
+  off_t offset, end;            /* What is left of it in the spill file. */
+  char *buffer;                 /* DIRLIST_MERGE_BUFFER_SIZE bytes read from it. */
+  size_t length, position;
+  char **records;               /* The run in memory, instead of the above. */
+  size_t num_records, next_record;
+  char *record;                 /* Its smallest record not yet handed out. */
+};
+
+struct dirlist {
+  int directory_fd;
+  char *batch;                  /* DIRLIST_BATCH_SIZE bytes from getdents64(). */
+  size_t batch_length, batch_position;
+  int sorted;
+
+  char *run;                    /* DIRLIST_RUN_SIZE bytes of records. */
+  size_t run_used;
+  char **records;
+  size_t num_records;
+  int spill_fd;
+  struct dirlist_source *sources;
+  int num_sources;
+  int *heap;                    /* Indexes of sources with records left. */
+  int heap_size;
+  int current;                  /* Source of the record last handed out. */
+};
+
+/* Reads the next raw entry, "." included. Returns 1, 0 at the end, or -1. */
+static int dirlist_read(struct dirlist *list, char **name, int *is_directory) {
+  if (list->batch_position == list->batch_length) {
+    ssize_t bytes;
+    while ((bytes = getdents64(list->directory_fd, list->batch,
+            DIRLIST_BATCH_SIZE)) == -1 && errno == EINTR)
+      ;
+    if (bytes <= 0)
+      return bytes == 0 ? 0 : -1;
+    list->batch_length = bytes;
+    list->batch_position = 0;
+  }
+
+  struct dirent64 *entry = (struct dirent64 *) (list->batch + list->batch_position);
+  list->batch_position += entry->d_reclen;
+  *name = entry->d_name;
+  *is_directory = entry->d_type == DT_DIR;
+  return 1;
+}
+
+static int dirlist_compare_records(const void *a, const void *b) {
+  return strcmp(*(char **) a + 1, *(char **) b + 1);
+}
+
+static int dirlist_open_spill_file(void) {
+  char *directory = getenv("TMPDIR");
+  if (!directory || !*directory)
+    directory = P_tmpdir;
+
+  int fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    return fd;
+
+  /* Filesystems without O_TMPFILE. */
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/httpserver-dirlist.XXXXXX", directory);
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd != -1)
+    unlink(path);
+  return fd;
+}
+
+/* Sorts the records in memory and appends them to the spill file as a run. */
+static int dirlist_spill(struct dirlist *list) {
+  if (list->spill_fd == -1 && (list->spill_fd = dirlist_open_spill_file()) == -1)
+    return -1;
+
+  struct dirlist_source *sources = realloc(list->sources,
+      (list->num_sources + 1) * sizeof(struct dirlist_source));
+  if (!sources)
+    return -1;
+  list->sources = sources;
+  struct dirlist_source *run = &sources[list->num_sources];
+  memset(run, 0, sizeof(*run));
+  run->offset = run->end = list->num_sources > 0 ? sources[list->num_sources - 1].end : 0;
+
+  qsort(list->records, list->num_records, sizeof(char *), dirlist_compare_records);
+
+  struct iovec iov[IOV_MAX];
+  size_t i = 0;
+  while (i < list->num_records) {
+    int count = 0;
+    for (; i < list->num_records && count < IOV_MAX; i++, count++) {
+      iov[count].iov_base = list->records[i];
+      iov[count].iov_len = strlen(list->records[i] + 1) + 2;
+    }
+    /* Regular files take all of a writev() unless the disk is full. */
+    ssize_t bytes = pwritev(list->spill_fd, iov, count, run->end);
+    size_t expected = 0;
+    while (count > 0)
+      expected += iov[--count].iov_len;
+    if (bytes != (ssize_t) expected) {
+      if (bytes >= 0) errno = ENOSPC;
+      return -1;
+    }
+    run->end += bytes;
+  }
+
+  list->num_sources++;
+  list->run_used = 0;
+  list->num_records = 0;
+  return 0;
+}
+
+/* Moves SOURCE on to its next record, or sets it to NULL at the end of the run. */
+static int dirlist_source_advance(struct dirlist *list, struct dirlist_source *source) {
+  if (source->records) {
+    source->record = source->next_record < source->num_records
+        ? source->records[source->next_record++] : NULL;
+    return 0;
+  }
+
+  if (source->record)
+    source->position += strlen(source->record + 1) + 2;
+  char *end = memchr(source->buffer + source->position + 1, '\0',
+      source->length > source->position + 1 ? source->length - source->position - 1 : 0);
+  if (!end && source->offset < source->end) {
+    /* A record never straddles more than one refill. */
+    memmove(source->buffer, source->buffer + source->position,
+        source->length - source->position);
+    source->length -= source->position;
+    source->position = 0;
+    size_t wanted = DIRLIST_MERGE_BUFFER_SIZE - source->length;
+    if ((off_t) wanted > source->end - source->offset)
+      wanted = source->end - source->offset;
+    ssize_t bytes = pread(list->spill_fd, source->buffer + source->length, wanted,
+        source->offset);
+    if (bytes <= 0) {
+      if (bytes == 0) errno = EIO;
+      return -1;
+    }
+    source->length += bytes;
+    source->offset += bytes;
+    end = memchr(source->buffer + 1, '\0', source->length > 1 ? source->length - 1 : 0);
+  }
+  source->record = end ? source->buffer + source->position : NULL;
+  return 0;
+}
+
+static int dirlist_heap_less(struct dirlist *list, int a, int b) {
+  return strcmp(list->sources[list->heap[a]].record + 1,
+      list->sources[list->heap[b]].record + 1) < 0;
+}
+
+/* Restores the heap below INDEX. */
+static void dirlist_heap_down(struct dirlist *list, int index) {
+  while (1) {
+    int smallest = index, child = 2 * index + 1;
+    if (child < list->heap_size && dirlist_heap_less(list, child, smallest))
+      smallest = child;
+    if (child + 1 < list->heap_size && dirlist_heap_less(list, child + 1, smallest))
+      smallest = child + 1;
+    if (smallest == index)
+      return;
+    int swap = list->heap[index];
+    list->heap[index] = list->heap[smallest];
+    list->heap[smallest] = swap;
+    index = smallest;
+  }
+}
+
+/* Reads the whole directory into sorted runs and gets ready to merge them. */
+static int dirlist_sort(struct dirlist *list) {
+  char *name;
+  int is_directory, status, i;
+
+  list->run = malloc(DIRLIST_RUN_SIZE);
+  list->records = malloc(DIRLIST_RUN_RECORDS * sizeof(char *));
+  if (!list->run || !list->records)
+    return -1;
+
+  while ((status = dirlist_read(list, &name, &is_directory)) == 1) {
+    if (strcmp(name, ".") == 0)
+      continue;
+    size_t size = strlen(name) + 2;
+    if ((list->run_used + size > DIRLIST_RUN_SIZE
+          || list->num_records == DIRLIST_RUN_RECORDS) && dirlist_spill(list) == -1)
+      return -1;
+    char *record = list->run + list->run_used;
+    record[0] = is_directory ? 'd' : 'f';
+    memcpy(record + 1, name, size - 1);
+    list->records[list->num_records++] = record;
+    list->run_used += size;
+  }
+  if (status == -1)
+    return -1;
+  free(list->batch);
+  list->batch = NULL;
+
+  /* The last run stays in memory. */
+  qsort(list->records, list->num_records, sizeof(char *), dirlist_compare_records);
+  struct dirlist_source *sources = realloc(list->sources,
+      (list->num_sources + 1) * sizeof(struct dirlist_source));
+  list->heap = malloc((list->num_sources + 1) * sizeof(int));
+  if (!sources || !list->heap) {
+    if (sources) list->sources = sources;
+    return -1;
+  }
+  list->sources = sources;
+  struct dirlist_source *last = &sources[list->num_sources++];
+  memset(last, 0, sizeof(*last));
+  last->records = list->records;
+  last->num_records = list->num_records;
+
+  for (i = 0; i < list->num_sources; i++) {
+    struct dirlist_source *source = &list->sources[i];
+    if (!source->records && !(source->buffer = malloc(DIRLIST_MERGE_BUFFER_SIZE)))
+      return -1;
+    if (dirlist_source_advance(list, source) == -1)
+      return -1;
+    if (source->record)
+      list->heap[list->heap_size++] = i;
+  }
+  for (i = list->heap_size / 2 - 1; i >= 0; i--)
+    dirlist_heap_down(list, i);
+  return 0;
+}
+
+struct dirlist *dirlist_open(int directory_fd, int sorted) {
+  struct dirlist *list = calloc(1, sizeof(struct dirlist));
+  if (!list) {
+    close(directory_fd);
+    return NULL;
+  }
+  list->directory_fd = directory_fd;
+  list->sorted = sorted;
+  list->spill_fd = -1;
+  list->current = -1;
+
+  if (!(list->batch = malloc(DIRLIST_BATCH_SIZE)) || (sorted && dirlist_sort(list) == -1)) {
+    int saved_errno = errno;
+    dirlist_close(list);
+    errno = saved_errno;
+    return NULL;
+  }
+  return list;
+}
+
+int dirlist_next(struct dirlist *list, char **name, int *is_directory) {
+  if (!list->sorted) {
+    int status;
+    while ((status = dirlist_read(list, name, is_directory)) == 1
+        && strcmp(*name, ".") == 0)
+      ;
+    return status;
+  }
+
+  if (list->current != -1) {
+    if (dirlist_source_advance(list, &list->sources[list->current]) == -1)
+      return -1;
+    if (!list->sources[list->current].record)
+      list->heap[0] = list->heap[--list->heap_size];
+    dirlist_heap_down(list, 0);
+    list->current = -1;
+  }
+  if (list->heap_size == 0)
+    return 0;
+
+  list->current = list->heap[0];
+  char *record = list->sources[list->current].record;
+  *name = record + 1;
+  *is_directory = record[0] == 'd';
+  return 1;
+}
+
+void dirlist_close(struct dirlist *list) {
+  int i;
+  for (i = 0; i < list->num_sources; i++)
+    free(list->sources[i].buffer);
+  free(list->sources);
+  free(list->heap);
+  free(list->records);
+  free(list->run);
+  free(list->batch);
+  if (list->spill_fd != -1)
+    close(list->spill_fd);
+  close(list->directory_fd);
+  free(list);
+}
@@ -0,0 +1,54 @@
+/*
+ * Reading directories of any size in bounded memory, for listings.
+ *
+ * Entries are read straight from the kernel with getdents64() in batches of
+ * DIRLIST_BATCH_SIZE bytes and handed out one at a time, so a listing can be
+ * sent while the directory is still being read, and a directory with a
+ * million entries costs no more memory than one with ten.
+ *
+ * Sorted listings can't be sent before the last entry is read, but they are
+ * still bounded: names are sorted in runs of up to DIRLIST_RUN_SIZE bytes,
+ * runs that don't fit are spilled to an unlinked temporary file, and the
+ * runs are merged as the entries are handed out.
+ *
+ * Usage example:
+ *
+ *     struct dirlist *list = dirlist_open(directory_fd, 1);
+ *     char *name;
+ *     int is_directory;
+ *     while (dirlist_next(list, &name, &is_directory) == 1)
+ *       ... send NAME ...
+ *     dirlist_close(list);
+ */
+
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+/* Bytes of entries asked of the kernel per getdents64() call. */
+#define DIRLIST_BATCH_SIZE 65536
+
+/* Bytes of names sorted in memory at once; more are spilled to disk. */
+#define DIRLIST_RUN_SIZE (1 << 20)
+
+/* Bytes read from each spilled run at a time while merging. */
+#define DIRLIST_MERGE_BUFFER_SIZE 8192
+
+struct dirlist;
+
+/*
+ * Starts reading the directory DIRECTORY_FD, which the list takes over, in
+ * the order the filesystem returns entries, or by name with SORTED set. For
+ * a sorted list the whole directory is read (and spilled) here. Returns NULL
+ * and sets errno on failure, having closed DIRECTORY_FD.
+ */
+struct dirlist *dirlist_open(int directory_fd, int sorted);
+
+/*
+ * Points *NAME at the next entry's name, valid until the next call, and sets
+ * *IS_DIRECTORY. Skips ".". Returns 1, 0 at the end, or -1 on error.
+ */
+int dirlist_next(struct dirlist *list, char **name, int *is_directory);
+
+void dirlist_close(struct dirlist *list);
+
+#endif
@@ -0,0 +1,726 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "fastcgi.h"
+
+/* Connections carry one request at a time, so every request can use the same ID. */
+#define FASTCGI_REQUEST_ID 1
+
+#define FASTCGI_NO_RECORD ((size_t) -1)
+
+static struct sockaddr_storage worker_address;
+static socklen_t worker_address_length;
+
+static int *idle_fds;
+static int num_idle;
+static int max_idle;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *params[FASTCGI_MAX_PARAMS];
+static int num_params;
+
+/* Records on their way to a worker, built up in the caller's buffer. */
+struct fastcgi_writer {
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t used;
+  size_t record;                /* Start of the open record, or FASTCGI_NO_RECORD. */
+  int type;
+  int failed;
+};
+
+/* A response on its way back to the client. */
+struct fastcgi_response {
+  int fd;
+  int minor_version;
+  int head_only;
+  int status_code;              /* 0 until the head has been sent. */
+  int chunked;
+  int body_allowed;
+  size_t head_length;
+  char head[FASTCGI_HEAD_MAX];  /* The CGI header block, while it comes in. */
+
+  /* Where we are in the worker's stream of records. */
+  struct fcgi_header header;
+  struct fcgi_end_request_body end;
+  size_t header_have;
+  size_t end_have;
+  size_t content_left;
+  size_t padding_left;
+  int type;
+  int ended;                    /* FCGI_END_REQUEST is in. */
+  int reusable;                 /* The connection can take another request. */
+  int heard;                    /* The worker has sent something. */
+};
+
+/* The request body, as far as it has been read from the client. */
+struct fastcgi_body {
+  char *pending;                /* Read with the headers, and decoded. */
+  size_t pending_length;
+  int chunked;
+  size_t remaining;             /* Of a Content-Length body, after PENDING. */
+  struct http_chunked_decoder decoder;
+  int streamed;                 /* More than PENDING has been taken from the client. */
+};
+
+static void fastcgi_invalid(char *address) {
+  fprintf(stderr, "Expected unix:PATH or HOST:PORT, got %s\n", address);
+  exit(EXIT_FAILURE);
+}
+
+void fastcgi_init(char *address, int idle) {
+  memset(&worker_address, 0, sizeof(worker_address));
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *) &worker_address;
+    char *path = address + 5;
+    if (!*path || strlen(path) >= sizeof(un->sun_path))
+      fastcgi_invalid(address);
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, path);
+    worker_address_length = sizeof(struct sockaddr_un);
+  } else {
+    char *colon = strrchr(address, ':');
+    if (!colon || colon == address || !colon[1])
+      fastcgi_invalid(address);
+    char *hostname = strndup(address, colon - address);
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (!hostname || getaddrinfo(hostname, colon + 1, &hints, &result) != 0) {
+      fprintf(stderr, "Cannot find host: %s\n", address);
+      exit(ENXIO);
+    }
+    memcpy(&worker_address, result->ai_addr, result->ai_addrlen);
+    worker_address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    free(hostname);
+  }
+
+  max_idle = idle > 0 ? idle : 0;
+  idle_fds = calloc(max_idle + 1, sizeof(int));
+  if (!idle_fds) {
+    perror("Failed to allocate FastCGI pool");
+    exit(errno);
+  }
+}
+
+int fastcgi_add_param(char *param) {
+  char *equals = strchr(param, '=');
+  if (!equals || equals == param || num_params == FASTCGI_MAX_PARAMS)
+    return -1;
+  params[num_params++] = param;
+  return 0;
+}
+
+/* connect() that gives up after FASTCGI_CONNECT_TIMEOUT_MS. */
+static int fastcgi_connect_new(void) {
+  int socket_fd = socket(worker_address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd == -1)
+    return -1;
+
+  int flags = fcntl(socket_fd, F_GETFL);
+  fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+
+  int status = connect(socket_fd, (struct sockaddr *) &worker_address,
+      worker_address_length);
+  if (status == -1 && errno == EINPROGRESS) {
+    struct pollfd pollfd = { .fd = socket_fd, .events = POLLOUT };
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (coro_poll(&pollfd, 1, FASTCGI_CONNECT_TIMEOUT_MS) == 1
+        && getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0
+        && error == 0)
+      status = 0;
+  }
+  if (status == -1) {
+    close(socket_fd);
+    return -1;
+  }
+
+  fcntl(socket_fd, F_SETFL, flags);
+  if (worker_address.ss_family == AF_INET) {
+    /* Requests go out as a few small writes; don't let Nagle hold them. */
+    int on = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  return socket_fd;
+}
+
+int fastcgi_connect(int *reused) {
+  pthread_mutex_lock(&pool_lock);
+  while (num_idle > 0) {
+    int fd = idle_fds[--num_idle];
+    pthread_mutex_unlock(&pool_lock);
+
+    /* A worker may have hung up on an idle connection; that reads as EOF. */
+    char byte;
+    if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+        && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      *reused = 1;
+      return fd;
+    }
+    close(fd);
+    pthread_mutex_lock(&pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  *reused = 0;
+  return fastcgi_connect_new();
+}
+
+static void fastcgi_release(int fd, int reusable) {
+  if (reusable) {
+    pthread_mutex_lock(&pool_lock);
+    if (num_idle < max_idle) {
+      idle_fds[num_idle++] = fd;
+      fd = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+  if (fd != -1)
+    close(fd);
+}
+
+static void fastcgi_write_all(struct fastcgi_writer *writer, char *data, size_t size) {
+  while (size > 0 && !writer->failed) {
+    ssize_t bytes = coro_write(writer->fd, data, size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) {
+      writer->failed = 1;
+      break;
+    }
+    data += bytes;
+    size -= bytes;
+  }
+}
+
+static void fastcgi_close_record(struct fastcgi_writer *writer) {
+  if (writer->record == FASTCGI_NO_RECORD)
+    return;
+  fcgi_header_init((struct fcgi_header *) (writer->buffer + writer->record),
+      writer->type, FASTCGI_REQUEST_ID,
+      writer->used - writer->record - sizeof(struct fcgi_header));
+  writer->record = FASTCGI_NO_RECORD;
+}
+
+static void fastcgi_flush(struct fastcgi_writer *writer) {
+  fastcgi_close_record(writer);
+  fastcgi_write_all(writer, writer->buffer, writer->used);
+  writer->used = 0;
+}
+
+/* Makes sure a record of TYPE is open with room for SIZE more content bytes. */
+static int fastcgi_reserve(struct fastcgi_writer *writer, int type, size_t size) {
+  if (writer->record != FASTCGI_NO_RECORD && (writer->type != type
+        || writer->used + size > writer->size
+        || writer->used - writer->record - sizeof(struct fcgi_header) + size
+          > FCGI_MAX_CONTENT))
+    fastcgi_close_record(writer);
+  if (writer->record == FASTCGI_NO_RECORD) {
+    if (writer->used + sizeof(struct fcgi_header) + size > writer->size)
+      fastcgi_flush(writer);
+    if (sizeof(struct fcgi_header) + size > writer->size)
+      return -1;
+    writer->record = writer->used;
+    writer->type = type;
+    writer->used += sizeof(struct fcgi_header);
+  }
+  return 0;
+}
+
+/* Appends SIZE bytes of the stream TYPE, split over records as needed. */
+static void fastcgi_append(struct fastcgi_writer *writer, int type, char *data,
+    size_t size) {
+  while (size > 0) {
+    if (fastcgi_reserve(writer, type, 1) == -1)
+      return;
+    size_t content = writer->used - writer->record - sizeof(struct fcgi_header);
+    size_t take = writer->size - writer->used;
+    if (take > FCGI_MAX_CONTENT - content) take = FCGI_MAX_CONTENT - content;
+    if (take > size) take = size;
+    memcpy(writer->buffer + writer->used, data, take);
+    writer->used += take;
+    data += take;
+    size -= take;
+  }
+}
+
+/* Appends an empty record of TYPE, which ends that stream. */
+static void fastcgi_append_end(struct fastcgi_writer *writer, int type) {
+  fastcgi_close_record(writer);
+  fastcgi_reserve(writer, type, 0);
+  fastcgi_close_record(writer);
+}
+
+static size_t fastcgi_encode_length(char *out, size_t length) {
+  if (length < 128) {
+    out[0] = length;
+    return 1;
+  }
+  out[0] = (length >> 24) | 0x80;
+  out[1] = length >> 16;
+  out[2] = length >> 8;
+  out[3] = length;
+  return 4;
+}
+
+/*
+ * Appends one name-value pair. Pairs never straddle records, since some
+ * workers parse each PARAMS record on its own.
+ */
+static void fastcgi_add_pair(struct fastcgi_writer *writer, char *name,
+    size_t name_length, char *value, size_t value_length) {
+  char lengths[8];
+  size_t lengths_size = fastcgi_encode_length(lengths, name_length);
+  lengths_size += fastcgi_encode_length(lengths + lengths_size, value_length);
+  size_t size = lengths_size + name_length + value_length;
+
+  if (size > FCGI_MAX_CONTENT || fastcgi_reserve(writer, FCGI_PARAMS, size) == -1)
+    return;   /* Larger than a record (or the whole buffer); left out. */
+  char *out = writer->buffer + writer->used;
+  memcpy(out, lengths, lengths_size);
+  memcpy(out + lengths_size, name, name_length);
+  memcpy(out + lengths_size + name_length, value, value_length);
+  writer->used += size;
+}
+
+static void fastcgi_add_string(struct fastcgi_writer *writer, char *name, char *value) {
+  fastcgi_add_pair(writer, name, strlen(name), value, strlen(value));
+}
+
+/* Adds the socket address at ADDRESS as NAME_ADDR and NAME_PORT. */
+static void fastcgi_add_address(struct fastcgi_writer *writer, char *addr_name,
+    char *port_name, struct sockaddr_in *address) {
+  char host[INET_ADDRSTRLEN], port[8];
+  if (address->sin_family != AF_INET
+      || !inet_ntop(AF_INET, &address->sin_addr, host, sizeof(host)))
+    return;
+  snprintf(port, sizeof(port), "%d", ntohs(address->sin_port));
+  fastcgi_add_string(writer, addr_name, host);
+  fastcgi_add_string(writer, port_name, port);
+}
+
+/* Whether a request header must not be passed on as HTTP_*. */
+static int fastcgi_skip_header(char *key) {
+  /* Hop-by-hop headers, and "Proxy", which would become HTTP_PROXY. */
+  return strcasecmp(key, "Connection") == 0 || strcasecmp(key, "Keep-Alive") == 0
+      || strcasecmp(key, "Transfer-Encoding") == 0 || strcasecmp(key, "Expect") == 0
+      || strcasecmp(key, "Proxy") == 0;
+}
+
+static void fastcgi_add_params(struct fastcgi_writer *writer, int fd,
+    struct http_request *request) {
+  char *query = strchr(request->path, '?');
+  size_t path_length = query ? (size_t) (query - request->path) : strlen(request->path);
+  int i;
+
+  fastcgi_add_string(writer, "GATEWAY_INTERFACE", "CGI/1.1");
+  fastcgi_add_string(writer, "SERVER_SOFTWARE", "httpserver");
+  fastcgi_add_string(writer, "SERVER_PROTOCOL",
+      request->minor_version >= 1 ? "HTTP/1.1" : "HTTP/1.0");
+  fastcgi_add_string(writer, "REQUEST_METHOD", request->method);
+  fastcgi_add_string(writer, "REQUEST_URI", request->path);
+  fastcgi_add_string(writer, "SCRIPT_NAME", "");
+  fastcgi_add_pair(writer, "PATH_INFO", 9, request->path, path_length);
+  fastcgi_add_string(writer, "QUERY_STRING", query ? query + 1 : "");
+
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (getsockname(fd, (struct sockaddr *) &address, &length) == 0)
+    fastcgi_add_address(writer, "SERVER_ADDR", "SERVER_PORT", &address);
+  length = sizeof(address);
+  if (getpeername(fd, (struct sockaddr *) &address, &length) == 0)
+    fastcgi_add_address(writer, "REMOTE_ADDR", "REMOTE_PORT", &address);
+
+  char *host = http_request_get_header(request, "Host");
+  if (host)
+    fastcgi_add_pair(writer, "SERVER_NAME", 11, host, strcspn(host, ":"));
+
+  for (i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    char name[256];
+    size_t j, key_length = strlen(header->key);
+
+    if (strcasecmp(header->key, "Content-Type") == 0) {
+      fastcgi_add_string(writer, "CONTENT_TYPE", header->value);
+    } else if (strcasecmp(header->key, "Content-Length") == 0) {
+      fastcgi_add_string(writer, "CONTENT_LENGTH", header->value);
+    } else if (!fastcgi_skip_header(header->key) && key_length + 5 < sizeof(name)) {
+      memcpy(name, "HTTP_", 5);
+      for (j = 0; j < key_length; j++) {
+        char c = header->key[j];
+        name[5 + j] = c == '-' ? '_' : toupper((unsigned char) c);
+      }
+      fastcgi_add_pair(writer, name, key_length + 5, header->value,
+          strlen(header->value));
+    }
+  }
+
+  for (i = 0; i < num_params; i++) {
+    char *equals = strchr(params[i], '=');
+    fastcgi_add_pair(writer, params[i], equals - params[i], equals + 1,
+        strlen(equals + 1));
+  }
+}
+
+static void fastcgi_send_body(struct fastcgi_response *response, char *data,
+    size_t size) {
+  if (!response->body_allowed || size == 0)
+    return;
+  if (response->chunked)
+    http_send_chunk(response->fd, data, size);
+  else
+    http_send_data(response->fd, data, size);
+}
+
+/* Whether the CGI header line at LINE (of LENGTH bytes) is named NAME. */
+static int fastcgi_header_is(char *line, size_t length, char *name) {
+  size_t name_length = strlen(name);
+  return length > name_length && line[name_length] == ':'
+      && strncasecmp(line, name, name_length) == 0;
+}
+
+/* Turns the CGI header block ending at END into the HTTP response head. */
+static void fastcgi_send_head(struct fastcgi_response *response, char *end) {
+  int status_code = 0, has_length = 0, has_location = 0;
+  char *line, *next;
+
+  for (line = response->head; line < end; line = next) {
+    char *line_end = memchr(line, '\n', end - line);
+    next = line_end ? line_end + 1 : end;
+    size_t length = (line_end ? line_end : end) - line;
+    if (fastcgi_header_is(line, length, "Status"))
+      status_code = atoi(line + 7);
+    else if (fastcgi_header_is(line, length, "Content-Length"))
+      has_length = 1;
+    else if (fastcgi_header_is(line, length, "Location"))
+      has_location = 1;
+  }
+  if (status_code < 100 || status_code > 999)
+    status_code = has_location ? 302 : 200;
+
+  response->status_code = status_code;
+  response->body_allowed = !response->head_only && status_code != 204
+      && status_code != 304;
+  /* Without a length, HTTP/1.1 clients get chunks; others read until close. */
+  response->chunked = response->body_allowed && !has_length
+      && response->minor_version >= 1;
+  if (response->chunked)
+    http_start_chunked_response(response->fd, status_code);
+  else
+    http_start_response(response->fd, status_code);
+
+  for (line = response->head; line < end; line = next) {
+    char *line_end = memchr(line, '\n', end - line);
+    next = line_end ? line_end + 1 : end;
+    if (!line_end) line_end = end;
+    if (line_end > line && line_end[-1] == '\r') line_end--;
+    *line_end = '\0';
+
+    char *colon = strchr(line, ':');
+    if (!colon || fastcgi_header_is(line, line_end - line, "Status")
+        || fastcgi_header_is(line, line_end - line, "Transfer-Encoding")
+        || fastcgi_header_is(line, line_end - line, "Connection"))
+      continue;
+    *colon = '\0';
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    http_send_header(response->fd, line, value);
+  }
+  http_end_headers(response->fd);
+}
+
+/* Relays SIZE bytes of the worker's FCGI_STDOUT. Returns -1 if the head is too long. */
+static int fastcgi_relay(struct fastcgi_response *response, char *data, size_t size) {
+  if (response->status_code) {
+    fastcgi_send_body(response, data, size);
+    return 0;
+  }
+
+  size_t take = FASTCGI_HEAD_MAX - response->head_length;
+  if (take > size) take = size;
+  memcpy(response->head + response->head_length, data, take);
+  size_t head_length = response->head_length + take;
+
+  char *end = http_find_header_end(response->head, head_length);
+  if (!end) {
+    response->head_length = head_length;
+    return head_length == FASTCGI_HEAD_MAX ? -1 : 0;
+  }
+  char *body = end;
+  size_t body_length = response->head + head_length - end;
+  fastcgi_send_head(response, end);
+  fastcgi_send_body(response, body, body_length);
+  fastcgi_send_body(response, data + take, size - take);
+  return 0;
+}
+
+/* Processes SIZE bytes of the worker's records. Returns -1 if they are malformed. */
+static int fastcgi_consume(struct fastcgi_response *response, char *cursor,
+    size_t size) {
+  char *limit = cursor + size;
+
+  while (cursor < limit) {
+    size_t available = limit - cursor;
+
+    if (response->header_have < sizeof(response->header)) {
+      size_t take = sizeof(response->header) - response->header_have;
+      if (take > available) take = available;
+      memcpy((char *) &response->header + response->header_have, cursor, take);
+      response->header_have += take;
+      cursor += take;
+      if (response->header_have < sizeof(response->header))
+        continue;
+      struct fcgi_header *header = &response->header;
+      if (header->version != FCGI_VERSION_1) return -1;
+      /* Records for any other request ID are skipped. */
+      response->type = (header->request_id_b1 << 8 | header->request_id_b0)
+          == FASTCGI_REQUEST_ID ? header->type : 0;
+      response->content_left = header->content_length_b1 << 8 | header->content_length_b0;
+      response->padding_left = header->padding_length;
+    } else if (response->content_left > 0) {
+      size_t take = response->content_left < available ? response->content_left : available;
+      if (response->type == FCGI_STDOUT && fastcgi_relay(response, cursor, take) == -1) {
+        return -1;
+      } else if (response->type == FCGI_STDERR) {
+        fwrite(cursor, 1, take, stderr);
+      } else if (response->type == FCGI_END_REQUEST
+          && response->end_have < sizeof(response->end)) {
+        size_t copy = sizeof(response->end) - response->end_have;
+        if (copy > take) copy = take;
+        memcpy((char *) &response->end + response->end_have, cursor, copy);
+        response->end_have += copy;
+      }
+      cursor += take;
+      response->content_left -= take;
+    } else {
+      size_t take = response->padding_left < available ? response->padding_left : available;
+      cursor += take;
+      response->padding_left -= take;
+    }
+
+    if (response->header_have == sizeof(response->header)
+        && response->content_left == 0 && response->padding_left == 0) {
+      if (response->type == FCGI_END_REQUEST) {
+        /* Anything after the end would be out of step with the next request. */
+        response->ended = 1;
+        response->reusable = response->end_have == sizeof(response->end)
+            && response->end.protocol_status == FCGI_REQUEST_COMPLETE
+            && cursor == limit;
+        return 0;
+      }
+      response->header_have = 0;
+    }
+  }
+  return 0;
+}
+
+/* Reads what the worker has sent (waiting for something) and processes it. */
+static int fastcgi_read_some(int worker_fd, struct fastcgi_response *response,
+    char *buffer, size_t size) {
+  ssize_t bytes;
+  do {
+    bytes = coro_read(worker_fd, buffer, size);
+  } while (bytes < 0 && errno == EINTR);
+  if (bytes <= 0)
+    return -1;
+  response->heard = 1;
+  return fastcgi_consume(response, buffer, bytes);
+}
+
+/*
+ * Writes SIZE bytes of DATA to the worker, relaying whatever it sends in the
+ * meantime: a worker that answers while it reads (say, an echo) would
+ * otherwise fill its socket and stop reading, while we wait to write.
+ */
+static int fastcgi_write_relaying(int worker_fd, struct fastcgi_response *response,
+    char *data, size_t size, char *in_buffer, size_t in_size) {
+  while (size > 0 && !response->ended) {
+    struct pollfd pollfd = { .fd = worker_fd, .events = POLLIN | POLLOUT };
+    if (coro_poll(&pollfd, 1, -1) == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (pollfd.revents & POLLIN) {
+      if (fastcgi_read_some(worker_fd, response, in_buffer, in_size) == -1)
+        return -1;
+      continue;
+    }
+    ssize_t bytes = send(worker_fd, data, size, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      continue;
+    if (bytes <= 0)
+      return -1;
+    data += bytes;
+    size -= bytes;
+  }
+  return 0;
+}
+
+/*
+ * Takes the body bytes read along with REQUEST's headers, decoding them if
+ * the body is chunked. This is done once, so that the request can be sent
+ * again. Returns -1 if the body is malformed.
+ */
+static int fastcgi_start_body(struct fastcgi_body *body, struct http_request *request) {
+  char *transfer_encoding = http_request_get_header(request, "Transfer-Encoding");
+  char *content_length = http_request_get_header(request, "Content-Length");
+
+  memset(body, 0, sizeof(*body));
+  body->pending = request->raw + request->header_length;
+  body->pending_length = request->raw_length - request->header_length;
+  body->chunked = transfer_encoding && strcasecmp(transfer_encoding, "chunked") == 0;
+  if (body->chunked) {
+    http_chunked_decoder_init(&body->decoder);
+    ssize_t decoded = http_chunked_decode(&body->decoder, body->pending,
+        body->pending_length);
+    if (decoded < 0) return -1;
+    body->pending_length = decoded;
+  } else {
+    body->remaining = content_length ? strtoull(content_length, NULL, 10) : 0;
+    if (body->pending_length > body->remaining)
+      body->pending_length = body->remaining;
+    body->remaining -= body->pending_length;
+  }
+  return 0;
+}
+
+/*
+ * Sends the request: its parameters, then its body as FCGI_STDIN. Body bytes
+ * read along with the headers ride along with the parameters. The rest is
+ * read into one half of the writer's buffer, behind room for a record header,
+ * while the other half takes in whatever the worker answers meanwhile.
+ * Returns -1 if the worker or the client went away.
+ */
+static int fastcgi_send_request(struct fastcgi_writer *writer,
+    struct fastcgi_response *response, int fd, struct http_request *request,
+    struct fastcgi_body *body) {
+  struct fcgi_begin_request_body begin;
+  memset(&begin, 0, sizeof(begin));
+  begin.role_b0 = FCGI_RESPONDER;
+  begin.flags = FCGI_KEEP_CONN;
+  fastcgi_reserve(writer, FCGI_BEGIN_REQUEST, sizeof(begin));
+  memcpy(writer->buffer + writer->used, &begin, sizeof(begin));
+  writer->used += sizeof(begin);
+  fastcgi_close_record(writer);
+
+  fastcgi_add_params(writer, fd, request);
+  fastcgi_append_end(writer, FCGI_PARAMS);
+
+  fastcgi_append(writer, FCGI_STDIN, body->pending, body->pending_length);
+
+  int more = body->chunked ? !body->decoder.done : body->remaining > 0;
+  if (!more) {
+    /* The usual case: the whole request goes out in one write. */
+    fastcgi_append_end(writer, FCGI_STDIN);
+    fastcgi_flush(writer);
+    return writer->failed ? -1 : 0;
+  }
+  fastcgi_flush(writer);
+  if (writer->failed)
+    return -1;
+
+  /* From here on the request can't be sent again. */
+  body->streamed = 1;
+
+  /* The client holds the body back until told to go ahead. */
+  char *expect = http_request_get_header(request, "Expect");
+  if (expect && request->minor_version >= 1 && strcasecmp(expect, "100-continue") == 0)
+    http_send_string(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+
+  size_t half = writer->size / 2;
+  char *record = writer->buffer, *content = record + sizeof(struct fcgi_header);
+  size_t room = half - sizeof(struct fcgi_header);
+  if (room > FCGI_MAX_CONTENT) room = FCGI_MAX_CONTENT;
+  while (more && !response->ended) {
+    size_t wanted = body->chunked || body->remaining > room ? room : body->remaining;
+    ssize_t bytes = coro_read(fd, content, wanted);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    if (body->chunked) {
+      if ((bytes = http_chunked_decode(&body->decoder, content, bytes)) < 0) return -1;
+      more = !body->decoder.done;
+    } else {
+      more = (body->remaining -= bytes) > 0;
+    }
+    if (bytes == 0) continue;
+    fcgi_header_init((struct fcgi_header *) record, FCGI_STDIN, FASTCGI_REQUEST_ID, bytes);
+    if (fastcgi_write_relaying(writer->fd, response, record,
+          sizeof(struct fcgi_header) + bytes, writer->buffer + half, half) == -1)
+      return -1;
+  }
+
+  if (response->ended) {
+    /* The worker answered without reading the whole body. */
+    response->reusable = 0;
+    return 0;
+  }
+  fcgi_header_init((struct fcgi_header *) record, FCGI_STDIN, FASTCGI_REQUEST_ID, 0);
+  return fastcgi_write_relaying(writer->fd, response, record,
+      sizeof(struct fcgi_header), writer->buffer + half, half);
+}
+
+int fastcgi_serve(int worker_fd, int reused, int fd, struct http_request *request,
+    char *buffer, size_t size) {
+  struct fastcgi_body body;
+  if (fastcgi_start_body(&body, request) == -1) {
+    fastcgi_release(worker_fd, 1);
+    return -1;
+  }
+
+  struct fastcgi_response response;
+  int status;
+  while (1) {
+    struct fastcgi_writer writer = {
+      .fd = worker_fd,
+      .buffer = buffer,
+      .size = size,
+      .record = FASTCGI_NO_RECORD,
+    };
+    memset(&response, 0, sizeof(response));
+    response.fd = fd;
+    response.minor_version = request->minor_version;
+    response.head_only = strcmp(request->method, "HEAD") == 0;
+
+    status = fastcgi_send_request(&writer, &response, fd, request, &body);
+    while (status == 0 && !response.ended)
+      status = fastcgi_read_some(worker_fd, &response, buffer, size);
+
+    fastcgi_release(worker_fd, status == 0 && response.reusable);
+    /*
+     * A worker may close an idle connection just as we take it from the pool.
+     * If it did so before answering anything, and the client has sent nothing
+     * we can't send again, try once more on a new connection.
+     */
+    if (status == 0 || !reused || response.heard || body.streamed)
+      break;
+    reused = 0;
+    if ((worker_fd = fastcgi_connect_new()) == -1)
+      return -1;
+  }
+
+  /* A cut-off response is left unterminated, so the client can tell. */
+  if (status == 0 && response.chunked)
+    http_end_chunks(fd);
+  /* Without a complete head nothing was sent. */
+  return response.status_code ? response.status_code : -1;
+}
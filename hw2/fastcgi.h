@@ -0,0 +1,130 @@
+/*
+ * A FastCGI client, for dynamic content served by long-running application
+ * workers instead of a process per request.
+ *
+ * Requests are spread over a pool of persistent connections to the workers,
+ * on a UNIX socket or over TCP. Each request borrows an idle connection (or
+ * opens one), sends its CGI parameters and body as FastCGI records with
+ * FCGI_KEEP_CONN set, and streams the response back to the client as the
+ * worker produces it. Once the worker ends the request, the connection goes
+ * back to the pool for the next one.
+ *
+ * Usage example:
+ *
+ *     ./fcgiworker --workers 4 unix:/tmp/app.sock
+ *     ./httpserver --fastcgi unix:/tmp/app.sock --port 8000
+ *
+ *     fastcgi_init("unix:/tmp/app.sock", 16);     (or "127.0.0.1:9000")
+ *     fastcgi_add_param("SCRIPT_FILENAME=/srv/app/index.php");
+ *
+ *     struct http_request *request = http_request_parse(fd);
+ *     int reused;
+ *     int worker_fd = fastcgi_connect(&reused);
+ *     if (worker_fd < 0 || fastcgi_serve(worker_fd, reused, fd, request,
+ *           buffer, sizeof(buffer)) < 0)
+ *       ... nothing was sent; answer 502 ...
+ *
+ * The constants and record layout below are shared with fcgiworker.c.
+ */
+
+#ifndef FASTCGI_H
+#define FASTCGI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libhttp.h"
+
+#define FASTCGI_CONNECT_TIMEOUT_MS 1000
+
+/* Longest CGI header block accepted from a worker. */
+#define FASTCGI_HEAD_MAX 8192
+
+/* Parameters added with fastcgi_add_param(). */
+#define FASTCGI_MAX_PARAMS 32
+
+#define FCGI_VERSION_1 1
+#define FCGI_MAX_CONTENT 65535
+
+/* Record types. */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+/* FCGI_BEGIN_REQUEST. */
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+
+/* FCGI_END_REQUEST protocol statuses. */
+#define FCGI_REQUEST_COMPLETE 0
+
+struct fcgi_header {
+  uint8_t version;
+  uint8_t type;
+  uint8_t request_id_b1;
+  uint8_t request_id_b0;
+  uint8_t content_length_b1;
+  uint8_t content_length_b0;
+  uint8_t padding_length;
+  uint8_t reserved;
+};
+
+struct fcgi_begin_request_body {
+  uint8_t role_b1;
+  uint8_t role_b0;
+  uint8_t flags;
+  uint8_t reserved[5];
+};
+
+struct fcgi_end_request_body {
+  uint8_t app_status_b3;
+  uint8_t app_status_b2;
+  uint8_t app_status_b1;
+  uint8_t app_status_b0;
+  uint8_t protocol_status;
+  uint8_t reserved[3];
+};
+
+static inline void fcgi_header_init(struct fcgi_header *header, int type,
+    int request_id, size_t content_length) {
+  header->version = FCGI_VERSION_1;
+  header->type = type;
+  header->request_id_b1 = request_id >> 8;
+  header->request_id_b0 = request_id;
+  header->content_length_b1 = content_length >> 8;
+  header->content_length_b0 = content_length;
+  header->padding_length = 0;
+  header->reserved = 0;
+}
+
+/*
+ * Connects to the workers at ADDRESS ("unix:PATH" or "HOST:PORT") on demand,
+ * keeping up to MAX_IDLE idle connections open. Exits if ADDRESS is invalid.
+ */
+void fastcgi_init(char *address, int max_idle);
+
+/* Sends "NAME=VALUE" to the workers with every request. Returns -1 if malformed. */
+int fastcgi_add_param(char *param);
+
+/*
+ * Returns an idle connection to the workers, setting *REUSED, or a new one;
+ * -1 if unreachable.
+ */
+int fastcgi_connect(int *reused);
+
+/*
+ * Has the worker on WORKER_FD answer REQUEST, read from FD, using SIZE bytes
+ * of BUFFER. WORKER_FD goes back to the pool if it is still usable, or is
+ * closed. If it was REUSED from the pool and fails before the worker answers
+ * or more of the body is read, the request is sent once more on a new
+ * connection. Returns the status code sent, or -1 if the worker failed
+ * before anything was sent.
+ */
+int fastcgi_serve(int worker_fd, int reused, int fd, struct http_request *request,
+    char *buffer, size_t size);
+
+#endif
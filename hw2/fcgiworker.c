@@ -0,0 +1,413 @@
+/*
+ * A stand-in FastCGI application, for trying out and testing --fastcgi.
+ *
+ * Listens on a UNIX socket or TCP port and forks a pool of worker processes
+ * that accept connections from it and answer requests over them for as long
+ * as the server keeps them open (FCGI_KEEP_CONN), or until another
+ * connection is waiting while theirs is idle. GET and HEAD are answered
+ * with a page listing the request's CGI parameters; any other method echoes
+ * the request body back as it streams in. "?sleep=MS" in the query string
+ * delays the answer, to make a slow endpoint.
+ *
+ * Usage example:
+ *
+ *     ./fcgiworker --workers 4 unix:/tmp/app.sock
+ *     ./fcgiworker 127.0.0.1:9000
+ *     ./httpserver --fastcgi unix:/tmp/app.sock --port 8000
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fastcgi.h"
+
+#define WORKER_PARAMS_MAX (64 * 1024)
+
+struct worker_request {
+  int id;
+  int keep_conn;
+  int params_done;
+  int head_sent;
+  int echo;
+  size_t params_length;
+  char params[WORKER_PARAMS_MAX];
+  unsigned long served;         /* Requests so far on this connection. */
+};
+
+static int read_exact(int fd, void *buffer, size_t size) {
+  char *cursor = buffer;
+  while (size > 0) {
+    ssize_t bytes = read(fd, cursor, size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    cursor += bytes;
+    size -= bytes;
+  }
+  return 0;
+}
+
+static int write_exact(int fd, const void *buffer, size_t size) {
+  const char *cursor = buffer;
+  while (size > 0) {
+    ssize_t bytes = write(fd, cursor, size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    cursor += bytes;
+    size -= bytes;
+  }
+  return 0;
+}
+
+/* Writes LENGTH bytes of the stream TYPE, in as many records as it takes. */
+static int write_stream(int fd, int type, int id, const char *data, size_t length) {
+  struct fcgi_header header;
+  do {
+    size_t take = length < FCGI_MAX_CONTENT ? length : FCGI_MAX_CONTENT;
+    fcgi_header_init(&header, type, id, take);
+    if (write_exact(fd, &header, sizeof(header)) == -1
+        || write_exact(fd, data, take) == -1)
+      return -1;
+    data += take;
+    length -= take;
+  } while (length > 0);
+  return 0;
+}
+
+static size_t decode_length(unsigned char **cursor) {
+  unsigned char *p = *cursor;
+  if (!(p[0] & 0x80)) {
+    *cursor += 1;
+    return p[0];
+  }
+  *cursor += 4;
+  return (size_t) (p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Calls VISIT on each parameter; stops early if it returns nonzero. */
+static void each_param(struct worker_request *request,
+    int (*visit)(char *name, size_t name_length, char *value, size_t value_length,
+      void *argument), void *argument) {
+  unsigned char *cursor = (unsigned char *) request->params;
+  unsigned char *end = cursor + request->params_length;
+  while (cursor < end) {
+    size_t name_length = decode_length(&cursor);
+    size_t value_length = decode_length(&cursor);
+    if (cursor + name_length + value_length > end)
+      break;
+    if (visit((char *) cursor, name_length, (char *) cursor + name_length,
+          value_length, argument))
+      break;
+    cursor += name_length + value_length;
+  }
+}
+
+struct param_lookup {
+  char *name;
+  char value[1024];
+  int found;
+};
+
+static int match_param(char *name, size_t name_length, char *value,
+    size_t value_length, void *argument) {
+  struct param_lookup *lookup = argument;
+  if (strlen(lookup->name) != name_length || memcmp(lookup->name, name, name_length))
+    return 0;
+  if (value_length >= sizeof(lookup->value))
+    value_length = sizeof(lookup->value) - 1;
+  memcpy(lookup->value, value, value_length);
+  lookup->value[value_length] = '\0';
+  lookup->found = 1;
+  return 1;
+}
+
+static char *get_param(struct worker_request *request, char *name,
+    struct param_lookup *lookup) {
+  lookup->name = name;
+  lookup->found = 0;
+  each_param(request, match_param, lookup);
+  return lookup->found ? lookup->value : NULL;
+}
+
+struct page {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static void page_append(struct page *page, const char *data, size_t length) {
+  if (page->length + length > page->capacity) {
+    page->capacity = (page->length + length) * 2;
+    page->data = realloc(page->data, page->capacity);
+    if (!page->data) {
+      perror("Failed to allocate page");
+      exit(errno);
+    }
+  }
+  memcpy(page->data + page->length, data, length);
+  page->length += length;
+}
+
+static int append_param(char *name, size_t name_length, char *value,
+    size_t value_length, void *argument) {
+  struct page *page = argument;
+  page_append(page, name, name_length);
+  page_append(page, "=", 1);
+  page_append(page, value, value_length);
+  page_append(page, "\n", 1);
+  return 0;
+}
+
+/* Sends the response head once the parameters are in. */
+static int start_response(int fd, struct worker_request *request) {
+  struct param_lookup lookup;
+  char *method = get_param(request, "REQUEST_METHOD", &lookup);
+  request->echo = method && strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0;
+
+  char *query = get_param(request, "QUERY_STRING", &lookup);
+  char *sleep_ms = query ? strstr(query, "sleep=") : NULL;
+  if (sleep_ms)
+    usleep(atoi(sleep_ms + 6) * 1000);
+
+  request->head_sent = 1;
+  if (request->echo) {
+    char *head = "Status: 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n";
+    return write_stream(fd, FCGI_STDOUT, request->id, head, strlen(head));
+  }
+  return 0;
+}
+
+static int finish_request(int fd, struct worker_request *request) {
+  struct fcgi_header header;
+  struct fcgi_end_request_body end;
+
+  if (!request->echo) {
+    struct page page = { NULL, 0, 0 };
+    char line[256];
+    int length = snprintf(line, sizeof(line),
+        "Status: 200 OK\r\nContent-Type: text/plain\r\n\r\n"
+        "Hello from FastCGI worker %d, request %lu on this connection\n\n",
+        (int) getpid(), request->served + 1);
+    page_append(&page, line, length);
+    each_param(request, append_param, &page);
+
+    /* A Content-Length lets the server skip chunking. */
+    char head[64];
+    char *body = strstr(page.data, "\r\n\r\n") + 4;
+    int head_length = snprintf(head, sizeof(head), "Content-Length: %zu\r\n",
+        page.length - (body - page.data));
+    int status = write_stream(fd, FCGI_STDOUT, request->id, head, head_length)
+        || write_stream(fd, FCGI_STDOUT, request->id, page.data, page.length);
+    free(page.data);
+    if (status)
+      return -1;
+  }
+
+  fcgi_header_init(&header, FCGI_STDOUT, request->id, 0);
+  if (write_exact(fd, &header, sizeof(header)) == -1)
+    return -1;
+  memset(&end, 0, sizeof(end));
+  end.protocol_status = FCGI_REQUEST_COMPLETE;
+  fcgi_header_init(&header, FCGI_END_REQUEST, request->id, sizeof(end));
+  if (write_exact(fd, &header, sizeof(header)) == -1
+      || write_exact(fd, &end, sizeof(end)) == -1)
+    return -1;
+  request->served++;
+  return 0;
+}
+
+/*
+ * Between requests, waits for the next one on FD. A worker only serves one
+ * connection at a time, so it gives up an idle one as soon as another is
+ * waiting to be accepted on LISTEN_FD; otherwise a server keeping more
+ * connections than there are workers could leave some waiting forever.
+ * Returns -1 to give up FD.
+ */
+static int wait_for_request(int fd, int listen_fd) {
+  struct pollfd fds[2] = {
+    { .fd = fd, .events = POLLIN },
+    { .fd = listen_fd, .events = POLLIN },
+  };
+  while (poll(fds, 2, -1) == -1)
+    if (errno != EINTR)
+      return -1;
+  return fds[0].revents ? 0 : -1;
+}
+
+static void serve_connection(int fd, int listen_fd, struct worker_request *request) {
+  static char content[FCGI_MAX_CONTENT + 256];
+  struct fcgi_header header;
+  int idle = 0;
+
+  request->served = 0;
+  while ((!idle || wait_for_request(fd, listen_fd) == 0)
+      && read_exact(fd, &header, sizeof(header)) == 0) {
+    idle = 0;
+    size_t length = header.content_length_b1 << 8 | header.content_length_b0;
+    int id = header.request_id_b1 << 8 | header.request_id_b0;
+    if (read_exact(fd, content, length + header.padding_length) == -1)
+      return;
+
+    switch (header.type) {
+      case FCGI_BEGIN_REQUEST: {
+        struct fcgi_begin_request_body *begin = (struct fcgi_begin_request_body *) content;
+        request->id = id;
+        request->keep_conn = begin->flags & FCGI_KEEP_CONN;
+        request->params_done = request->head_sent = request->echo = 0;
+        request->params_length = 0;
+        break;
+      }
+      case FCGI_PARAMS:
+        if (length == 0) {
+          request->params_done = 1;
+        } else if (request->params_length + length <= WORKER_PARAMS_MAX) {
+          memcpy(request->params + request->params_length, content, length);
+          request->params_length += length;
+        }
+        break;
+      case FCGI_STDIN:
+        if (!request->head_sent && start_response(fd, request) == -1)
+          return;
+        if (length > 0) {
+          if (request->echo
+              && write_stream(fd, FCGI_STDOUT, request->id, content, length) == -1)
+            return;
+          break;
+        }
+        if (finish_request(fd, request) == -1 || !request->keep_conn)
+          return;
+        idle = 1;
+        break;
+      case FCGI_ABORT_REQUEST:
+        if (finish_request(fd, request) == -1)
+          return;
+        idle = 1;
+        break;
+      default:
+        break;  /* Management records aren't supported. */
+    }
+  }
+}
+
+static int listen_on(char *address) {
+  int socket_fd;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", address + 5);
+    unlink(un.sun_path);
+    socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1 || bind(socket_fd, (struct sockaddr *) &un, sizeof(un)) == -1) {
+      perror("Failed to bind socket");
+      exit(errno);
+    }
+  } else {
+    struct sockaddr_in in;
+    char *colon = strrchr(address, ':');
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(atoi(colon ? colon + 1 : address));
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (colon) {
+      *colon = '\0';
+      if (inet_pton(AF_INET, address, &in.sin_addr) != 1) {
+        fprintf(stderr, "Expected an IPv4 address: %s\n", address);
+        exit(EXIT_FAILURE);
+      }
+    }
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (socket_fd == -1
+        || setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+        || bind(socket_fd, (struct sockaddr *) &in, sizeof(in)) == -1) {
+      perror("Failed to bind socket");
+      exit(errno);
+    }
+  }
+
+  if (listen(socket_fd, 1024) == -1) {
+    perror("Failed to listen on socket");
+    exit(errno);
+  }
+  return socket_fd;
+}
+
+static void worker_main(int listen_fd) {
+  struct worker_request *request = malloc(sizeof(struct worker_request));
+  if (!request) {
+    perror("Failed to allocate request");
+    exit(errno);
+  }
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to accept connection");
+      exit(errno);
+    }
+    serve_connection(fd, listen_fd, request);
+    close(fd);
+  }
+}
+
+static void exit_with_usage(void) {
+  fprintf(stderr, "Usage: ./fcgiworker [--workers N] unix:PATH | [HOST:]PORT\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  int num_workers = 4, i;
+  char *address = NULL;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0) {
+      if (!argv[++i] || (num_workers = atoi(argv[i])) < 1)
+        exit_with_usage();
+    } else if (!address) {
+      address = argv[i];
+    } else {
+      exit_with_usage();
+    }
+  }
+  if (!address)
+    exit_with_usage();
+
+  signal(SIGPIPE, SIG_IGN);
+  int listen_fd = listen_on(address);
+  for (i = 0; i < num_workers; i++) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("Failed to fork worker");
+      exit(errno);
+    }
+    if (pid == 0)
+      worker_main(listen_fd);
+  }
+  printf("Serving FastCGI with %d workers\n", num_workers);
+  fflush(stdout);
+
+  /* Replace workers that die, so the pool stays at full strength. */
+  while (1) {
+    if (wait(NULL) == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fork() == 0)
+      worker_main(listen_fd);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "utlist.h"
+
+#define FDCACHE_BUCKETS 4096
+#define FDCACHE_WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+    | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* A watched directory, by inotify watch descriptor. */
+struct fdcache_watch {
+  int wd;
+  char *directory;
+  struct fdcache_watch *next;
+};
+
+/* An invalidation on its way to a shard. */
+struct fdcache_message {
+  char *path;
+  int exact;                          /* Only PATH, not what is beneath it. */
+  struct fdcache_message *next;
+};
+
+/*
+ * A cache table: the one every thread shares, or a thread's own (see
+ * fdcache_attach_shard()). Only the inotify thread learns about changes, and
+ * it never touches a table: it leaves each shard a message in its mailbox,
+ * which the shard applies itself on its next lookup.
+ */
+struct fdcache_shard {
+  pthread_mutex_t lock;               /* Uncontended unless threads share it. */
+  struct fdcache_entry *buckets[FDCACHE_BUCKETS];
+  struct fdcache_entry *lru;
+  int num_entries;
+  unsigned long invalidations;        /* Bumped on every message applied. */
+
+  pthread_mutex_t mailbox_lock;
+  struct fdcache_message *mailbox;
+  int drop_all;                       /* A message couldn't be allocated. */
+  int has_mail;                       /* Checked without mailbox_lock. */
+  struct fdcache_shard *next;
+};
+
+static char *root_path;
+static int root_fd = -1;
+static int max_entries;
+static int inotify_fd = -1;
+static int have_openat2 = 1;
+
+static struct fdcache_shard shared_shard = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .mailbox_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static __thread struct fdcache_shard *thread_shard;
+
+/* Guards the watches and the list of shards. */
+static struct fdcache_watch *watches;
+static struct fdcache_shard *shards = &shared_shard;
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long fdcache_hash(char *key) {
+  unsigned long hash = 5381;
+  while (*key)
+    hash = hash * 33 + (unsigned char) *key++;
+  return hash % FDCACHE_BUCKETS;
+}
+
+int fdcache_root(void) {
+  return root_fd;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+int fdcache_normalize_path(char *request_path, char *out, size_t size) {
+  size_t length = 0;
+  char *cursor = request_path;
+
+  while (*cursor && *cursor != '?' && *cursor != '#') {
+    /* Skip runs of slashes, then take one component. */
+    while (*cursor == '/') cursor++;
+    if (!*cursor || *cursor == '?' || *cursor == '#') break;
+
+    size_t component_start = length;
+    while (*cursor && *cursor != '/' && *cursor != '?' && *cursor != '#') {
+      char c = *cursor++;
+      if (c == '%') {
+        int high = hex_value(cursor[0]), low = high < 0 ? -1 : hex_value(cursor[1]);
+        if (low < 0) return -1;
+        c = high * 16 + low;
+        cursor += 2;
+        if (c == '\0' || c == '/') return -1;
+      }
+      if (length + 2 >= size) return -1;
+      out[length++] = c;
+    }
+
+    size_t component_length = length - component_start;
+    if (component_length == 1 && out[component_start] == '.') {
+      length = component_start;
+    } else if (component_length == 2 && out[component_start] == '.'
+        && out[component_start + 1] == '.') {
+      return -1;
+    } else {
+      out[length++] = '/';
+    }
+  }
+
+  if (length == 0) {
+    if (size < 2) return -1;
+    strcpy(out, ".");
+    return 0;
+  }
+  out[length - 1] = '\0'; /* Drop the trailing slash. */
+  return 0;
+}
+
+/* Opens PATH beneath the root; the kernel rejects anything that escapes it. */
+static int fdcache_openat(char *path, int flags) {
+  if (have_openat2) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_CLOEXEC | flags;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS)
+      return fd;
+    have_openat2 = 0;
+  }
+
+  /*
+   * Pre-5.6 kernels: normalized paths have no "..", so only symlinks could
+   * lead out. O_NOFOLLOW refuses just the last component, so walk the path a
+   * component at a time and refuse a symlink anywhere along it.
+   */
+  char copy[PATH_MAX];
+  if (strlen(path) >= sizeof(copy)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(copy, path);
+
+  int directory_fd = root_fd;
+  char *component = copy, *slash;
+  while ((slash = strchr(component, '/'))) {
+    *slash = '\0';
+    int fd = openat(directory_fd, component,
+        O_PATH | O_CLOEXEC | O_NOFOLLOW | O_DIRECTORY);
+    int saved_errno = errno;
+    if (directory_fd != root_fd)
+      close(directory_fd);
+    if (fd == -1) {
+      errno = saved_errno;
+      return -1;
+    }
+    directory_fd = fd;
+    component = slash + 1;
+  }
+
+  int fd = openat(directory_fd, component, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | flags);
+  if (directory_fd != root_fd) {
+    int saved_errno = errno;
+    close(directory_fd);
+    errno = saved_errno;
+  }
+  return fd;
+}
+
+int fdcache_open_directory(char *path) {
+  return fdcache_openat(path, O_DIRECTORY);
+}
+
+static void fdcache_entry_free(struct fdcache_entry *entry) {
+  close(entry->fd);
+  free(entry->path);
+  free(entry);
+}
+
+static struct fdcache_shard *fdcache_shard(void) {
+  return thread_shard ? thread_shard : &shared_shard;
+}
+
+/* Drops the table's reference to ENTRY. Caller holds SHARD->lock. */
+static void fdcache_unlink(struct fdcache_shard *shard, struct fdcache_entry *entry) {
+  struct fdcache_entry **link = &shard->buckets[fdcache_hash(entry->path)];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(shard->lru, entry);
+  shard->num_entries--;
+  if (--entry->refcount == 0)
+    fdcache_entry_free(entry);
+}
+
+/* Drops the entry for exactly PATH, if any. Caller holds SHARD->lock. */
+static void fdcache_drop(struct fdcache_shard *shard, char *path) {
+  struct fdcache_entry *entry;
+  for (entry = shard->buckets[fdcache_hash(path)]; entry; entry = entry->hash_next)
+    if (strcmp(entry->path, path) == 0) {
+      fdcache_unlink(shard, entry);
+      return;
+    }
+}
+
+/* Drops PATH and everything beneath it. Caller holds SHARD->lock. */
+static void fdcache_invalidate(struct fdcache_shard *shard, char *path) {
+  struct fdcache_entry *entry, *tmp;
+  size_t length = strlen(path);
+  int everything = strcmp(path, ".") == 0;
+
+  DL_FOREACH_SAFE(shard->lru, entry, tmp) {
+    if (everything || (strncmp(entry->path, path, length) == 0
+          && (entry->path[length] == '\0' || entry->path[length] == '/')))
+      fdcache_unlink(shard, entry);
+  }
+}
+
+/* Leaves every shard a message to drop PATH. Caller holds fdcache_lock. */
+static void fdcache_post(char *path, int exact) {
+  struct fdcache_shard *shard;
+  for (shard = shards; shard; shard = shard->next) {
+    struct fdcache_message *message = malloc(sizeof(struct fdcache_message));
+    if (message && !(message->path = strdup(path))) {
+      free(message);
+      message = NULL;
+    }
+    pthread_mutex_lock(&shard->mailbox_lock);
+    if (message) {
+      message->exact = exact;
+      message->next = shard->mailbox;
+      shard->mailbox = message;
+    } else {
+      /* Dropping everything is always safe. */
+      shard->drop_all = 1;
+    }
+    __atomic_store_n(&shard->has_mail, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shard->mailbox_lock);
+  }
+}
+
+/* Applies the messages left for SHARD. Caller holds SHARD->lock. */
+static void fdcache_read_mail(struct fdcache_shard *shard) {
+  if (!__atomic_load_n(&shard->has_mail, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&shard->mailbox_lock);
+  struct fdcache_message *message = shard->mailbox, *next;
+  int drop_all = shard->drop_all;
+  shard->mailbox = NULL;
+  shard->drop_all = 0;
+  __atomic_store_n(&shard->has_mail, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&shard->mailbox_lock);
+
+  shard->invalidations++;
+  if (drop_all)
+    fdcache_invalidate(shard, ".");
+  for (; message; message = next) {
+    next = message->next;
+    if (message->exact)
+      fdcache_drop(shard, message->path);
+    else
+      fdcache_invalidate(shard, message->path);
+    free(message->path);
+    free(message);
+  }
+}
+
+/* Watches DIRECTORY (relative to the root) if it isn't already. Caller holds fdcache_lock. */
+static void fdcache_watch_directory(char *directory) {
+  struct fdcache_watch *watch;
+  char full_path[PATH_MAX];
+
+  if (inotify_fd == -1)
+    return;
+  for (watch = watches; watch; watch = watch->next)
+    if (strcmp(watch->directory, directory) == 0)
+      return;
+
+  snprintf(full_path, sizeof(full_path), "%s/%s", root_path, directory);
+  int wd = inotify_add_watch(inotify_fd, full_path, FDCACHE_WATCH_EVENTS);
+  if (wd == -1)
+    return;
+
+  watch = malloc(sizeof(struct fdcache_watch));
+  if (!watch) return;
+  watch->wd = wd;
+  watch->directory = strdup(directory);
+  watch->next = watches;
+  watches = watch;
+}
+
+/* Watches the directory containing PATH. Caller holds fdcache_lock. */
+static void fdcache_watch_parent(char *path) {
+  char directory[PATH_MAX];
+  char *slash = strrchr(path, '/');
+
+  if (!slash || (size_t) (slash - path) >= sizeof(directory)) {
+    fdcache_watch_directory(".");
+    return;
+  }
+  memcpy(directory, path, slash - path);
+  directory[slash - path] = '\0';
+  fdcache_watch_directory(directory);
+}
+
+static void fdcache_handle_event(struct inotify_event *event) {
+  struct fdcache_watch *watch, **link;
+  char path[PATH_MAX];
+
+  pthread_mutex_lock(&fdcache_lock);
+  if (event->mask & IN_Q_OVERFLOW) {
+    fdcache_post(".", 0);
+    pthread_mutex_unlock(&fdcache_lock);
+    return;
+  }
+
+  for (link = &watches; (watch = *link); link = &watch->next)
+    if (watch->wd == event->wd)
+      break;
+  if (!watch) {
+    pthread_mutex_unlock(&fdcache_lock);
+    return;
+  }
+
+  if (event->len > 0 && strcmp(watch->directory, ".") != 0)
+    snprintf(path, sizeof(path), "%s/%s", watch->directory, event->name);
+  else if (event->len > 0)
+    snprintf(path, sizeof(path), "%s", event->name);
+  else
+    snprintf(path, sizeof(path), "%s", watch->directory);
+  fdcache_post(path, 0);
+
+  /* The directory's own fstat() result changes with its entries. */
+  if (event->len > 0)
+    fdcache_post(watch->directory, 1);
+
+  /* The watch follows the inode; once it moves, the path is no longer ours. */
+  if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+    inotify_rm_watch(inotify_fd, watch->wd);
+
+  if (event->mask & IN_IGNORED) {
+    *link = watch->next;
+    free(watch->directory);
+    free(watch);
+  }
+  pthread_mutex_unlock(&fdcache_lock);
+}
+
+static void *fdcache_inotify_main(void *argument) {
+  char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) continue;
+    if (length <= 0) break;
+
+    char *cursor = buffer;
+    while (cursor < buffer + length) {
+      struct inotify_event *event = (struct inotify_event *) cursor;
+      fdcache_handle_event(event);
+      cursor += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return NULL;
+}
+
+void fdcache_init(char *root, int entries) {
+  root_path = root;
+  max_entries = entries;
+
+  root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd == -1) {
+    fprintf(stderr, "Failed to open document root %s: %s\n", root, strerror(errno));
+    exit(errno);
+  }
+
+  if (max_entries == 0)
+    return;
+
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    /* Without invalidation, stale descriptors could be served forever. */
+    perror("Failed to set up inotify (descriptor cache disabled)");
+    max_entries = 0;
+    return;
+  }
+
+  pthread_t thread;
+  int error = pthread_create(&thread, NULL, fdcache_inotify_main, NULL);
+  if (error) {
+    fprintf(stderr, "Failed to create inotify thread: %s\n", strerror(error));
+    exit(error);
+  }
+  pthread_detach(thread);
+}
+
+void fdcache_attach_shard(void) {
+  if (thread_shard)
+    return;
+  struct fdcache_shard *shard = calloc(1, sizeof(struct fdcache_shard));
+  if (!shard) {
+    perror("Failed to allocate descriptor cache shard (sharing instead)");
+    return;
+  }
+  pthread_mutex_init(&shard->lock, NULL);
+  pthread_mutex_init(&shard->mailbox_lock, NULL);
+
+  pthread_mutex_lock(&fdcache_lock);
+  shard->next = shards;
+  shards = shard;
+  pthread_mutex_unlock(&fdcache_lock);
+  thread_shard = shard;
+}
+
+struct fdcache_entry *fdcache_open(char *path) {
+  struct fdcache_shard *shard = fdcache_shard();
+  struct fdcache_entry *entry;
+  unsigned long bucket = fdcache_hash(path);
+
+  pthread_mutex_lock(&shard->lock);
+  fdcache_read_mail(shard);
+  for (entry = shard->buckets[bucket]; entry; entry = entry->hash_next)
+    if (strcmp(entry->path, path) == 0)
+      break;
+  if (entry) {
+    entry->refcount++;
+    DL_DELETE(shard->lru, entry);
+    DL_PREPEND(shard->lru, entry);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+
+  /*
+   * Watch before opening, so no change after the open can be missed, and
+   * don't cache what we opened if anything was invalidated meanwhile.
+   */
+  if (max_entries > 0) {
+    pthread_mutex_lock(&fdcache_lock);
+    fdcache_watch_parent(path);
+    pthread_mutex_unlock(&fdcache_lock);
+  }
+  unsigned long invalidations_before = shard->invalidations;
+  pthread_mutex_unlock(&shard->lock);
+
+  entry = calloc(1, sizeof(struct fdcache_entry));
+  if (!entry) return NULL;
+  entry->fd = fdcache_openat(path, 0);
+  if (entry->fd == -1 || fstat(entry->fd, &entry->st) == -1) {
+    int saved_errno = errno;
+    if (entry->fd != -1) close(entry->fd);
+    free(entry);
+    errno = saved_errno;
+    return NULL;
+  }
+  if (!(entry->path = strdup(path))) {
+    close(entry->fd);
+    free(entry);
+    errno = ENOMEM;
+    return NULL;
+  }
+  entry->refcount = 1;
+  entry->shard = shard;
+
+  if (max_entries == 0)
+    return entry;
+
+  pthread_mutex_lock(&shard->lock);
+  fdcache_read_mail(shard);
+  struct fdcache_entry *other;
+  for (other = shard->buckets[bucket]; other; other = other->hash_next)
+    if (strcmp(other->path, path) == 0)
+      break;
+  if (!other && shard->invalidations == invalidations_before) {
+    /* The table holds a reference of its own. */
+    entry->refcount++;
+    entry->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    DL_PREPEND(shard->lru, entry);
+    if (++shard->num_entries > max_entries)
+      fdcache_unlink(shard, shard->lru->prev);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return entry;
+}
+
+off_t fdcache_cached_size(char *path) {
+  struct fdcache_shard *shard = fdcache_shard();
+  struct fdcache_entry *entry;
+  off_t size = -1;
+
+  pthread_mutex_lock(&shard->lock);
+  fdcache_read_mail(shard);
+  for (entry = shard->buckets[fdcache_hash(path)]; entry; entry = entry->hash_next)
+    if (strcmp(entry->path, path) == 0) {
+      size = entry->st.st_size;
+      break;
+    }
+  pthread_mutex_unlock(&shard->lock);
+  return size;
+}
+
+void fdcache_release(struct fdcache_entry *entry) {
+  struct fdcache_shard *shard = entry->shard;
+  pthread_mutex_lock(&shard->lock);
+  int last = --entry->refcount == 0;
+  pthread_mutex_unlock(&shard->lock);
+  if (last)
+    fdcache_entry_free(entry);
+}
@@ -0,0 +1,95 @@
+/*
+ * A cache of open file descriptors under the document root.
+ *
+ * The document root is opened once as a directory fd, and every lookup is
+ * resolved relative to it with openat2(RESOLVE_BENEATH), so the kernel
+ * confines traversal to the root without any path checks in user space.
+ * Kernels without openat2() get a walk of one openat() per component that
+ * refuses symlinks anywhere in the path.
+ * Open descriptors and their fstat() results are kept in a bounded LRU cache
+ * keyed by path, so hot files need neither a path walk nor an open() per
+ * request. An inotify thread invalidates entries whose files change.
+ *
+ * Usage example:
+ *
+ *     fdcache_init("files/", 1024);
+ *
+ *     char path[PATH_MAX];
+ *     if (fdcache_normalize_path(request->path, path, sizeof(path)) == 0) {
+ *       struct fdcache_entry *entry = fdcache_open(path);
+ *       if (entry) {
+ *         http_send_file(fd, entry->fd, 0, entry->st.st_size);
+ *         fdcache_release(entry);
+ *       }
+ *     }
+ *
+ * By default all threads share one table. A thread that calls
+ * fdcache_attach_shard() gets a table of its own instead, which no other
+ * thread touches: the inotify thread only posts invalidations to it, and the
+ * owner applies them on its next lookup.
+ *
+ * Entries are reference counted and immutable. Readers must not change the
+ * file offset of ENTRY->fd; use pread() or sendfile() with an explicit offset.
+ */
+
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+struct fdcache_shard;
+
+struct fdcache_entry {
+  char *path;
+  int fd;
+  struct stat st;
+  int refcount;
+  struct fdcache_shard *shard;        /* The table it came from. */
+  struct fdcache_entry *hash_next;
+  struct fdcache_entry *prev, *next;
+};
+
+/*
+ * Opens ROOT as the document root and starts the invalidation thread. Keeps
+ * up to MAX_ENTRIES descriptors open; 0 disables caching (but not the
+ * confined lookups). Exits if ROOT can't be opened.
+ */
+void fdcache_init(char *root, int max_entries);
+
+/*
+ * Gives the calling thread a table of its own, holding up to the same number
+ * of entries, for the rest of its life. Threads that don't call it share one.
+ */
+void fdcache_attach_shard(void);
+
+/* The document root directory fd. */
+int fdcache_root(void);
+
+/*
+ * Turns the path of a request ("/a%20b/./c?x=1") into a key relative to the
+ * root ("a b/c", or "." for the root itself). Returns -1 if the path is
+ * malformed or contains a ".." component.
+ */
+int fdcache_normalize_path(char *request_path, char *out, size_t size);
+
+/*
+ * Returns the entry for PATH, a normalized path, opening it if needed. Returns
+ * NULL and sets errno if it doesn't exist or resolves outside the root.
+ */
+struct fdcache_entry *fdcache_open(char *path);
+void fdcache_release(struct fdcache_entry *entry);
+
+/*
+ * Opens the directory PATH, a normalized path, beneath the root without
+ * caching it, e.g. to create files in. Returns -1 and sets errno on failure.
+ */
+int fdcache_open_directory(char *path);
+
+/*
+ * Returns the size of PATH if it is in the cache, or -1. Never touches the
+ * filesystem, so it is cheap enough for guessing a request's cost.
+ */
+off_t fdcache_cached_size(char *path);
+
+#endif
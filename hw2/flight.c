@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "flight.h"
+#include "libhttp.h"
+#include "utlist.h"
+
+#define FLIGHT_BUCKETS 1024
+
+struct flight_chunk {
+  struct flight_chunk *next;
+  size_t length;
+  char data[FLIGHT_CHUNK_SIZE];
+};
+
+struct flight_member {
+  struct flight *flight;
+  int leader;
+  int event_fd;                 /* Written to wake a waiting follower. */
+  int waiting;
+  size_t offset;                /* Bytes of the response sent so far. */
+  struct flight_member *prev, *next;
+};
+
+struct flight {
+  struct http_copy copy;        /* What libhttp hands the leader's bytes to. */
+  char *key;
+  pthread_mutex_t lock;
+  struct flight_chunk *head, *tail;
+  size_t head_offset;           /* Where HEAD starts in the response. */
+  size_t length;                /* Of the response so far. */
+  int open;                     /* Taking followers. */
+  int done;
+  int failed;                   /* Bytes were lost; followers are cut off. */
+  int aborted;                  /* Not for followers: they fetch their own. */
+  int status_code;
+  int refcount;                 /* Members, leader included. */
+  struct flight_member *followers;
+  struct flight *hash_next;
+};
+
+static struct flight *buckets[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long flight_hash(char *key) {
+  unsigned long hash = 5381;
+  while (*key)
+    hash = hash * 33 + (unsigned char) *key++;
+  return hash % FLIGHT_BUCKETS;
+}
+
+/* Wakes every follower waiting for more. Caller holds FLIGHT->lock. */
+static void flight_wake(struct flight *flight) {
+  struct flight_member *member;
+  uint64_t one = 1;
+  DL_FOREACH(flight->followers, member) {
+    /* Only fails if the count is about to overflow, which wakes it anyway. */
+    if (member->waiting && write(member->event_fd, &one, sizeof(one)) == sizeof(one))
+      member->waiting = 0;
+  }
+}
+
+/* Waits until MEMBER is woken; the caller checks again what changed. */
+static void flight_wait(struct flight_member *member) {
+  struct pollfd pollfd = { .fd = member->event_fd, .events = POLLIN };
+  uint64_t count;
+  if (coro_poll(&pollfd, 1, -1) == 1)
+    while (read(member->event_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+      ;
+}
+
+/*
+ * Once the flight is closed to newcomers, frees the chunks every follower
+ * has sent. Caller holds FLIGHT->lock.
+ */
+static void flight_trim(struct flight *flight) {
+  struct flight_member *member;
+  size_t sent = flight->length;
+
+  if (flight->open)
+    return;
+  DL_FOREACH(flight->followers, member)
+    if (member->offset < sent)
+      sent = member->offset;
+
+  while (flight->head && flight->head_offset + flight->head->length <= sent
+      && (flight->head != flight->tail || flight->head->length == FLIGHT_CHUNK_SIZE)) {
+    struct flight_chunk *chunk = flight->head;
+    flight->head = chunk->next;
+    flight->head_offset += chunk->length;
+    if (chunk == flight->tail)
+      flight->tail = NULL;
+    free(chunk);
+  }
+}
+
+/* Appends what the leader sends its client. */
+static void flight_write(struct http_copy *copy, const char *data, size_t size) {
+  struct flight *flight = (struct flight *) copy;
+
+  pthread_mutex_lock(&flight->lock);
+  while (size > 0 && !flight->failed) {
+    struct flight_chunk *chunk = flight->tail;
+    if (!chunk || chunk->length == FLIGHT_CHUNK_SIZE) {
+      if (!(chunk = malloc(sizeof(struct flight_chunk)))) {
+        flight->failed = 1;
+        break;
+      }
+      chunk->next = NULL;
+      chunk->length = 0;
+      if (flight->tail)
+        flight->tail->next = chunk;
+      else
+        flight->head = chunk;
+      flight->tail = chunk;
+    }
+    size_t length = FLIGHT_CHUNK_SIZE - chunk->length;
+    if (length > size) length = size;
+    memcpy(chunk->data + chunk->length, data, length);
+    chunk->length += length;
+    flight->length += length;
+    data += length;
+    size -= length;
+  }
+
+  if (flight->length > FLIGHT_MAX_SHARED)
+    flight->open = 0;
+  flight_wake(flight);
+  flight_trim(flight);
+  pthread_mutex_unlock(&flight->lock);
+}
+
+/* Drops MEMBER's reference to its flight. Caller holds FLIGHT->lock, which this releases. */
+static void flight_leave(struct flight_member *member) {
+  struct flight *flight = member->flight;
+  if (!member->leader)
+    DL_DELETE(flight->followers, member);
+  int last = --flight->refcount == 0;
+  pthread_mutex_unlock(&flight->lock);
+
+  if (member->event_fd != -1)
+    close(member->event_fd);
+  free(member);
+  if (!last)
+    return;
+
+  while (flight->head) {
+    struct flight_chunk *chunk = flight->head;
+    flight->head = chunk->next;
+    free(chunk);
+  }
+  pthread_mutex_destroy(&flight->lock);
+  free(flight->key);
+  free(flight);
+}
+
+struct flight_member *flight_join(char *key, int fd) {
+  struct flight_member *member = calloc(1, sizeof(struct flight_member));
+  if (!member)
+    return NULL;
+  member->event_fd = -1;
+
+  unsigned long bucket = flight_hash(key);
+  struct flight *flight;
+  pthread_mutex_lock(&flight_lock);
+  for (flight = buckets[bucket]; flight; flight = flight->hash_next) {
+    if (strcmp(flight->key, key) != 0)
+      continue;
+    pthread_mutex_lock(&flight->lock);
+    if (flight->open) {
+      member->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (member->event_fd == -1) {
+        pthread_mutex_unlock(&flight->lock);
+        break;
+      }
+      member->flight = flight;
+      flight->refcount++;
+      DL_APPEND(flight->followers, member);
+      pthread_mutex_unlock(&flight->lock);
+      pthread_mutex_unlock(&flight_lock);
+      return member;
+    }
+    pthread_mutex_unlock(&flight->lock);
+  }
+
+  /* No flight to join: lead a new one. */
+  flight = calloc(1, sizeof(struct flight));
+  if (!flight || !(flight->key = strdup(key))) {
+    pthread_mutex_unlock(&flight_lock);
+    free(flight);
+    free(member);
+    return NULL;
+  }
+  flight->copy.fd = fd;
+  flight->copy.write = flight_write;
+  pthread_mutex_init(&flight->lock, NULL);
+  flight->open = 1;
+  flight->refcount = 1;
+  flight->hash_next = buckets[bucket];
+  buckets[bucket] = flight;
+  pthread_mutex_unlock(&flight_lock);
+
+  member->flight = flight;
+  member->leader = 1;
+  http_copy = &flight->copy;
+  return member;
+}
+
+int flight_is_leader(struct flight_member *member) {
+  return !member || member->leader;
+}
+
+/* Stops the leader's flight taking newcomers; it may already have. */
+static void flight_unhash(struct flight *flight) {
+  pthread_mutex_lock(&flight_lock);
+  struct flight **link = &buckets[flight_hash(flight->key)];
+  while (*link && *link != flight)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = flight->hash_next;
+  pthread_mutex_unlock(&flight_lock);
+}
+
+void flight_abort(struct flight_member *member) {
+  if (!member)
+    return;
+  struct flight *flight = member->flight;
+  http_copy = NULL;
+  flight_unhash(flight);
+
+  pthread_mutex_lock(&flight->lock);
+  flight->open = 0;
+  /* Once followers have had bytes of it, all they can be told is that it broke off. */
+  if (flight->length == 0)
+    flight->aborted = 1;
+  else
+    flight->failed = 1;
+  flight_wake(flight);
+  pthread_mutex_unlock(&flight->lock);
+}
+
+void flight_finish(struct flight_member *member, int status_code) {
+  if (!member)
+    return;
+  struct flight *flight = member->flight;
+  http_copy = NULL;
+  flight_unhash(flight);
+
+  pthread_mutex_lock(&flight->lock);
+  flight->open = 0;
+  flight->done = 1;
+  flight->status_code = status_code;
+  flight_wake(flight);
+  flight_leave(member);
+}
+
+int flight_follow(struct flight_member *member, int fd) {
+  struct flight *flight = member->flight;
+
+  pthread_mutex_lock(&flight->lock);
+  while (!flight->aborted) {
+    if (member->offset < flight->length) {
+      /* Bytes are never changed once written, so they are sent unlocked. */
+      struct flight_chunk *chunk = flight->head;
+      size_t start = flight->head_offset;
+      while (start + chunk->length <= member->offset) {
+        start += chunk->length;
+        chunk = chunk->next;
+      }
+      size_t skip = member->offset - start;
+      size_t length = chunk->length - skip;
+      pthread_mutex_unlock(&flight->lock);
+      http_send_data(fd, chunk->data + skip, length);
+      pthread_mutex_lock(&flight->lock);
+      member->offset += length;
+      flight_trim(flight);
+      continue;
+    }
+    if (flight->done || flight->failed)
+      break;
+
+    member->waiting = 1;
+    pthread_mutex_unlock(&flight->lock);
+    flight_wait(member);
+    pthread_mutex_lock(&flight->lock);
+  }
+
+  int status_code = flight->aborted ? FLIGHT_ABORTED
+    : flight->failed ? 0 : flight->status_code;
+  flight_leave(member);
+  return status_code;
+}
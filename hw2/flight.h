@@ -0,0 +1,76 @@
+/*
+ * Single-flight request coalescing for proxy mode.
+ *
+ * When several clients ask for the same URL at once, only the first (the
+ * leader) fetches it from upstream. Everything the leader sends its client
+ * is also appended to a shared buffer of reference-counted chunks, and the
+ * other clients (followers) are sent the same bytes from it as they arrive,
+ * starting from the first, however late they joined. The flight ends with
+ * the leader's response; later requests start a new one.
+ *
+ * Usage example:
+ *
+ *     struct flight_member *member = flight_join(key, fd);
+ *     if (flight_is_leader(member)) {
+ *       ... fetch and send the response as usual ...
+ *       flight_finish(member, status_code);
+ *     } else {
+ *       status_code = flight_follow(member, fd);
+ *     }
+ *
+ * A leader whose response turns out to be meant for its client alone (see
+ * cache_response_is_shareable()) calls flight_abort() before sending any of
+ * it, and its followers are then left to fetch their own.
+ *
+ * The buffer is kept whole until FLIGHT_MAX_SHARED bytes have gone through
+ * it. Past that the flight takes no more followers, and chunks are freed as
+ * soon as every follower has sent them, so a large download costs no more
+ * than the distance between the leader and its slowest follower.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+
+/* Bytes per chunk of a flight's buffer. */
+#define FLIGHT_CHUNK_SIZE 65536
+
+/* Bytes after which a flight stops taking followers. */
+#define FLIGHT_MAX_SHARED (8 << 20)
+
+/* What flight_follow() returns if the leader's response wasn't for followers. */
+#define FLIGHT_ABORTED -1
+
+struct flight_member;
+
+/*
+ * Joins the flight in progress for KEY, or starts one with the caller as
+ * its leader. From then on, until flight_finish(), whatever the leader sends
+ * its client on FD with libhttp is shared with the flight's followers. Returns NULL if out of
+ * memory, which makes the caller a leader without followers.
+ */
+struct flight_member *flight_join(char *key, int fd);
+
+int flight_is_leader(struct flight_member *member);
+
+/*
+ * Sends the leader's followers away to fetch their own response, and stops
+ * sharing what it sends. Must come before the leader has sent its client
+ * anything; after that, the followers' responses are only cut off. The
+ * leader still calls flight_finish().
+ */
+void flight_abort(struct flight_member *member);
+
+/* Ends the leader's flight, whose response had STATUS_CODE (0 if none). */
+void flight_finish(struct flight_member *member, int status_code);
+
+/*
+ * Sends a follower's client on FD the leader's response, as it comes, then
+ * leaves the flight. Returns the leader's status code, 0 if the response
+ * was cut off, or FLIGHT_ABORTED if the leader aborted the flight, in which
+ * case nothing was sent.
+ */
+int flight_follow(struct flight_member *member, int fd);
+
+#endif
@@ -1,21 +1,43 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "affinity.h"
+#include "bundle.h"
+#include "cache.h"
+#include "coro.h"
+#include "dirlist.h"
+#include "fastcgi.h"
+#include "fdcache.h"
+#include "flight.h"
 #include "libhttp.h"
+#include "plugin.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "upload.h"
+#include "upstream.h"
 #include "wq.h"
 
 /*
@@ -30,7 +52,239 @@ int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+char *server_fastcgi_address;
+int server_fastcgi_connections = 16;
+int server_cpu_affinity;
+int server_numa;
+size_t server_cache_size;
+size_t server_cache_disk_size;
+char *server_cache_directory;
+char *server_health_check_path;
+int server_health_check_interval = 5;
+char *server_access_log;
+int server_fd_cache_size = 1024;
+int server_rate_limit_clients = 1 << 20;
+char *server_trace_path;
+int server_trace_sample = 1;
+char *server_bundle_path;
+size_t server_access_log_max_size;
+size_t server_max_upload_size;
+int server_sort_listings;
+int server_backlog = 1024;
+int server_defer_accept = 1;
+int server_fastopen;
+
+/*
+ * Worker threads. With --cpu-affinity every worker is pinned to its own core
+ * and owns a private queue, so the listener can hand each connection to the
+ * worker running on the CPU that received its packets.
+ */
+#define WORKER_BUFFER_SIZE 65536
+
+struct worker {
+  pthread_t thread;
+  int cpu;                       /* -1 if the worker floats. */
+  wq_t *queue;
+  char *buffer;                  /* WORKER_BUFFER_SIZE bytes, node-local. */
+  void (*request_handler)(int);
+};
+
+struct worker *workers;
+int worker_for_cpu[CPU_SETSIZE];
+__thread struct worker *current_worker;
+
+/*
+ * Returns the calling worker's scratch buffer (WORKER_BUFFER_SIZE bytes), or
+ * NULL when requests are served on the listener thread.
+ */
+char *worker_buffer() {
+  return current_worker ? current_worker->buffer : NULL;
+}
+
+
+void send_error_page(int fd, int status_code, char *message);
+int request_is_rate_limited(int fd, struct http_request *request);
+int request_is_for_plugin(int fd, struct http_request *request);
+
+/* Sends the regular file behind ENTRY, named PATH, as a 200 response. */
+void send_file(int fd, char *path, struct fdcache_entry *entry, int head_only) {
+  char content_length[24];
+  snprintf(content_length, sizeof(content_length), "%lld",
+      (long long) entry->st.st_size);
+
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", http_get_mime_type(path));
+  http_send_header(fd, "Content-Length", content_length);
+  http_end_headers(fd);
+  if (!head_only)
+    http_send_file(fd, entry->fd, 0, entry->st.st_size);
+}
+
+/*
+ * Output for a generated page. It is sent in PAGE_BUFFER_SIZE pieces, as
+ * chunks to HTTP/1.1 clients and as plain data, ended by closing the
+ * connection, to older ones.
+ */
+#define PAGE_BUFFER_SIZE 4096
+
+struct page_buffer {
+  int fd;
+  int chunked;
+  size_t length;
+  char data[PAGE_BUFFER_SIZE];
+};
+
+void page_flush(struct page_buffer *page) {
+  if (page->chunked)
+    http_send_chunk(page->fd, page->data, page->length);
+  else
+    http_send_data(page->fd, page->data, page->length);
+  page->length = 0;
+}
+
+void page_append(struct page_buffer *page, char *data, size_t size) {
+  while (size > 0) {
+    size_t length = PAGE_BUFFER_SIZE - page->length;
+    if (length > size) length = size;
+    memcpy(page->data + page->length, data, length);
+    page->length += length;
+    data += length;
+    size -= length;
+    if (page->length == PAGE_BUFFER_SIZE)
+      page_flush(page);
+  }
+}
+
+void page_append_string(struct page_buffer *page, char *string) {
+  page_append(page, string, strlen(string));
+}
 
+/* Appends NAME with the characters HTML gives meaning to escaped. */
+void page_append_html_escaped(struct page_buffer *page, char *name) {
+  for (; *name; name++) {
+    char *entity = NULL;
+    switch (*name) {
+      case '&': entity = "&amp;"; break;
+      case '<': entity = "&lt;"; break;
+      case '>': entity = "&gt;"; break;
+      case '"': entity = "&quot;"; break;
+      case '\'': entity = "&#39;"; break;
+    }
+    if (entity)
+      page_append_string(page, entity);
+    else
+      page_append(page, name, 1);
+  }
+}
+
+/*
+ * Sends a page linking to every entry of the directory behind ENTRY, chunked
+ * if CHUNKED is set, so the page is streamed as it is read. Memory use is
+ * bounded however many entries there are, sorted or not (see dirlist.h).
+ */
+void send_directory_listing(int fd, struct fdcache_entry *entry, int head_only,
+    int chunked) {
+  /* ENTRY->fd is shared, so read the directory through a descriptor of our own. */
+  int directory_fd = openat(entry->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory_fd == -1) {
+    send_error_page(fd, 403, "403 Forbidden");
+    return;
+  }
+  struct dirlist *list = NULL;
+  if (head_only)
+    close(directory_fd);
+  else if (!(list = dirlist_open(directory_fd, server_sort_listings))) {
+    send_error_page(fd, 500, "500 Internal Server Error");
+    return;
+  }
+
+  if (chunked)
+    http_start_chunked_response(fd, 200);
+  else
+    http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_end_headers(fd);
+  if (head_only)
+    return;
+
+  struct page_buffer page = { .fd = fd, .chunked = chunked };
+  char *name;
+  int is_directory, status;
+  page_append_string(&page, "<html><body><ul>\n");
+  while ((status = dirlist_next(list, &name, &is_directory)) == 1) {
+    char *suffix = is_directory ? "/" : "";
+    page_append_string(&page, "<li><a href=\"");
+    page_append_html_escaped(&page, name);
+    page_append_string(&page, suffix);
+    page_append_string(&page, "\">");
+    page_append_html_escaped(&page, name);
+    page_append_string(&page, suffix);
+    page_append_string(&page, "</a></li>\n");
+  }
+  dirlist_close(list);
+
+  /* A listing cut off by a read error is left unterminated, so the client can tell. */
+  if (status == -1) {
+    page_flush(&page);
+    return;
+  }
+  page_append_string(&page, "</ul></body></html>\n");
+  page_flush(&page);
+  if (chunked)
+    http_end_chunks(fd);
+}
+
+/* Whether the path of REQUEST_PATH, without its query, ends in a slash. */
+int request_path_has_slash(char *request_path) {
+  size_t length = strcspn(request_path, "?#");
+  return length > 0 && request_path[length - 1] == '/';
+}
+
+/*
+ * Redirects a directory to "dir/", keeping any query after the slash;
+ * relative links in its page only work there.
+ */
+void send_directory_redirect(int fd, char *request_path) {
+  size_t length = strcspn(request_path, "?#");
+  char *location = malloc(strlen(request_path) + 2);
+  if (!location) {
+    send_error_page(fd, 500, "500 Internal Server Error");
+    return;
+  }
+  sprintf(location, "%.*s/%s", (int) length, request_path, request_path + length);
+  http_start_response(fd, 301);
+  http_send_header(fd, "Location", location);
+  http_end_headers(fd);
+  free(location);
+}
+
+/*
+ * Stores the body of a PUT or POST under the document root at the request's
+ * path, creating or atomically replacing the file (see upload.h).
+ */
+void handle_upload(int fd, struct http_request *request) {
+  char path[PATH_MAX];
+  int status_code = 404;
+  if (fdcache_normalize_path(request->path, path, sizeof(path)) == 0)
+    status_code = upload_receive(fd, request, path, server_max_upload_size);
+  trace_phase(TRACE_OPENED);
+
+  if (status_code == 201 || status_code == 204) {
+    /* A 204 must not carry Content-Length (RFC 9110, section 8.6). */
+    http_start_response(fd, status_code);
+    if (status_code == 201) {
+      http_send_header(fd, "Location", request->path);
+      http_send_header(fd, "Content-Length", "0");
+    }
+    http_end_headers(fd);
+    return;
+  }
+
+  char message[64];
+  snprintf(message, sizeof(message), "%d %s", status_code,
+      http_get_response_message(status_code));
+  send_error_page(fd, status_code, message);
+}
 
 /*
  * Reads an HTTP request from stream (fd), and writes an HTTP response
@@ -42,158 +296,1218 @@ int server_proxy_port;
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * Paths are resolved beneath the document root by fdcache_open(), so hot
+ * files are served from an already open descriptor. With --max-upload-size,
+ * PUT and POST store their body at the path instead.
  */
 void handle_files_request(int fd) {
+  struct http_request *request = http_request_parse(fd);
+  if (!request) {
+    send_error_page(fd, 400, "400 Bad Request");
+    return;
+  }
+  accesslog_set_request(request->method, request->path);
+  trace_parsed(request->method, request->path);
+  if (request_is_rate_limited(fd, request)
+      || request_is_for_plugin(fd, request)) {
+    http_request_free(request);
+    return;
+  }
 
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
+  if (server_max_upload_size && (strcmp(request->method, "PUT") == 0
+        || strcmp(request->method, "POST") == 0)) {
+    handle_upload(fd, request);
+    http_request_free(request);
+    return;
+  }
 
+  int head_only = strcmp(request->method, "HEAD") == 0;
+  if (strcmp(request->method, "GET") != 0 && !head_only) {
+    send_error_page(fd, 405, "405 Method Not Allowed");
+    http_request_free(request);
+    return;
+  }
+
+  char path[PATH_MAX];
+  struct fdcache_entry *entry = NULL;
+  if (fdcache_normalize_path(request->path, path, sizeof(path)) == 0)
+    entry = fdcache_open(path);
+  trace_phase(TRACE_OPENED);
+  if (!entry) {
+    send_error_page(fd, 404, "404 Not Found");
+    http_request_free(request);
+    return;
+  }
+
+  if (S_ISREG(entry->st.st_mode)) {
+    send_file(fd, path, entry, head_only);
+  } else if (!S_ISDIR(entry->st.st_mode)) {
+    send_error_page(fd, 403, "403 Forbidden");
+  } else if (!request_path_has_slash(request->path)) {
+    send_directory_redirect(fd, request->path);
+  } else {
+    char index_path[PATH_MAX + 16];
+    snprintf(index_path, sizeof(index_path), "%s/index.html", path);
+    struct fdcache_entry *index = fdcache_open(index_path);
+    if (index && S_ISREG(index->st.st_mode))
+      send_file(fd, index_path, index, head_only);
+    else
+      send_directory_listing(fd, entry, head_only,
+          request->minor_version >= 1);
+    if (index)
+      fdcache_release(index);
+  }
+
+  fdcache_release(entry);
+  http_request_free(request);
+}
+
+/*
+ * Serves a request from the bundle mapped by --bundle, like
+ * handle_files_request() but without touching the filesystem: every
+ * response was prepared by mkbundle and is just looked up and sent.
+ */
+void handle_bundle_request(int fd) {
   struct http_request *request = http_request_parse(fd);
+  if (!request) {
+    send_error_page(fd, 400, "400 Bad Request");
+    return;
+  }
+  accesslog_set_request(request->method, request->path);
+  trace_parsed(request->method, request->path);
+  if (request_is_rate_limited(fd, request)
+      || request_is_for_plugin(fd, request)) {
+    http_request_free(request);
+    return;
+  }
 
-  http_start_response(fd, 200);
+  int head_only = strcmp(request->method, "HEAD") == 0;
+  char path[PATH_MAX];
+  struct bundle_entry *entry = NULL;
+  if (strcmp(request->method, "GET") != 0 && !head_only)
+    send_error_page(fd, 405, "405 Method Not Allowed");
+  else if (fdcache_normalize_path(request->path, path, sizeof(path)) != 0
+      || !(entry = bundle_lookup(path)))
+    send_error_page(fd, 404, "404 Not Found");
+  else if ((entry->flags & BUNDLE_DIRECTORY)
+      && !request_path_has_slash(request->path))
+    send_directory_redirect(fd, request->path);
+  else {
+    trace_phase(TRACE_OPENED);
+    bundle_send(fd, entry, bundle_choose_variant(entry,
+          http_request_get_header(request, "Accept-Encoding")), head_only,
+        http_request_get_header(request, "If-None-Match"));
+  }
+
+  http_request_free(request);
+}
+
+
+void send_error_page(int fd, int status_code, char *message) {
+  http_start_response(fd, status_code);
   http_send_header(fd, "Content-Type", "text/html");
   http_end_headers(fd);
-  http_send_string(fd,
-      "<center>"
-      "<h1>Welcome to httpserver!</h1>"
-      "<hr>"
-      "<p>Nothing's here yet.</p>"
-      "</center>");
+  http_send_string(fd, "<center><h1>");
+  http_send_string(fd, message);
+  http_send_string(fd, "</h1><hr></center>");
+}
+
+/* Turns a rate-limited client away, telling it when to try again. */
+void send_too_many_requests(int fd, int retry_after) {
+  char seconds[16];
+  snprintf(seconds, sizeof(seconds), "%d", retry_after);
+  http_start_response(fd, 429);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_send_header(fd, "Retry-After", seconds);
+  http_end_headers(fd);
+  http_send_string(fd, "<center><h1>429 Too Many Requests</h1><hr></center>");
+}
+
+/*
+ * Charges REQUEST against the per-prefix rate limits, and answers it with 429
+ * if they're exceeded. Returns 1 if it did, in which case the caller is done.
+ */
+int request_is_rate_limited(int fd, struct http_request *request) {
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+
+  if (!ratelimit_enabled()
+      || getpeername(fd, (struct sockaddr *) &address, &length) == -1)
+    return 0;
+  int retry_after = ratelimit_check_request(address.sin_addr, request->path);
+  if (!retry_after)
+    return 0;
+  send_too_many_requests(fd, retry_after);
+  return 1;
+}
+
+/*
+ * Hands REQUEST to the --plugin whose prefix covers its path, if any, and
+ * returns 1 once it has been answered.
+ */
+int request_is_for_plugin(int fd, struct http_request *request) {
+  struct plugin *plugin;
+
+  if (!plugin_count() || !(plugin = plugin_find(request->path)))
+    return 0;
+  trace_phase(TRACE_OPENED);
+  if (plugin_serve(plugin, fd, request) != 0 && http_bytes_sent == 0)
+    send_error_page(fd, 500, "500 Internal Server Error");
+  return 1;
+}
+
+/*
+ * Relays bytes in both directions between the client (fd) and the proxy
+ * target (upstream_fd) until the target closes its side. The bytes already
+ * consumed while parsing REQUEST are forwarded first. Returns the status code
+ * of the target's response, or 0 if it didn't look like HTTP.
+ */
+int proxy_relay(int fd, int upstream_fd, struct http_request *request,
+    char *buffer, size_t buffer_size) {
+  int status_code = -1;
+  http_send_data(upstream_fd, request->raw, request->raw_length);
+
+  struct pollfd fds[2] = {
+    { .fd = fd, .events = POLLIN },
+    { .fd = upstream_fd, .events = POLLIN },
+  };
+
+  while (1) {
+    if (coro_poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      return status_code < 0 ? 0 : status_code;
+    }
+
+    if (fds[0].revents) {
+      ssize_t bytes = coro_read(fd, buffer, buffer_size);
+      if (bytes <= 0) {
+        /* Client is done sending; keep relaying the response. */
+        shutdown(upstream_fd, SHUT_WR);
+        fds[0].fd = -1;
+      } else {
+        http_send_data(upstream_fd, buffer, bytes);
+      }
+    }
+
+    if (fds[1].revents) {
+      ssize_t bytes = coro_read(upstream_fd, buffer, buffer_size);
+      if (bytes <= 0)
+        return status_code < 0 ? 0 : status_code;
+      if (status_code < 0) {
+        /* "HTTP/x.y SSS" */
+        status_code = 0;
+        if (bytes >= 12 && strncmp(buffer, "HTTP/", 5) == 0)
+          status_code = atoi(buffer + 9);
+      }
+      http_send_data(fd, buffer, bytes);
+    }
+  }
+}
+
+/* Headers that only make sense on a single connection, never forwarded. */
+int is_hop_by_hop_header(char *key) {
+  return strcasecmp(key, "Connection") == 0
+    || strcasecmp(key, "Keep-Alive") == 0
+    || strcasecmp(key, "Proxy-Connection") == 0
+    || strcasecmp(key, "TE") == 0
+    || strcasecmp(key, "Upgrade") == 0;
+}
+
+/*
+ * Rebuilds the head of RESPONSE, read into DATA, without its framing: the
+ * status line, then every header but Transfer-Encoding, Content-Length and
+ * the hop-by-hop ones, then EXTRA_HEADERS. Returns the new head, blank line
+ * included, in memory the caller frees.
+ */
+char *proxy_unframed_head(char *data, struct http_response *response,
+    char *extra_headers, size_t *length) {
+  char *head;
+  FILE *out = open_memstream(&head, length);
+  int i;
+
+  fwrite(data, 1, strcspn(data, "\n") + 1, out);
+  for (i = 0; i < response->num_headers; i++) {
+    char *key = response->headers[i].key;
+    if (strcasecmp(key, "Transfer-Encoding") == 0
+        || strcasecmp(key, "Content-Length") == 0 || is_hop_by_hop_header(key))
+      continue;
+    fprintf(out, "%s: %s\r\n", key, response->headers[i].value);
+  }
+  fprintf(out, "%s\r\n", extra_headers);
+  fclose(out);
+  return head;
 }
 
+/*
+ * Streams a chunked upstream body to the client: re-chunked for HTTP/1.1
+ * clients, or decoded and ended by closing the connection for older ones.
+ * RESPONSE_DATA holds the head and the first SIZE - header_length bytes of
+ * the body, in a malloc'd buffer of CAPACITY bytes that this frees. While
+ * the decoded body fits in the cache's object limit it is collected there
+ * and, once the last chunk is in, stored with a Content-Length in place of
+ * the chunked framing.
+ */
+void proxy_stream_chunked(int fd, int upstream_fd, struct http_request *request,
+    char *response_data, size_t size, size_t capacity,
+    struct http_response *response, char *buffer, size_t buffer_size) {
+  struct http_chunked_decoder decoder;
+  int chunked = request->minor_version >= 1;
+  int storable = cache_enabled() && cache_response_is_storable(response);
+  size_t header_length = response->header_length;
+  /* One byte of slack, so a body of exactly the limit can still finish. */
+  size_t limit = header_length + cache_object_limit() + 1;
+  size_t head_length;
+
+  char *head = proxy_unframed_head(response_data, response,
+      chunked ? "Transfer-Encoding: chunked\r\nConnection: close\r\n" : "",
+      &head_length);
+  http_send_data(fd, head, head_length);
+  free(head);
+
+  http_chunked_decoder_init(&decoder);
+  char *target = response_data + header_length;
+  ssize_t bytes = size - header_length;
+  size = header_length;
+
+  while (1) {
+    bytes = http_chunked_decode(&decoder, target, bytes);
+    if (bytes < 0)
+      break;
+    if (chunked)
+      http_send_chunk(fd, target, bytes);
+    else
+      http_send_data(fd, target, bytes);
+    if (storable)
+      size += bytes;
+    if (decoder.done)
+      break;
+
+    /* Keep collecting for the cache only while the body may still fit. */
+    if (storable && size == capacity) {
+      size_t grown = capacity * 2 > limit ? limit : capacity * 2;
+      char *bigger = capacity >= limit ? NULL : realloc(response_data, grown);
+      if (bigger) {
+        response_data = bigger;
+        capacity = grown;
+      } else {
+        storable = 0;
+      }
+    }
+    target = storable ? response_data + size : buffer;
+    size_t target_size = storable ? capacity - size : buffer_size;
+
+    bytes = coro_read(upstream_fd, target, target_size);
+    if (bytes < 0 && errno == EINTR) {
+      bytes = 0;
+      continue;
+    }
+    if (bytes <= 0)
+      break;
+  }
+
+  /* A truncated body must not look complete to the client. */
+  if (!decoder.done) {
+    free(response_data);
+    return;
+  }
+  if (chunked)
+    http_end_chunks(fd);
+
+  if (storable) {
+    char content_length[48];
+    snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n",
+        size - header_length);
+    head = proxy_unframed_head(response_data, response, content_length,
+        &head_length);
+    char *stored = malloc(head_length + size - header_length);
+    struct http_response *stored_response = NULL;
+    if (stored) {
+      memcpy(stored, head, head_length);
+      memcpy(stored + head_length, response_data + header_length,
+          size - header_length);
+      stored_response = http_response_parse(stored, head_length);
+    }
+    if (stored_response)
+      cache_store(request->path, stored, head_length + size - header_length,
+          stored_response);
+    http_response_free(stored_response);
+    free(stored);
+    free(head);
+  }
+  free(response_data);
+}
 
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
+ * Fetches a cacheable GET from the proxy target and streams the response to
+ * the client, storing a copy in the cache when the response allows it. If a
+ * stale ENTRY is given it is revalidated with a conditional request, and a
+ * 304 from the target is answered from the cache. UPSTREAM_FD is connected
+ * to UPSTREAM, whose name is sent as the Host if the client gave none. If
+ * the request leads a FLIGHT and the response is not one to share, the
+ * flight is aborted before any of it is sent. Returns the status code of
+ * the target's response, or 0 if none was received.
+ */
+int proxy_fetch_cacheable(int fd, int upstream_fd, struct upstream *upstream,
+    struct flight_member *flight, struct http_request *request,
+    struct cache_entry *entry, char *buffer, size_t buffer_size) {
+  char *upstream_request;
+  size_t upstream_request_length;
+  FILE *out = open_memstream(&upstream_request, &upstream_request_length);
+  int i;
+
+  /*
+   * HTTP/1.1 with Connection: close, so the response ends when the socket
+   * does unless it is chunked, which proxy_stream_chunked() then undoes.
+   */
+  fprintf(out, "%s %s HTTP/1.1\r\n", request->method, request->path);
+  if (!http_request_get_header(request, "Host"))
+    fprintf(out, "Host: %s\r\n", upstream->hostname);
+  for (i = 0; i < request->num_headers; i++) {
+    char *key = request->headers[i].key;
+    if (is_hop_by_hop_header(key))
+      continue;
+    if (entry && (strcasecmp(key, "If-None-Match") == 0
+          || strcasecmp(key, "If-Modified-Since") == 0))
+      continue;
+    fprintf(out, "%s: %s\r\n", key, request->headers[i].value);
+  }
+  if (entry && entry->etag)
+    fprintf(out, "If-None-Match: %s\r\n", entry->etag);
+  if (entry && entry->last_modified)
+    fprintf(out, "If-Modified-Since: %s\r\n", entry->last_modified);
+  fprintf(out, "Connection: close\r\n\r\n");
+  fclose(out);
+
+  http_send_data(upstream_fd, upstream_request, upstream_request_length);
+  free(upstream_request);
+
+  /* Read until we have the whole response head. */
+  size_t capacity = buffer_size, size = 0;
+  char *response_data = malloc(capacity);
+  struct http_response *response = NULL;
+  ssize_t bytes;
+
+  if (!response_data) {
+    send_error_page(fd, 502, "502 Bad Gateway");
+    return 0;
+  }
+  while (!response) {
+    if (size == capacity) {
+      /* A head we can't hold is treated like one that never ends. */
+      char *bigger = capacity >= 8 * buffer_size ? NULL
+        : realloc(response_data, capacity * 2);
+      if (!bigger) break;
+      response_data = bigger;
+      capacity *= 2;
+    }
+    bytes = coro_read(upstream_fd, response_data + size, capacity - size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) break;
+    size += bytes;
+    response = http_response_parse(response_data, size);
+  }
+
+  if (!response) {
+    if (size > 0)
+      http_send_data(fd, response_data, size);
+    else
+      send_error_page(fd, 502, "502 Bad Gateway");
+    free(response_data);
+    return 0;
+  }
+
+  if (!cache_response_is_shareable(response))
+    flight_abort(flight);
+
+  int status_code = response->status_code;
+  if (entry && status_code == 304) {
+    cache_entry_revalidated(entry, response);
+    cache_entry_send(fd, entry);
+    http_response_free(response);
+    free(response_data);
+    return status_code;
+  }
+
+  char *transfer_encoding = http_response_get_header(response,
+      "Transfer-Encoding");
+  if (transfer_encoding && strcasestr(transfer_encoding, "chunked")) {
+    proxy_stream_chunked(fd, upstream_fd, request, response_data, size,
+        capacity, response, buffer, buffer_size);
+    http_response_free(response);
+    return status_code;
+  }
+
+  int storable = cache_response_is_storable(response);
+  /* One byte of slack, so a body of exactly the limit still sees EOF. */
+  size_t limit = response->header_length + cache_object_limit() + 1;
+  http_send_data(fd, response_data, size);
+
+  while (1) {
+    char *target = buffer;
+    size_t target_size = buffer_size;
+
+    /* While the response may still be stored, read straight into the copy. */
+    if (storable && size == capacity) {
+      size_t grown = capacity * 2 > limit ? limit : capacity * 2;
+      char *bigger = capacity >= limit ? NULL : realloc(response_data, grown);
+      if (bigger) {
+        response_data = bigger;
+        capacity = grown;
+      } else {
+        storable = 0;
+        free(response_data);
+        response_data = NULL;
+      }
+    }
+    if (storable) {
+      target = response_data + size;
+      target_size = capacity - size;
+    }
+
+    bytes = coro_read(upstream_fd, target, target_size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0) storable = 0;
+    if (bytes <= 0) break;
+    http_send_data(fd, target, bytes);
+    if (storable) size += bytes;
+  }
+
+  char *content_length = http_response_get_header(response, "Content-Length");
+  if (storable && content_length
+      && strtoull(content_length, NULL, 10) != size - response->header_length)
+    storable = 0; /* Truncated. */
+  if (storable)
+    cache_store(request->path, response_data, size, response);
+
+  http_response_free(response);
+  free(response_data);
+  return status_code;
+}
+
+/*
+ * Relays traffic to/from the stream fd and the proxy target. HTTP requests
+ * from the client (fd) are sent to the proxy target, and HTTP responses from
+ * the proxy target are sent to the client (fd).
  *
  *   +--------+     +------------+     +--------------+
  *   | client | <-> | httpserver | <-> | proxy target |
  *   +--------+     +------------+     +--------------+
+ *
+ * The proxy target is picked among the --proxy upstreams by the --lb policy.
+ * With --cache-size, cacheable GETs are answered from the shared response
+ * cache when a fresh copy is stored, without contacting any upstream, and
+ * concurrent misses for the same URL share a single fetch (see flight.h).
  */
 void handle_proxy_request(int fd) {
+  char stack_buffer[8192];
+  char *buffer = worker_buffer();
+  size_t buffer_size = WORKER_BUFFER_SIZE;
+  if (!buffer) {
+    buffer = stack_buffer;
+    buffer_size = sizeof(stack_buffer);
+  }
+
+  struct http_request *request = http_request_parse(fd);
+  if (!request) {
+    send_error_page(fd, 400, "400 Bad Request");
+    return;
+  }
+  accesslog_set_request(request->method, request->path);
+  trace_parsed(request->method, request->path);
+  if (request_is_rate_limited(fd, request)
+      || request_is_for_plugin(fd, request)) {
+    http_request_free(request);
+    return;
+  }
+
+  int cacheable = cache_enabled() && cache_request_is_cacheable(request);
+  struct cache_entry *entry = NULL;
+  if (cacheable) {
+    entry = cache_lookup(request->path);
+    if (entry && cache_entry_is_fresh(entry)
+        && !cache_request_wants_revalidation(request)) {
+      accesslog_set_status(200); /* Only 200s are ever stored. */
+      cache_entry_send(fd, entry);
+      cache_release(entry);
+      http_request_free(request);
+      return;
+    }
+  }
 
   /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+   * Requests that get the same response can share one fetch. Conditional and
+   * range requests are passed upstream as they are, so they can't, and nor
+   * can requests with cookies, whose responses may be the client's own. The
+   * response is framed for the client's HTTP version and may be negotiated
+   * on the Accept headers, so those are in the key.
+   */
+  struct flight_member *flight = NULL;
+  if (cacheable && !http_request_get_header(request, "If-None-Match")
+      && !http_request_get_header(request, "If-Modified-Since")
+      && !http_request_get_header(request, "Range")
+      && !http_request_get_header(request, "Cookie")) {
+    char *accept = http_request_get_header(request, "Accept");
+    char *accept_encoding = http_request_get_header(request, "Accept-Encoding");
+    char *accept_language = http_request_get_header(request, "Accept-Language");
+    char *key;
+    if (asprintf(&key, "1.%d %s\n%s\n%s\n%s", request->minor_version,
+          request->path, accept ? accept : "",
+          accept_encoding ? accept_encoding : "",
+          accept_language ? accept_language : "") >= 0) {
+      flight = flight_join(key, fd);
+      free(key);
+    }
+    if (!flight_is_leader(flight)) {
+      int status_code = flight_follow(flight, fd);
+      flight = NULL;
+      if (status_code != FLIGHT_ABORTED) {
+        accesslog_set_status(status_code);
+        if (entry)
+          cache_release(entry);
+        http_request_free(request);
+        return;
+      }
+      /* The leader's response was its client's alone: fetch our own. */
+    }
+  }
+
+  struct upstream *upstream;
+  uint64_t upstream_start = accesslog_now();
+  int upstream_fd = upstream_connect(&upstream);
+  int status_code = 502;
+  trace_phase(TRACE_OPENED);
+  if (upstream_fd < 0) {
+    send_error_page(fd, 502, "502 Bad Gateway");
+  } else {
+    if (cacheable)
+      status_code = proxy_fetch_cacheable(fd, upstream_fd, upstream, flight,
+          request, entry, buffer, buffer_size);
+    else
+      status_code = proxy_relay(fd, upstream_fd, request, buffer, buffer_size);
+    close(upstream_fd);
+    upstream_release(upstream, status_code);
+    accesslog_set_status(status_code);
+  }
+  accesslog_add_upstream_time(accesslog_now() - upstream_start);
+  flight_finish(flight, status_code);
+
+  if (entry)
+    cache_release(entry);
+  http_request_free(request);
+}
+
+/*
+ * Has a FastCGI worker at the --fastcgi address answer the request, over a
+ * connection borrowed from the pool (see fastcgi.h).
+ */
+void handle_fastcgi_request(int fd) {
+  char stack_buffer[8192];
+  char *buffer = worker_buffer();
+  size_t buffer_size = WORKER_BUFFER_SIZE;
+  if (!buffer) {
+    buffer = stack_buffer;
+    buffer_size = sizeof(stack_buffer);
+  }
+
+  struct http_request *request = http_request_parse(fd);
+  if (!request) {
+    send_error_page(fd, 400, "400 Bad Request");
+    return;
+  }
+  accesslog_set_request(request->method, request->path);
+  trace_parsed(request->method, request->path);
+  if (request_is_rate_limited(fd, request)
+      || request_is_for_plugin(fd, request)) {
+    http_request_free(request);
+    return;
+  }
+
+  uint64_t upstream_start = accesslog_now();
+  int reused;
+  int worker_fd = fastcgi_connect(&reused);
+  trace_phase(TRACE_OPENED);
+  if (worker_fd < 0
+      || fastcgi_serve(worker_fd, reused, fd, request, buffer, buffer_size) < 0)
+    send_error_page(fd, 502, "502 Bad Gateway");
+  accesslog_add_upstream_time(accesslog_now() - upstream_start);
+
+  http_request_free(request);
+}
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+/* Connections accepted but not yet closed, whether queued or being served. */
+int connections_in_flight;
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+/* The count this thread's connections are kept in; each core has its own. */
+__thread int *thread_connections_in_flight = &connections_in_flight;
+
+/* Serves one accepted connection with REQUEST_HANDLER, then closes it. */
+void serve_client(void (*request_handler)(int), int client_socket_fd) {
+  trace_begin(client_socket_fd);
+  accesslog_begin(client_socket_fd);
+  http_reset_tallies();
+  request_handler(client_socket_fd);
+  accesslog_end(http_status_sent, http_bytes_sent);
+  trace_end(http_status_sent, http_bytes_sent);
+  close(client_socket_fd);
+  __atomic_sub_fetch(thread_connections_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+void *worker_main(void *argument) {
+  struct worker *worker = argument;
+  current_worker = worker;
+
+  if (worker->cpu >= 0) {
+    if (affinity_pin_self(worker->cpu) == -1)
+      fprintf(stderr, "Failed to pin worker to CPU %d (ignoring)\n", worker->cpu);
+    if (server_numa && affinity_bind_memory_local() == -1)
+      perror("Failed to set NUMA memory policy (ignoring)");
+  }
+
+  /* Allocated after pinning so the pages are faulted in on our own node. */
+  worker->buffer = affinity_alloc_local(WORKER_BUFFER_SIZE, server_numa);
+  if (!worker->buffer) {
+    perror("Failed to allocate worker buffer");
     exit(errno);
   }
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+  while (1) {
+    int client_socket_fd = wq_pop(worker->queue);
+    serve_client(worker->request_handler, client_socket_fd);
   }
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+  return NULL;
+}
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+void init_thread_pool(int num_threads, void (*request_handler)(int)) {
+  int i;
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+  for (i = 0; i < CPU_SETSIZE; i++)
+    worker_for_cpu[i] = -1;
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+  if (num_threads < 1)
     return;
 
+  workers = calloc(num_threads, sizeof(struct worker));
+  if (!workers) {
+    perror("Failed to allocate thread pool");
+    exit(errno);
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    struct worker *worker = &workers[i];
+    worker->request_handler = request_handler;
+    worker->cpu = -1;
+    worker->queue = &work_queue;
+
+    if (server_cpu_affinity) {
+      /* Workers get the CPUs after the listener's, wrapping if oversubscribed. */
+      worker->cpu = affinity_cpu_at(i + 1);
+      if (worker_for_cpu[worker->cpu] == -1) {
+        worker_for_cpu[worker->cpu] = i;
+        worker->queue = malloc(sizeof(wq_t));
+        wq_init(worker->queue);
+      } else {
+        worker->queue = workers[worker_for_cpu[worker->cpu]].queue;
+      }
+    }
+
+    int error = pthread_create(&worker->thread, NULL, worker_main, worker);
+    if (error) {
+      fprintf(stderr, "Failed to create worker thread: %s\n", strerror(error));
+      exit(error);
+    }
   }
+}
 
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
+/*
+ * Picks the queue that should serve CLIENT_SOCKET_FD: the queue of the worker
+ * pinned to the CPU the connection arrived on, if any, or else the next
+ * worker in round-robin order.
+ */
+wq_t *dispatch_queue(int client_socket_fd) {
+  static int next_worker;
+
+  if (!server_cpu_affinity)
+    return &work_queue;
+
+  int cpu = affinity_incoming_cpu(client_socket_fd);
+  if (cpu >= 0 && cpu < CPU_SETSIZE && worker_for_cpu[cpu] != -1)
+    return workers[worker_for_cpu[cpu]].queue;
+
+  next_worker = (next_worker + 1) % num_threads;
+  return workers[next_worker].queue;
 }
 
+/*
+ * Guesses what serving CLIENT_SOCKET_FD will cost, in response bytes, for
+ * wq_push(). The request line is peeked at without consuming it, and looked
+ * up only in what is already in memory: the descriptor cache, the bundle or
+ * the proxy cache. Proxy requests that need an upstream count as large,
+ * since they may hold a worker for a long time.
+ */
+#define PROXY_UPSTREAM_COST (1 << 20)
+
+size_t estimate_request_cost(int client_socket_fd,
+    void (*request_handler)(int)) {
+  char peek[1024], path[PATH_MAX];
+  ssize_t length = recv(client_socket_fd, peek, sizeof(peek) - 1,
+      MSG_PEEK | MSG_DONTWAIT);
+  if (length <= 0)
+    return WQ_COST_UNKNOWN;
+  peek[length] = '\0';
 
-void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  /*
-   * TODO: Part of your solution for Task 2 goes here!
-   */
+  /* "METHOD /path HTTP/1.x" */
+  char *start = strchr(peek, ' '), *end;
+  if (!start || !(end = strpbrk(++start, " \r\n")))
+    return WQ_COST_UNKNOWN;
+  *end = '\0';
+
+  if (request_handler == handle_fastcgi_request)
+    return PROXY_UPSTREAM_COST;
+  if (request_handler == handle_proxy_request) {
+    struct cache_entry *entry = cache_enabled() ? cache_lookup(start) : NULL;
+    size_t cost = PROXY_UPSTREAM_COST;
+    if (entry && cache_entry_is_fresh(entry))
+      cost = entry->body_length;
+    if (entry)
+      cache_release(entry);
+    return cost;
+  }
+
+  if (fdcache_normalize_path(start, path, sizeof(path)) != 0)
+    return 0; /* Answered with an error page. */
+  if (request_handler == handle_bundle_request) {
+    struct bundle_entry *entry = bundle_lookup(path);
+    return entry ? entry->variants[BUNDLE_IDENTITY].body_length : 0;
+  }
+  off_t size = fdcache_cached_size(path);
+  return size >= 0 ? (size_t) size : WQ_COST_UNKNOWN;
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Coroutine mode (--coroutines): connections are served by coroutines on
+ * num_threads scheduler threads instead of one thread each, so slow clients
+ * and upstreams only hold a stack rather than a thread.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+int server_coroutines;
+int server_shared_nothing;
+void (*coroutine_request_handler)(int);
+
+void core_serve_client(int client_socket_fd);
+
+void coroutine_main(int client_socket_fd) {
+  if (server_shared_nothing)
+    core_serve_client(client_socket_fd);
+  else
+    serve_client(coroutine_request_handler, client_socket_fd);
+}
+
+static void *locate_http_status_sent(void) {
+  return &http_status_sent;
+}
+
+static void *locate_http_bytes_sent(void) {
+  return &http_bytes_sent;
+}
+
+static void *locate_http_copy(void) {
+  return &http_copy;
+}
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+/* Per-request thread-locals, which each coroutine must keep to itself. */
+void init_coroutines(int num_schedulers, void (*request_handler)(int)) {
+  coro_register_local(locate_http_status_sent, sizeof(http_status_sent));
+  coro_register_local(locate_http_bytes_sent, sizeof(http_bytes_sent));
+  coro_register_local(locate_http_copy, sizeof(http_copy));
+  coro_register_local(accesslog_request_state, accesslog_request_state_size());
+  coro_register_local(trace_request_state, trace_request_state_size());
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  coroutine_request_handler = request_handler;
+  coro_runtime_start(num_schedulers, coroutine_main);
+}
+
+/*
+ * Answers a connection over its client's rate limit with 429 straight from
+ * the listener, so that it never occupies a worker. Whatever part of the
+ * request has already arrived is read first: closing a socket with unread
+ * data resets it, and the client might never see the response.
+ */
+void reject_client(int client_socket_fd, int retry_after) {
+  char discard[4096];
+  accesslog_begin(client_socket_fd);
+  http_reset_tallies();
+  while (recv(client_socket_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+    ;
+  send_too_many_requests(client_socket_fd, retry_after);
+  accesslog_end(http_status_sent, http_bytes_sent);
+  shutdown(client_socket_fd, SHUT_WR);
+  close(client_socket_fd);
+}
+
+/*
+ * Shared-nothing mode (--shared-nothing): a thread per core, each pinned to
+ * its CPU and running its own event loop (a coroutine scheduler) that accepts
+ * from its own SO_REUSEPORT listening socket, so the kernel spreads incoming
+ * connections over the cores and each is served start to finish where it
+ * landed. Cores keep their own descriptor cache shard and in-flight count,
+ * and what they allocate comes from glibc's per-thread malloc arenas,
+ * node-local with --numa. The only traffic between cores is the messages
+ * posted to the descriptor cache shards; state that is per-client or
+ * per-upstream by nature (rate limits, the proxy cache, upstream health)
+ * stays shared.
+ */
+struct core {
+  int cpu;
+  int connections_in_flight;
+} __attribute__((aligned(64)));
+
+struct core *cores;
+int num_cores;
+
+void core_thread_init(int index) {
+  struct core *core = &cores[index];
+  if (affinity_pin_self(core->cpu) == -1)
+    fprintf(stderr, "Failed to pin core %d to CPU %d (ignoring)\n", index, core->cpu);
+  if (server_numa && affinity_bind_memory_local() == -1)
+    perror("Failed to set NUMA memory policy (ignoring)");
+  if (coroutine_request_handler == handle_files_request)
+    fdcache_attach_shard();
+  thread_connections_in_flight = &core->connections_in_flight;
+}
+
+/* Serves a connection a core accepted itself, rate limiting it first. */
+void core_serve_client(int client_socket_fd) {
+  if (ratelimit_enabled()) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_length = sizeof(client_address);
+    int retry_after = 0;
+    if (getpeername(client_socket_fd, (struct sockaddr *) &client_address,
+          &client_address_length) == 0)
+      retry_after = ratelimit_check_connection(client_address.sin_addr);
+    if (retry_after) {
+      reject_client(client_socket_fd, retry_after);
+      return;
+    }
+  }
+
+  __atomic_add_fetch(thread_connections_in_flight, 1, __ATOMIC_RELAXED);
+  trace_accepted(client_socket_fd);
+  trace_enqueued(client_socket_fd);
+  serve_client(coroutine_request_handler, client_socket_fd);
+}
+
+/* Connections in flight on all cores, for draining. */
+int count_connections_in_flight(void) {
+  int count = __atomic_load_n(&connections_in_flight, __ATOMIC_ACQUIRE);
+  int i;
+  for (i = 0; i < num_cores; i++)
+    count += __atomic_load_n(&cores[i].connections_in_flight, __ATOMIC_ACQUIRE);
+  return count;
+}
+
+/*
+ * Hot upgrade. SIGUSR2 makes the listener exec a fresh copy of the server
+ * (from the command line saved in server_argv) and hand it the listening
+ * socket. This process then stops accepting, waits up to
+ * UPGRADE_DRAIN_TIMEOUT seconds for connections in flight to finish, and
+ * exits.
+ */
+#define UPGRADE_DRAIN_TIMEOUT 30
+
+char **server_argv;
+volatile sig_atomic_t upgrade_requested;
+
+void upgrade_signal_handler(int signum) {
+  upgrade_requested = 1;
+}
+
+void upgrade_and_drain(int *sockets, int count) {
+  upgrade_requested = 0;
+  printf("Upgrading: starting new server...\n");
+  fflush(stdout);
+  if (upgrade_spawn(server_argv, sockets, count) == -1)
+    return;
+
+  printf("New server is up; draining %d connections\n",
+      count_connections_in_flight());
+  if (server_shared_nothing)
+    coro_stop_listening();
+  int i;
+  for (i = 0; i < count; i++)
+    close(sockets[i]);
+
+  int waited_ms = 0;
+  while (count_connections_in_flight() > 0
+      && waited_ms < UPGRADE_DRAIN_TIMEOUT * 1000) {
+    usleep(10000);
+    waited_ms += 10;
+  }
+  if (count_connections_in_flight() == 0)
+    plugin_unload_all();
+  printf("Drained; exiting\n");
+  exit(0);
+}
+
+/* With --trace, SIGUSR1 makes the listener write out the trace. */
+volatile sig_atomic_t trace_requested;
+
+void trace_signal_handler(int signum) {
+  trace_requested = 1;
+}
+
+/*
+ * Opens a TCP stream socket listening on all interfaces on server_port. With
+ * REUSE_PORT set, several such sockets can listen at once, and the kernel
+ * spreads connections over them. Returns -1 if the port can't be bound.
+ */
+int open_listening_socket(int reuse_port) {
+  struct sockaddr_in server_address;
+
+  int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-        sizeof(socket_option)) == -1) {
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+        sizeof(socket_option)) == -1
+      || (reuse_port && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1)) {
     perror("Failed to set socket options");
     exit(errno);
   }
 
+  /*
+   * Only wake accept() once the request has arrived, so that
+   * estimate_request_cost() finds it. The value is how many seconds to wait
+   * for it before accepting the connection anyway.
+   */
+  socket_option = server_defer_accept;
+  if (server_defer_accept && setsockopt(socket_number, IPPROTO_TCP,
+        TCP_DEFER_ACCEPT, &socket_option, sizeof(socket_option)) == -1)
+    perror("Failed to set TCP_DEFER_ACCEPT (ignoring)");
+
+  /*
+   * Let clients that have been here before send the request in the SYN. The
+   * value bounds the handshakes pending with data; the kernel also needs
+   * net.ipv4.tcp_fastopen to allow it for servers.
+   */
+  socket_option = server_fastopen;
+  if (server_fastopen && setsockopt(socket_number, IPPROTO_TCP, TCP_FASTOPEN,
+        &socket_option, sizeof(socket_option)) == -1)
+    perror("Failed to set TCP_FASTOPEN (ignoring)");
+
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
-    perror("Failed to bind on socket");
-    exit(errno);
+    int saved_errno = errno;
+    close(socket_number);
+    errno = saved_errno;
+    return -1;
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(socket_number, server_backlog) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
+  return socket_number;
+}
+
+/*
+ * Routes SIGUSR1 and SIGUSR2 to the handlers above. No SA_RESTART, so that
+ * they interrupt accept(). They stay blocked until the caller unblocks them.
+ */
+void install_listener_signal_handlers(void) {
+  struct sigaction listener_action;
+  memset(&listener_action, 0, sizeof(listener_action));
+  listener_action.sa_handler = upgrade_signal_handler;
+  sigaction(SIGUSR2, &listener_action, NULL);
+  listener_action.sa_handler = trace_signal_handler;
+  sigaction(SIGUSR1, &listener_action, NULL);
+}
+
+/*
+ * Runs --shared-nothing: starts a core per --num-threads (default: per
+ * allowed CPU), each with a listening socket of its own, and then only waits
+ * for signals. Never returns.
+ */
+void serve_shared_nothing(void (*request_handler)(int)) {
+  int i;
+
+  num_cores = num_threads > 0 ? num_threads : affinity_num_cpus();
+  cores = aligned_alloc(__alignof__(struct core), num_cores * sizeof(struct core));
+  int *sockets = calloc(num_cores, sizeof(int));
+  if (!cores || !sockets) {
+    perror("Failed to allocate cores");
+    exit(errno);
+  }
+  memset(cores, 0, num_cores * sizeof(struct core));
+
+  int num_sockets = upgrade_inherit_sockets(sockets, num_cores);
+  if (num_sockets > 0)
+    printf("Inherited %d listening sockets from old server\n", num_sockets);
+  while (num_sockets < num_cores) {
+    int socket_number = open_listening_socket(1);
+    if (socket_number == -1 && num_sockets == 0) {
+      perror("Failed to bind on socket");
+      exit(errno);
+    }
+    /* An old server without SO_REUSEPORT: share the sockets it handed over. */
+    if (socket_number == -1)
+      break;
+    sockets[num_sockets++] = socket_number;
+  }
+  printf("Listening on port %d on %d cores...\n", server_port, num_cores);
+
+  for (i = 0; i < num_cores; i++)
+    cores[i].cpu = affinity_cpu_at(i);
+  coro_set_thread_init(core_thread_init);
+  init_coroutines(num_cores, request_handler);
+  for (i = 0; i < num_cores; i++)
+    if (coro_listen(i, sockets[i % num_sockets]) == -1) {
+      perror("Failed to listen on core");
+      exit(errno);
+    }
+
+  /* With the signals blocked but between sigsuspend()s, none can be missed. */
+  install_listener_signal_handlers();
+  upgrade_notify_ready();
+
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+  while (1) {
+    if (upgrade_requested)
+      upgrade_and_drain(sockets, num_sockets);
+    if (trace_requested) {
+      trace_requested = 0;
+      trace_dump();
+    }
+    sigsuspend(&no_signals);
+  }
+}
+
+/* Connections accepted per wakeup of the listener, at most. */
+#define ACCEPT_BATCH 64
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number. For each accepted
+ * connection, calls request_handler with the accepted fd number.
+ *
+ * When started by a hot upgrade, the listening socket is inherited from the
+ * old server instead.
+ *
+ * The listener sleeps in poll() rather than accept(), and each time it wakes
+ * takes every connection already waiting, up to ACCEPT_BATCH, so a burst
+ * costs one wakeup rather than one per connection.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  struct sockaddr_in client_address;
+  socklen_t client_address_length;
+  int client_socket_number, i;
+
+  if (server_shared_nothing)
+    serve_shared_nothing(request_handler);
+
+  if (upgrade_inherit_sockets(socket_number, 1) == 1) {
+    printf("Inherited listening socket %d from old server\n", *socket_number);
+  } else if ((*socket_number = open_listening_socket(0)) == -1) {
+    perror("Failed to bind on socket");
+    exit(errno);
+  }
 
   printf("Listening on port %d...\n", server_port);
 
-  init_thread_pool(num_threads, request_handler);
+  if (server_cpu_affinity && affinity_pin_self(affinity_cpu_at(0)) == -1)
+    fprintf(stderr, "Failed to pin listener to CPU %d (ignoring)\n",
+        affinity_cpu_at(0));
+
+  if (server_coroutines)
+    init_coroutines(num_threads > 0 ? num_threads : 1, request_handler);
+  else
+    init_thread_pool(num_threads, request_handler);
+
+  /* Every other thread exists now with SIGUSR1 and SIGUSR2 blocked, so they land here. */
+  install_listener_signal_handlers();
+  sigset_t listener_signals;
+  sigemptyset(&listener_signals);
+  sigaddset(&listener_signals, SIGUSR1);
+  sigaddset(&listener_signals, SIGUSR2);
+  pthread_sigmask(SIG_UNBLOCK, &listener_signals, NULL);
+
+  /*
+   * An old server handing this socket over is in upgrade_spawn() until we
+   * are ready, so it never sees the flag change under a blocking accept().
+   */
+  fcntl(*socket_number, F_SETFL, fcntl(*socket_number, F_GETFL) | O_NONBLOCK);
+  /* Coroutines only ever use non-blocking sockets; workers block on theirs. */
+  int accept_flags = SOCK_CLOEXEC | (server_coroutines ? SOCK_NONBLOCK : 0);
+
+  upgrade_notify_ready();
 
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
-    if (client_socket_number < 0) {
-      perror("Error accepting socket");
+    if (upgrade_requested)
+      upgrade_and_drain(socket_number, 1);
+    if (trace_requested) {
+      trace_requested = 0;
+      trace_dump();
+    }
+
+    struct pollfd listener = { .fd = *socket_number, .events = POLLIN };
+    if (poll(&listener, 1, -1) == -1) {
+      if (errno != EINTR)
+        perror("Error waiting for connections");
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+      client_address_length = sizeof(client_address);
+      client_socket_number = accept4(*socket_number,
+          (struct sockaddr *) &client_address, &client_address_length,
+          accept_flags);
+      if (client_socket_number < 0) {
+        if (errno == ECONNABORTED)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          perror("Error accepting socket");
+        break;
+      }
+
+      int retry_after = ratelimit_check_connection(client_address.sin_addr);
+      if (retry_after) {
+        reject_client(client_socket_number, retry_after);
+        continue;
+      }
+
+      __atomic_add_fetch(&connections_in_flight, 1, __ATOMIC_RELAXED);
+      trace_accepted(client_socket_number);
 
-    // TODO: Change me?
-    request_handler(client_socket_number);
-    close(client_socket_number);
+      if (server_coroutines) {
+        trace_enqueued(client_socket_number);
+        coro_dispatch(client_socket_number);
+        continue;
+      }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+      if (num_threads > 0) {
+        size_t cost = estimate_request_cost(client_socket_number, request_handler);
+        /* Before the push: once queued, the slot belongs to the worker. */
+        trace_enqueued(client_socket_number);
+        wq_push(dispatch_queue(client_socket_number), client_socket_number, cost);
+        continue;
+      }
+
+      trace_enqueued(client_socket_number);
+
+      serve_client(request_handler, client_socket_number);
+    }
   }
 
   shutdown(*socket_number, SHUT_RDWR);
@@ -210,19 +1524,84 @@ void signal_callback_handler(int signum) {
 
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "       ./httpserver --bundle files.bundle --port 8000 (packed by ./mkbundle)\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "       ./httpserver --proxy host1:8001=3,host2:8001 --lb least-conn --port 8000\n"
+  "       ./httpserver --fastcgi unix:/tmp/app.sock --port 8000 (or --fastcgi HOST:PORT)\n"
+  "\n"
+  "Options:\n"
+  "  --cpu-affinity   Pin the listener and each worker to its own CPU\n"
+  "  --numa           Like --cpu-affinity, and keep worker memory on the local node\n"
+  "  --cache-size N   Cache proxied responses in up to N bytes of memory (k/m/g)\n"
+  "  --cache-dir DIR  Spill cached responses that don't fit in memory to DIR\n"
+  "  --cache-disk-size N  Bound the bytes spilled to --cache-dir (default 1g)\n"
+  "  --fastcgi-connections N  Keep up to N idle connections to --fastcgi workers (default 16)\n"
+  "  --fastcgi-param NAME=VALUE  Pass NAME to --fastcgi workers with every request\n"
+  "  --lb POLICY      Balance upstreams by round-robin (default), least-conn or p2c\n"
+  "  --health-check PATH  Probe every upstream with GET PATH, ejecting failures\n"
+  "  --health-interval N  Seconds between health probes (default 5)\n"
+  "  --access-log PATH    Log every request to PATH (\"-\" for stdout)\n"
+  "  --access-log-max-size N  Rotate the access log when it reaches N bytes\n"
+  "  --max-upload-size N  Accept PUT and POST uploads of up to N bytes under --files (k/m/g)\n"
+  "  --sort-listings  Sort directory listings by name (in bounded memory, spilling to TMPDIR)\n"
+  "  --fd-cache N     Keep up to N files under --files open (default 1024, 0 = off)\n"
+  "  --rate-limit RATE[/BURST]  Allow each client RATE connections a second\n"
+  "  --rate-limit-path PREFIX=RATE[/BURST]  Also limit each client's requests under PREFIX\n"
+  "  --rate-limit-clients N  Track up to N clients for rate limiting (default 1048576)\n"
+  "  --trace PATH     Record request phases; SIGUSR1 writes them to PATH as Chrome trace JSON\n"
+  "  --trace-sample N Trace one connection in N (default 1)\n"
+  "  --coroutines     Serve connections as coroutines on --num-threads threads (default 1)\n"
+  "  --shared-nothing Run a pinned event loop with its own listener on each of --num-threads\n"
+  "                   cores (default: every CPU), sharing nothing between them\n"
+  "  --backlog N      Queue up to N connections not yet accepted (default 1024)\n"
+  "  --defer-accept N Accept a connection only once it has sent data, or after N seconds\n"
+  "                   (default 1, 0 = off)\n"
+  "  --fastopen N     Take requests in the SYN with TCP Fast Open, up to N pending (0 = off)\n"
+  "\n"
+  "Send SIGUSR2 to upgrade to a fresh copy of the binary without dropping connections.\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
   exit(EXIT_SUCCESS);
 }
 
+/* Parses a byte count with an optional k, m or g suffix. Returns 0 if invalid. */
+size_t parse_size(char *string) {
+  char *suffix;
+  if (!string) return 0;
+  unsigned long long size = strtoull(string, &suffix, 10);
+  switch (*suffix) {
+    case 'k': case 'K': size <<= 10; suffix++; break;
+    case 'm': case 'M': size <<= 20; suffix++; break;
+    case 'g': case 'G': size <<= 30; suffix++; break;
+  }
+  return *suffix == '\0' ? size : 0;
+}
+
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
 
+  /* A client that hangs up (e.g. mid-upload) must not take the server down. */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Only the listener handles SIGUSR1 and SIGUSR2; threads started before it inherit this. */
+  sigset_t listener_signals;
+  sigemptyset(&listener_signals);
+  sigaddset(&listener_signals, SIGUSR1);
+  sigaddset(&listener_signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &listener_signals, NULL);
+
+  /* Option parsing below rewrites some arguments in place. */
+  server_argv = calloc(argc + 1, sizeof(char *));
+  int j;
+  for (j = 0; j < argc; j++)
+    server_argv[j] = strdup(argv[j]);
+
   /* Default settings */
   server_port = 8000;
   void (*request_handler)(int) = NULL;
+  char **plugin_specs = calloc(argc, sizeof(char *));
+  int num_plugin_specs = 0;
 
   int i;
   for (i = 1; i < argc; i++) {
@@ -234,6 +1613,13 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected argument after --files\n");
         exit_with_usage();
       }
+    } else if (strcmp("--bundle", argv[i]) == 0) {
+      request_handler = handle_bundle_request;
+      server_bundle_path = argv[++i];
+      if (!server_bundle_path) {
+        fprintf(stderr, "Expected argument after --bundle\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
 
@@ -243,14 +1629,47 @@ int main(int argc, char **argv) {
         exit_with_usage();
       }
 
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
-      } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
+      if (upstream_parse_list(proxy_target) < 1) {
+        fprintf(stderr, "Expected HOSTNAME:PORT[=WEIGHT],... after --proxy\n");
+        exit_with_usage();
+      }
+      server_proxy_hostname = upstream_first()->hostname;
+      server_proxy_port = upstream_first()->port;
+    } else if (strcmp("--fastcgi", argv[i]) == 0) {
+      request_handler = handle_fastcgi_request;
+      server_fastcgi_address = argv[++i];
+      if (!server_fastcgi_address) {
+        fprintf(stderr, "Expected argument after --fastcgi\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--fastcgi-connections", argv[i]) == 0) {
+      char *connections_str = argv[++i];
+      if (!connections_str || (server_fastcgi_connections = atoi(connections_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --fastcgi-connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--fastcgi-param", argv[i]) == 0) {
+      if (!argv[++i] || fastcgi_add_param(argv[i]) == -1) {
+        fprintf(stderr, "Expected NAME=VALUE after --fastcgi-param\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--lb", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (!policy || upstream_set_policy(policy) == -1) {
+        fprintf(stderr, "Expected round-robin, least-conn or p2c after --lb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--health-check", argv[i]) == 0) {
+      server_health_check_path = argv[++i];
+      if (!server_health_check_path || server_health_check_path[0] != '/') {
+        fprintf(stderr, "Expected a path after --health-check\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--health-interval", argv[i]) == 0) {
+      char *interval_str = argv[++i];
+      if (!interval_str || (server_health_check_interval = atoi(interval_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --health-interval\n");
+        exit_with_usage();
       }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
@@ -265,6 +1684,109 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--cpu-affinity", argv[i]) == 0) {
+      server_cpu_affinity = 1;
+    } else if (strcmp("--numa", argv[i]) == 0) {
+      server_cpu_affinity = 1;
+      server_numa = 1;
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      if (!(server_cache_size = parse_size(argv[++i]))) {
+        fprintf(stderr, "Expected size in bytes after --cache-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-disk-size", argv[i]) == 0) {
+      if (!(server_cache_disk_size = parse_size(argv[++i]))) {
+        fprintf(stderr, "Expected size in bytes after --cache-disk-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-dir", argv[i]) == 0) {
+      server_cache_directory = argv[++i];
+      if (!server_cache_directory) {
+        fprintf(stderr, "Expected argument after --cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      server_access_log = argv[++i];
+      if (!server_access_log) {
+        fprintf(stderr, "Expected argument after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-max-size", argv[i]) == 0) {
+      if (!(server_access_log_max_size = parse_size(argv[++i]))) {
+        fprintf(stderr, "Expected size in bytes after --access-log-max-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--sort-listings", argv[i]) == 0) {
+      server_sort_listings = 1;
+    } else if (strcmp("--backlog", argv[i]) == 0) {
+      char *backlog_str = argv[++i];
+      if (!backlog_str || (server_backlog = atoi(backlog_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --backlog\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--defer-accept", argv[i]) == 0) {
+      char *defer_accept_str = argv[++i];
+      if (!defer_accept_str || (server_defer_accept = atoi(defer_accept_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --defer-accept\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--fastopen", argv[i]) == 0) {
+      char *fastopen_str = argv[++i];
+      if (!fastopen_str || (server_fastopen = atoi(fastopen_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --fastopen\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--fd-cache", argv[i]) == 0) {
+      char *fd_cache_str = argv[++i];
+      if (!fd_cache_str || (server_fd_cache_size = atoi(fd_cache_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --fd-cache\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rule = argv[++i];
+      if (!rule || rule[0] == '/' || ratelimit_add_rule(rule) == -1) {
+        fprintf(stderr, "Expected RATE[/BURST] after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit-path", argv[i]) == 0) {
+      char *rule = argv[++i];
+      if (!rule || rule[0] != '/' || ratelimit_add_rule(rule) == -1) {
+        fprintf(stderr, "Expected PREFIX=RATE[/BURST] after --rate-limit-path\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit-clients", argv[i]) == 0) {
+      char *clients_str = argv[++i];
+      if (!clients_str || (server_rate_limit_clients = atoi(clients_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --rate-limit-clients\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-upload-size", argv[i]) == 0) {
+      if (!(server_max_upload_size = parse_size(argv[++i]))) {
+        fprintf(stderr, "Expected size in bytes after --max-upload-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--plugin", argv[i]) == 0) {
+      if (!argv[++i]) {
+        fprintf(stderr, "Expected argument after --plugin\n");
+        exit_with_usage();
+      }
+      plugin_specs[num_plugin_specs++] = argv[i];
+    } else if (strcmp("--trace", argv[i]) == 0) {
+      server_trace_path = argv[++i];
+      if (!server_trace_path) {
+        fprintf(stderr, "Expected argument after --trace\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--trace-sample", argv[i]) == 0) {
+      char *sample_str = argv[++i];
+      if (!sample_str || (server_trace_sample = atoi(sample_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --trace-sample\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--coroutines", argv[i]) == 0) {
+      server_coroutines = 1;
+    } else if (strcmp("--shared-nothing", argv[i]) == 0) {
+      server_shared_nothing = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -273,12 +1795,45 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
-    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                    "                      \"--proxy [HOSTNAME:PORT]\"\n");
+  if (server_files_directory == NULL && server_proxy_hostname == NULL
+      && server_bundle_path == NULL && server_fastcgi_address == NULL) {
+    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\", \n"
+                    "                      \"--bundle [FILE]\",\n"
+                    "                      \"--proxy [HOSTNAME:PORT]\" or\n"
+                    "                      \"--fastcgi [ADDRESS]\"\n");
     exit_with_usage();
   }
 
+  if (server_cache_size)
+    cache_init(server_cache_size,
+        server_cache_disk_size ? server_cache_disk_size : (size_t) 1 << 30,
+        server_cache_directory);
+
+  if (request_handler == handle_files_request)
+    fdcache_init(server_files_directory, server_fd_cache_size);
+  else if (request_handler == handle_bundle_request)
+    bundle_open(server_bundle_path);
+  else if (request_handler == handle_fastcgi_request)
+    fastcgi_init(server_fastcgi_address, server_fastcgi_connections);
+
+  ratelimit_init(server_rate_limit_clients);
+
+  if (server_trace_path)
+    trace_init(server_trace_path, server_trace_sample);
+
+  for (i = 0; i < num_plugin_specs; i++)
+    plugin_load(plugin_specs[i]);
+
+  if (server_access_log)
+    accesslog_init(server_access_log, server_access_log_max_size);
+
+  if (server_proxy_hostname && server_health_check_path)
+    upstream_start_health_checks(server_health_check_path,
+        server_health_check_interval);
+
+  wq_init(&work_queue);
+  affinity_init();
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
@@ -2,8 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "coro.h"
 #include "libhttp.h"
 
 #define LIBHTTP_REQUEST_MAX_SIZE 8192
@@ -13,15 +16,97 @@ void http_fatal_error(char *message) {
   exit(ENOBUFS);
 }
 
+/*
+ * Parses "Key: value" lines between START and END (END points just past the
+ * blank line, or at the end of the data if there was none) into a newly
+ * allocated array. Returns the number of headers parsed.
+ */
+static int http_parse_header_lines(char *start, char *end,
+    struct http_header **headers) {
+  int capacity = 0, count = 0;
+  char *line = start;
+
+  *headers = NULL;
+  while (line < end) {
+    char *line_end = memchr(line, '\n', end - line);
+    if (!line_end) line_end = end;
+    char *content_end = line_end;
+    if (content_end > line && content_end[-1] == '\r') content_end--;
+    if (content_end == line) break; /* Blank line: end of headers. */
+
+    char *colon = memchr(line, ':', content_end - line);
+    if (colon) {
+      char *value = colon + 1;
+      while (value < content_end && (*value == ' ' || *value == '\t')) value++;
+      char *value_end = content_end;
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        value_end--;
+
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        *headers = realloc(*headers, capacity * sizeof(struct http_header));
+        if (!*headers) http_fatal_error("Malloc failed");
+      }
+      (*headers)[count].key = strndup(line, colon - line);
+      (*headers)[count].value = strndup(value, value_end - value);
+      if (!(*headers)[count].key || !(*headers)[count].value)
+        http_fatal_error("Malloc failed");
+      count++;
+    }
+
+    line = line_end + 1;
+  }
+  return count;
+}
+
+static char *http_get_header(struct http_header *headers, int num_headers,
+    char *key) {
+  int i;
+  for (i = 0; i < num_headers; i++)
+    if (strcasecmp(headers[i].key, key) == 0)
+      return headers[i].value;
+  return NULL;
+}
+
+static void http_free_headers(struct http_header *headers, int num_headers) {
+  int i;
+  for (i = 0; i < num_headers; i++) {
+    free(headers[i].key);
+    free(headers[i].value);
+  }
+  free(headers);
+}
+
+char *http_find_header_end(char *data, size_t size) {
+  size_t i;
+  for (i = 0; i + 1 < size; i++) {
+    if (data[i] != '\n') continue;
+    if (data[i + 1] == '\n') return data + i + 2;
+    if (i + 2 < size && data[i + 1] == '\r' && data[i + 2] == '\n')
+      return data + i + 3;
+  }
+  return NULL;
+}
+
 struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
+  struct http_request *request = calloc(1, sizeof(struct http_request));
   if (!request) http_fatal_error("Malloc failed");
 
   char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
   if (!read_buffer) http_fatal_error("Malloc failed");
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+  /* Keep reading until the whole header block is in, or the peer stops. */
+  size_t total_read = 0;
+  char *header_end = NULL;
+  while (total_read < LIBHTTP_REQUEST_MAX_SIZE) {
+    ssize_t bytes_read = coro_read(fd, read_buffer + total_read,
+        LIBHTTP_REQUEST_MAX_SIZE - total_read);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) break;
+    total_read += bytes_read;
+    if ((header_end = http_find_header_end(read_buffer, total_read))) break;
+  }
+  read_buffer[total_read] = '\0'; /* Always null-terminate. */
 
   char *read_start, *read_end;
   size_t read_size;
@@ -55,24 +140,88 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end != '\0' && *read_end != '\n') read_end++;
     if (*read_end != '\n') break;
     read_end++;
+    if (strncmp(read_start, " HTTP/1.", 8) == 0 && read_start[8] >= '1'
+        && read_start[8] <= '9')
+      request->minor_version = 1;
 
-    free(read_buffer);
+    /* Read in the headers, up to the blank line. */
+    if (!header_end) header_end = read_buffer + total_read;
+    request->num_headers = http_parse_header_lines(read_end, header_end,
+        &request->headers);
+
+    request->raw = read_buffer;
+    request->raw_length = total_read;
+    request->header_length = header_end - read_buffer;
     return request;
   } while (0);
 
   /* An error occurred. */
+  free(request->method);
+  free(request->path);
   free(request);
   free(read_buffer);
   return NULL;
 
 }
 
+char *http_request_get_header(struct http_request *request, char *key) {
+  return http_get_header(request->headers, request->num_headers, key);
+}
+
+void http_request_free(struct http_request *request) {
+  if (!request) return;
+  free(request->method);
+  free(request->path);
+  http_free_headers(request->headers, request->num_headers);
+  free(request->raw);
+  free(request);
+}
+
+struct http_response *http_response_parse(char *data, size_t size) {
+  char *header_end = http_find_header_end(data, size);
+  if (!header_end) return NULL;
+
+  /* Status line: "HTTP/x.y SSS reason" */
+  if (size < 12 || strncmp(data, "HTTP/", 5) != 0) return NULL;
+  char *status = memchr(data, ' ', header_end - data);
+  if (!status || header_end - status < 4) return NULL;
+  status++;
+  if (status[0] < '1' || status[0] > '5' || status[1] < '0' || status[1] > '9'
+      || status[2] < '0' || status[2] > '9')
+    return NULL;
+
+  struct http_response *response = calloc(1, sizeof(struct http_response));
+  if (!response) http_fatal_error("Malloc failed");
+  response->status_code = (status[0] - '0') * 100 + (status[1] - '0') * 10
+    + (status[2] - '0');
+
+  char *line_end = memchr(data, '\n', header_end - data);
+  response->num_headers = http_parse_header_lines(line_end + 1, header_end,
+      &response->headers);
+  response->header_length = header_end - data;
+  return response;
+}
+
+char *http_response_get_header(struct http_response *response, char *key) {
+  return http_get_header(response->headers, response->num_headers, key);
+}
+
+void http_response_free(struct http_response *response) {
+  if (!response) return;
+  http_free_headers(response->headers, response->num_headers);
+  free(response);
+}
+
 char* http_get_response_message(int status_code) {
   switch (status_code) {
     case 100:
       return "Continue";
     case 200:
       return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +238,68 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 409:
+      return "Conflict";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Payload Too Large";
+    case 429:
+      return "Too Many Requests";
+    case 501:
+      return "Not Implemented";
+    case 502:
+      return "Bad Gateway";
     default:
       return "Internal Server Error";
   }
 }
 
+__thread int http_status_sent;
+__thread size_t http_bytes_sent;
+
+void (*http_first_byte_hook)(void);
+__thread struct http_copy *http_copy;
+
+/* Adds BYTES to the tally of bytes sent. */
+static void http_tally(size_t bytes) {
+  if (http_bytes_sent == 0 && bytes > 0 && http_first_byte_hook)
+    http_first_byte_hook();
+  http_bytes_sent += bytes;
+}
+
+void http_reset_tallies(void) {
+  http_status_sent = 0;
+  http_bytes_sent = 0;
+}
+
+/*
+ * Header lines are formatted into a buffer and sent with http_send_data()
+ * rather than with dprintf(), so they go through coro_write() too.
+ */
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
+  char line[64];
+  http_status_sent = status_code;
+  int length = snprintf(line, sizeof(line), "HTTP/1.0 %d %s\r\n", status_code,
       http_get_response_message(status_code));
+  http_send_data(fd, line, length);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  char line[512];
+  int length = snprintf(line, sizeof(line), "%s: %s\r\n", key, value);
+  if ((size_t) length < sizeof(line)) {
+    http_send_data(fd, line, length);
+    return;
+  }
+  http_send_string(fd, key);
+  http_send_data(fd, ": ", 2);
+  http_send_string(fd, value);
+  http_send_data(fd, "\r\n", 2);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  http_send_data(fd, "\r\n", 2);
 }
 
 void http_send_string(int fd, char *data) {
@@ -113,15 +308,196 @@ void http_send_string(int fd, char *data) {
 
 void http_send_data(int fd, char *data, size_t size) {
   ssize_t bytes_sent;
+  if (http_copy && http_copy->fd == fd && size > 0)
+    http_copy->write(http_copy, data, size);
   while (size > 0) {
-    bytes_sent = write(fd, data, size);
+    bytes_sent = coro_write(fd, data, size);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
     if (bytes_sent < 0)
       return;
+    http_tally(bytes_sent);
     size -= bytes_sent;
     data += bytes_sent;
   }
 }
 
+/*
+ * Sends SIZE bytes of FILE_FD starting at OFFSET, without going through user
+ * space. The file offset of FILE_FD is left alone, so FILE_FD may be shared.
+ */
+void http_send_file(int fd, int file_fd, off_t offset, size_t size) {
+  ssize_t bytes_sent;
+  if (http_copy && http_copy->fd == fd) {
+    /* The copy can't be spliced; read the range through a buffer. */
+    char buffer[8192];
+    off_t position = offset;
+    size_t left = size;
+    while (left > 0) {
+      ssize_t bytes = pread(file_fd, buffer, left < sizeof(buffer) ? left : sizeof(buffer),
+          position);
+      if (bytes < 0 && errno == EINTR) continue;
+      if (bytes <= 0) break;
+      http_copy->write(http_copy, buffer, bytes);
+      position += bytes;
+      left -= bytes;
+    }
+  }
+  while (size > 0) {
+    bytes_sent = coro_sendfile(fd, file_fd, &offset, size);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent <= 0)
+      return;
+    http_tally(bytes_sent);
+    size -= bytes_sent;
+  }
+}
+
+/* Sends all of IOV, like http_send_data(). */
+static void http_send_iov(int fd, struct iovec *iov, int count) {
+  int i;
+  for (i = 0; http_copy && http_copy->fd == fd && i < count; i++)
+    if (iov[i].iov_len > 0)
+      http_copy->write(http_copy, iov[i].iov_base, iov[i].iov_len);
+  while (count > 0) {
+    ssize_t bytes_sent = coro_writev(fd, iov, count);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent < 0)
+      return;
+    http_tally(bytes_sent);
+    while (count > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+}
+
+void http_start_chunked_response(int fd, int status_code) {
+  char line[128];
+  http_status_sent = status_code;
+  int length = snprintf(line, sizeof(line),
+      "HTTP/1.1 %d %s\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n",
+      status_code, http_get_response_message(status_code));
+  http_send_data(fd, line, length);
+}
+
+/* The chunk's size line, payload and CRLF go out in a single writev(). */
+void http_send_chunk(int fd, char *data, size_t size) {
+  char size_line[24];
+  if (size == 0)
+    return; /* An empty chunk would end the body. */
+  struct iovec iov[3] = {
+    { .iov_base = size_line,
+      .iov_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", size) },
+    { .iov_base = data, .iov_len = size },
+    { .iov_base = "\r\n", .iov_len = 2 },
+  };
+  http_send_iov(fd, iov, 3);
+}
+
+void http_end_chunks(int fd) {
+  http_send_data(fd, "0\r\n\r\n", 5);
+}
+
+enum {
+  CHUNK_SIZE_START,             /* Expecting the first hex digit of a size. */
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,              /* Skipping ";name=value" up to the LF. */
+  CHUNK_DATA,
+  CHUNK_DATA_END,               /* Expecting the CRLF after the payload. */
+  CHUNK_TRAILER_START,          /* At the start of a trailer line. */
+  CHUNK_TRAILER,
+  CHUNK_DONE,
+};
+
+void http_chunked_decoder_init(struct http_chunked_decoder *decoder) {
+  decoder->state = CHUNK_SIZE_START;
+  decoder->remaining = 0;
+  decoder->done = 0;
+}
+
+ssize_t http_chunked_decode(struct http_chunked_decoder *decoder, char *data,
+    size_t size) {
+  char *in = data, *end = data + size, *out = data;
+
+  while (in < end && decoder->state != CHUNK_DONE) {
+    char c = *in;
+    int digit;
+
+    switch (decoder->state) {
+      case CHUNK_SIZE_START:
+      case CHUNK_SIZE:
+        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+          digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+          if (decoder->remaining > ((size_t) -1 >> 4))
+            return -1;
+          decoder->remaining = decoder->remaining * 16 + digit;
+          decoder->state = CHUNK_SIZE;
+        } else if (decoder->state == CHUNK_SIZE_START) {
+          return -1;
+        } else if (c == ';' || c == ' ' || c == '\t' || c == '\r') {
+          decoder->state = CHUNK_EXTENSION;
+        } else if (c == '\n') {
+          decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+        } else {
+          return -1;
+        }
+        in++;
+        break;
+
+      case CHUNK_EXTENSION:
+        if (c == '\n')
+          decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+        in++;
+        break;
+
+      case CHUNK_DATA: {
+        size_t length = end - in;
+        if (length > decoder->remaining)
+          length = decoder->remaining;
+        memmove(out, in, length);
+        out += length;
+        in += length;
+        if ((decoder->remaining -= length) == 0)
+          decoder->state = CHUNK_DATA_END;
+        break;
+      }
+
+      case CHUNK_DATA_END:
+        if (c == '\n')
+          decoder->state = CHUNK_SIZE_START;
+        else if (c != '\r')
+          return -1;
+        in++;
+        break;
+
+      case CHUNK_TRAILER_START:
+        if (c == '\n') {
+          decoder->state = CHUNK_DONE;
+          decoder->done = 1;
+        } else if (c != '\r') {
+          decoder->state = CHUNK_TRAILER;
+        }
+        in++;
+        break;
+
+      case CHUNK_TRAILER:
+        if (c == '\n')
+          decoder->state = CHUNK_TRAILER_START;
+        in++;
+        break;
+    }
+  }
+  return out - data;
+}
+
 char *http_get_mime_type(char *file_name) {
   char *file_extension = strrchr(file_name, '.');
   if (file_extension == NULL) {
@@ -20,15 +20,54 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
+struct http_header {
+  char *key;
+  char *value;
+};
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * RAW holds every byte read from the socket so far: the request line, the
+ * header block (HEADER_LENGTH bytes including the blank line) and possibly
+ * the beginning of the body.
  */
 struct http_request {
   char *method;
   char *path;
+  struct http_header *headers;
+  int num_headers;
+  int minor_version;           /* 1 for HTTP/1.1 and later, else 0. */
+  char *raw;
+  size_t raw_length;
+  size_t header_length;
 };
 
 struct http_request *http_request_parse(int fd);
+char *http_request_get_header(struct http_request *request, char *key);
+void http_request_free(struct http_request *request);
+
+/*
+ * Functions for parsing the head of an HTTP response held in memory, e.g. one
+ * read back from an upstream server. Returns NULL if DATA does not yet hold a
+ * complete, well-formed status line and header block.
+ */
+struct http_response {
+  int status_code;
+  struct http_header *headers;
+  int num_headers;
+  size_t header_length;
+};
+
+struct http_response *http_response_parse(char *data, size_t size);
+char *http_response_get_header(struct http_response *response, char *key);
+void http_response_free(struct http_response *response);
+
+/* Returns the end of the header block in DATA (past the blank line), or NULL. */
+char *http_find_header_end(char *data, size_t size);
 
 /*
  * Functions for sending an HTTP response.
@@ -38,10 +77,65 @@ void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
+void http_send_file(int fd, int file_fd, off_t offset, size_t size);
+
+/*
+ * Chunked transfer encoding, for bodies whose length isn't known up front.
+ * Only HTTP/1.1 clients understand it, so check the request's MINOR_VERSION
+ * first. http_start_chunked_response() is used in place of
+ * http_start_response(); the headers are then sent as usual, followed by any
+ * number of http_send_chunk() calls and one http_end_chunks().
+ */
+void http_start_chunked_response(int fd, int status_code);
+void http_send_chunk(int fd, char *data, size_t size);
+void http_end_chunks(int fd);
+
+/*
+ * Decodes a chunked body incrementally, e.g. as it is read from an upstream.
+ * http_chunked_decode() consumes SIZE bytes of DATA and moves the payload
+ * they carry to the front of DATA, returning its length, or -1 if the body
+ * is malformed. DONE is set once the last chunk and trailer are in; any
+ * bytes after them are ignored.
+ */
+struct http_chunked_decoder {
+  int state;
+  size_t remaining;
+  int done;
+};
+
+void http_chunked_decoder_init(struct http_chunked_decoder *decoder);
+ssize_t http_chunked_decode(struct http_chunked_decoder *decoder, char *data,
+    size_t size);
+
+/*
+ * Per-thread tallies of the response being written, e.g. for access logging.
+ * http_start_response() records the status code, and every function above
+ * adds the bytes it wrote. http_reset_tallies() starts over.
+ */
+extern __thread int http_status_sent;
+extern __thread size_t http_bytes_sent;
+void http_reset_tallies(void);
+
+/* If set, called once the first bytes of a response have been written. */
+extern void (*http_first_byte_hook)(void);
+
+/*
+ * If set, everything the functions above are asked to send to HTTP_COPY->fd
+ * is also handed to HTTP_COPY->write(), e.g. to share the response with
+ * other clients. Whether or not the client took it: a copy doesn't end with
+ * the client.
+ */
+struct http_copy {
+  int fd;
+  void (*write)(struct http_copy *copy, const char *data, size_t size);
+};
+extern __thread struct http_copy *http_copy;
 
 /*
- * Helper function: gets the Content-Type based on a file name.
+ * Helper functions: get the reason phrase for a status code, and the
+ * Content-Type based on a file name.
  */
+char *http_get_response_message(int status_code);
 char *http_get_mime_type(char *file_name);
 
 #endif
@@ -0,0 +1,385 @@
+/*
+ * Packs a document root into a bundle for httpserver --bundle; see bundle.h.
+ *
+ *     ./mkbundle [--gzip] DIRECTORY OUTPUT
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bundle.h"
+#include "libhttp.h"
+
+/* Only keep a compressed variant that saves at least this share. */
+#define GZIP_MIN_SAVING 10
+
+struct item {
+  char *path;                   /* Key: normalized, "." for the root. */
+  uint32_t flags;
+  char *body[2];
+  size_t body_length[2];
+  char *head[2];
+  char *etag[2];
+};
+
+static struct item *items;
+static uint32_t num_items, items_capacity;
+static int use_gzip;
+
+static void fail(char *what, char *path) {
+  fprintf(stderr, "mkbundle: %s %s: %s\n", what, path, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+static void out_of_memory(void) {
+  fprintf(stderr, "mkbundle: out of memory\n");
+  exit(EXIT_FAILURE);
+}
+
+static void *checked_malloc(size_t size) {
+  void *pointer = malloc(size ? size : 1);
+  if (!pointer)
+    out_of_memory();
+  return pointer;
+}
+
+static char *read_file(char *path, size_t *length) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    fail("cannot read", path);
+  char *data = checked_malloc(st.st_size);
+  size_t total = 0;
+  while (total < (size_t) st.st_size) {
+    ssize_t bytes = read(fd, data + total, st.st_size - total);
+    if (bytes <= 0)
+      fail("cannot read", path);
+    total += bytes;
+  }
+  close(fd);
+  *length = total;
+  return data;
+}
+
+static uint64_t content_hash(char *data, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  while (length--)
+    hash = (hash ^ (unsigned char) *data++) * 1099511628211ULL;
+  return hash;
+}
+
+static int is_compressible(char *content_type) {
+  return strncmp(content_type, "text/", 5) == 0
+    || strcmp(content_type, "application/javascript") == 0;
+}
+
+/* Returns DATA gzip-compressed, or NULL if that doesn't save enough. */
+static char *gzip(char *data, size_t length, size_t *compressed_length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  /* 16 + MAX_WBITS: a gzip wrapper, as Content-Encoding: gzip requires. */
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t capacity = deflateBound(&stream, length);
+  char *out = checked_malloc(capacity);
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = length;
+  stream.next_out = (Bytef *) out;
+  stream.avail_out = capacity;
+  int status = deflate(&stream, Z_FINISH);
+  *compressed_length = stream.total_out;
+  deflateEnd(&stream);
+
+  if (status != Z_STREAM_END
+      || *compressed_length * 100 > length * (100 - GZIP_MIN_SAVING)) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+/* Fills in the heads and ETags of ITEM, and its gzip variant if worthwhile. */
+static void finish_item(struct item *item, char *content_type) {
+  char etag[48];
+  int variant;
+
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)
+      content_hash(item->body[BUNDLE_IDENTITY], item->body_length[BUNDLE_IDENTITY]));
+  item->etag[BUNDLE_IDENTITY] = strdup(etag);
+
+  if (use_gzip && is_compressible(content_type)) {
+    item->body[BUNDLE_GZIP] = gzip(item->body[BUNDLE_IDENTITY],
+        item->body_length[BUNDLE_IDENTITY], &item->body_length[BUNDLE_GZIP]);
+    if (item->body[BUNDLE_GZIP]) {
+      etag[strlen(etag) - 1] = '\0';
+      strcat(etag, "-gzip\"");
+      item->etag[BUNDLE_GZIP] = strdup(etag);
+    }
+  }
+
+  for (variant = BUNDLE_IDENTITY; variant <= BUNDLE_GZIP; variant++) {
+    if (!item->body[variant])
+      continue;
+    if (asprintf(&item->head[variant],
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: %s\r\n"
+          "Content-Length: %zu\r\n"
+          "ETag: %s\r\n"
+          "%s%s\r\n",
+          content_type, item->body_length[variant], item->etag[variant],
+          variant == BUNDLE_GZIP ? "Content-Encoding: gzip\r\n" : "",
+          item->body[BUNDLE_GZIP] ? "Vary: Accept-Encoding\r\n" : "") == -1)
+      out_of_memory();
+  }
+}
+
+static struct item *new_item(char *path, uint32_t flags) {
+  if (num_items == items_capacity) {
+    items_capacity = items_capacity ? items_capacity * 2 : 64;
+    items = realloc(items, items_capacity * sizeof(struct item));
+    if (!items)
+      out_of_memory();
+  }
+  struct item *item = &items[num_items++];
+  memset(item, 0, sizeof(*item));
+  item->path = strdup(path);
+  item->flags = flags;
+  return item;
+}
+
+/* Appends NAME to the listing in *PAGE with HTML's special characters escaped. */
+static void append_escaped(FILE *page, char *name) {
+  for (; *name; name++) {
+    switch (*name) {
+      case '&': fputs("&amp;", page); break;
+      case '<': fputs("&lt;", page); break;
+      case '>': fputs("&gt;", page); break;
+      case '"': fputs("&quot;", page); break;
+      case '\'': fputs("&#39;", page); break;
+      default: fputc(*name, page);
+    }
+  }
+}
+
+static int skip_dot(const struct dirent *dirent) {
+  return strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0;
+}
+
+/*
+ * Adds the directory at FS_PATH, with key KEY, and everything beneath it.
+ * The directory's own page is its index.html, or else a listing like the
+ * one httpserver --files generates.
+ */
+static void add_directory(char *fs_path, char *key) {
+  struct dirent **names;
+  int count = scandir(fs_path, &names, skip_dot, alphasort);
+  if (count == -1)
+    fail("cannot list", fs_path);
+
+  char *listing;
+  size_t listing_length;
+  FILE *page = open_memstream(&listing, &listing_length);
+  fputs("<html><body><ul>\n", page);
+  if (strcmp(key, ".") != 0)
+    fputs("<li><a href=\"../\">../</a></li>\n", page);
+
+  char *index_path = NULL;
+  int i;
+  for (i = 0; i < count; i++) {
+    char *name = names[i]->d_name, *child_path, *child_key;
+    struct stat st;
+    if (asprintf(&child_path, "%s/%s", fs_path, name) == -1
+        || asprintf(&child_key, "%s/%s", key, name) == -1)
+      out_of_memory();
+    if (strcmp(key, ".") == 0) {
+      free(child_key);
+      child_key = strdup(name);
+    }
+
+    /* Like --files with openat2(RESOLVE_BENEATH): no symlinks. */
+    if (lstat(child_path, &st) == -1)
+      fail("cannot stat", child_path);
+    if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
+      char *suffix = S_ISDIR(st.st_mode) ? "/" : "";
+      fputs("<li><a href=\"", page);
+      append_escaped(page, name);
+      fprintf(page, "%s\">", suffix);
+      append_escaped(page, name);
+      fprintf(page, "%s</a></li>\n", suffix);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      add_directory(child_path, child_key);
+    } else if (S_ISREG(st.st_mode)) {
+      struct item *item = new_item(child_key, 0);
+      item->body[BUNDLE_IDENTITY] = read_file(child_path,
+          &item->body_length[BUNDLE_IDENTITY]);
+      finish_item(item, http_get_mime_type(name));
+      if (strcmp(name, "index.html") == 0)
+        index_path = strdup(child_path);
+    }
+    free(child_path);
+    free(child_key);
+    free(names[i]);
+  }
+  free(names);
+  fputs("</ul></body></html>\n", page);
+  fclose(page);
+
+  struct item *item = new_item(key, BUNDLE_DIRECTORY);
+  if (index_path) {
+    item->body[BUNDLE_IDENTITY] = read_file(index_path,
+        &item->body_length[BUNDLE_IDENTITY]);
+    free(listing);
+    free(index_path);
+  } else {
+    item->body[BUNDLE_IDENTITY] = listing;
+    item->body_length[BUNDLE_IDENTITY] = listing_length;
+  }
+  finish_item(item, "text/html");
+}
+
+static uint64_t align(uint64_t offset) {
+  return (offset + BUNDLE_ALIGNMENT - 1) & ~(uint64_t) (BUNDLE_ALIGNMENT - 1);
+}
+
+static void write_at(int fd, void *data, size_t length, uint64_t offset,
+    char *path) {
+  while (length > 0) {
+    ssize_t bytes = pwrite(fd, data, length, offset);
+    if (bytes <= 0)
+      fail("cannot write", path);
+    data = (char *) data + bytes;
+    length -= bytes;
+    offset += bytes;
+  }
+}
+
+/* Appends LENGTH bytes to the string area, returning their offset. */
+static uint64_t add_string(FILE *strings, uint64_t base, char *data,
+    size_t length) {
+  uint64_t offset = base + ftell(strings);
+  fwrite(data, 1, length, strings);
+  return offset;
+}
+
+static void write_bundle(char *output) {
+  struct bundle_header header;
+  uint32_t i, num_buckets = 1;
+  int variant;
+
+  while (num_buckets < num_items * 2)
+    num_buckets <<= 1;
+
+  struct bundle_entry *entries = calloc(num_items, sizeof(struct bundle_entry));
+  uint32_t *buckets = calloc(num_buckets, sizeof(uint32_t));
+  if (!entries || !buckets)
+    out_of_memory();
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+  header.version = BUNDLE_VERSION;
+  header.num_entries = num_items;
+  header.num_buckets = num_buckets;
+  header.entries_offset = sizeof(header);
+  header.buckets_offset = header.entries_offset
+    + (uint64_t) num_items * sizeof(struct bundle_entry);
+  uint64_t strings_offset = header.buckets_offset
+    + (uint64_t) num_buckets * sizeof(uint32_t);
+
+  char *strings;
+  size_t strings_length;
+  FILE *strings_file = open_memstream(&strings, &strings_length);
+  for (i = 0; i < num_items; i++) {
+    struct item *item = &items[i];
+    struct bundle_entry *entry = &entries[i];
+    entry->path_length = strlen(item->path);
+    entry->path_offset = add_string(strings_file, strings_offset, item->path,
+        entry->path_length);
+    entry->flags = item->flags;
+    for (variant = BUNDLE_IDENTITY; variant <= BUNDLE_GZIP; variant++) {
+      if (!item->head[variant])
+        continue;
+      struct bundle_variant *v = &entry->variants[variant];
+      v->head_length = strlen(item->head[variant]);
+      v->head_offset = add_string(strings_file, strings_offset,
+          item->head[variant], v->head_length);
+      v->etag_length = strlen(item->etag[variant]);
+      v->etag_offset = add_string(strings_file, strings_offset,
+          item->etag[variant], v->etag_length);
+      v->body_length = item->body_length[variant];
+    }
+
+    uint32_t bucket = bundle_hash(item->path, entry->path_length) & (num_buckets - 1);
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = i + 1;
+  }
+  fclose(strings_file);
+
+  char *temporary;
+  if (asprintf(&temporary, "%s.tmp", output) == -1)
+    out_of_memory();
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    fail("cannot create", temporary);
+
+  /* Bodies start on page boundaries, after everything else. */
+  uint64_t offset = align(strings_offset + strings_length);
+  for (i = 0; i < num_items; i++) {
+    for (variant = BUNDLE_IDENTITY; variant <= BUNDLE_GZIP; variant++) {
+      struct bundle_variant *v = &entries[i].variants[variant];
+      if (!items[i].body[variant])
+        continue;
+      v->body_offset = offset;
+      write_at(fd, items[i].body[variant], v->body_length, offset, temporary);
+      offset = align(offset + v->body_length);
+    }
+  }
+
+  write_at(fd, &header, sizeof(header), 0, temporary);
+  write_at(fd, entries, num_items * sizeof(struct bundle_entry),
+      header.entries_offset, temporary);
+  write_at(fd, buckets, num_buckets * sizeof(uint32_t), header.buckets_offset,
+      temporary);
+  write_at(fd, strings, strings_length, strings_offset, temporary);
+  if (ftruncate(fd, offset) == -1 || fsync(fd) == -1 || close(fd) == -1)
+    fail("cannot write", temporary);
+
+  /* Replace OUTPUT atomically, so a running server's mapping stays intact. */
+  if (rename(temporary, output) == -1)
+    fail("cannot rename to", output);
+  printf("Packed %u entries into %s (%llu bytes)\n", num_items, output,
+      (unsigned long long) offset);
+}
+
+int main(int argc, char **argv) {
+  int argument = 1;
+  if (argument < argc && strcmp(argv[argument], "--gzip") == 0) {
+    use_gzip = 1;
+    argument++;
+  }
+  if (argc - argument != 2) {
+    fprintf(stderr, "Usage: %s [--gzip] DIRECTORY OUTPUT\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char *root = argv[argument];
+  size_t length = strlen(root);
+  while (length > 1 && root[length - 1] == '/')
+    root[--length] = '\0';
+
+  add_directory(root, ".");
+  write_bundle(argv[argument + 1]);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "coro.h"
+#include "libhttp.h"
+#include "plugin.h"
+
+struct plugin {
+  char *path;
+  char *prefix;                 /* Without a trailing slash; "" for "/". */
+  size_t prefix_length;
+  void *handle;
+  void *state;
+  int (*handle_request)(struct plugin_request *request);
+  void (*teardown)(void *state);
+};
+
+/* A request being served; plugins only see REQUEST, its first member. */
+struct plugin_call {
+  struct plugin_request request;
+  int fd;
+  struct http_request *http;
+  char *pending;                /* Body bytes read along with the headers. */
+  size_t pending_length;
+  int chunked;
+  struct http_chunked_decoder decoder;
+  size_t remaining;             /* Of a Content-Length body. */
+  int body_done;
+  int expects_continue;         /* Sent "Expect: 100-continue". */
+};
+
+static struct plugin plugins[PLUGIN_MAX];
+static int num_plugins;
+
+static char *plugin_get_header(struct plugin_request *request, char *key) {
+  return http_request_get_header(((struct plugin_call *) request)->http, key);
+}
+
+static ssize_t plugin_read_body(struct plugin_request *request, void *buffer,
+    size_t size) {
+  struct plugin_call *call = (struct plugin_call *) request;
+
+  while (!call->body_done && size > 0) {
+    size_t wanted = size;
+    ssize_t bytes;
+    if (!call->chunked && call->remaining < wanted)
+      wanted = call->remaining;
+
+    if (call->pending_length) {
+      bytes = call->pending_length < wanted ? call->pending_length : wanted;
+      memcpy(buffer, call->pending, bytes);
+      call->pending += bytes;
+      call->pending_length -= bytes;
+    } else {
+      /* The client holds the body back until told to go ahead. */
+      if (call->expects_continue) {
+        http_send_string(call->fd, "HTTP/1.1 100 Continue\r\n\r\n");
+        call->expects_continue = 0;
+      }
+      bytes = coro_read(call->fd, buffer, wanted);
+      if (bytes < 0 && errno == EINTR) continue;
+      if (bytes <= 0) return -1;
+    }
+
+    if (call->chunked) {
+      /* Decoded in place; a read may hold nothing but framing. */
+      bytes = http_chunked_decode(&call->decoder, buffer, bytes);
+      if (bytes < 0) return -1;
+      call->body_done = call->decoder.done;
+      if (bytes == 0) continue;
+    } else if ((call->remaining -= bytes) == 0) {
+      call->body_done = 1;
+    }
+    return bytes;
+  }
+  return 0;
+}
+
+static void plugin_start_response(struct plugin_request *request, int status_code) {
+  http_start_response(((struct plugin_call *) request)->fd, status_code);
+}
+
+static void plugin_send_header(struct plugin_request *request, char *key,
+    char *value) {
+  http_send_header(((struct plugin_call *) request)->fd, key, value);
+}
+
+static void plugin_end_headers(struct plugin_request *request) {
+  http_end_headers(((struct plugin_call *) request)->fd);
+}
+
+static void plugin_send_data(struct plugin_request *request, const void *data,
+    size_t size) {
+  http_send_data(((struct plugin_call *) request)->fd, (char *) data, size);
+}
+
+static const struct plugin_host plugin_host = {
+  .abi_version = PLUGIN_ABI_VERSION,
+  .get_header = plugin_get_header,
+  .read_body = plugin_read_body,
+  .start_response = plugin_start_response,
+  .send_header = plugin_send_header,
+  .end_headers = plugin_end_headers,
+  .send_data = plugin_send_data,
+  .get_mime_type = http_get_mime_type,
+};
+
+static void *plugin_symbol(struct plugin *plugin, char *name) {
+  void *symbol = dlsym(plugin->handle, name);
+  if (!symbol) {
+    fprintf(stderr, "Plugin %s: %s\n", plugin->path, dlerror());
+    exit(EXIT_FAILURE);
+  }
+  return symbol;
+}
+
+void plugin_load(char *spec) {
+  char *colon = strrchr(spec, ':');
+  if (!colon || colon == spec || colon[1] != '/') {
+    fprintf(stderr, "Expected PATH.so:/PREFIX, got %s\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  if (num_plugins == PLUGIN_MAX) {
+    fprintf(stderr, "At most %d plugins can be loaded\n", PLUGIN_MAX);
+    exit(EXIT_FAILURE);
+  }
+
+  struct plugin *plugin = &plugins[num_plugins];
+  /* dlopen() only looks in the current directory for paths with a slash. */
+  size_t path_length = colon - spec;
+  int relative = !memchr(spec, '/', path_length);
+  plugin->path = malloc(path_length + 3);
+  if (!plugin->path) {
+    perror("Failed to allocate plugin");
+    exit(errno);
+  }
+  sprintf(plugin->path, "%s%.*s", relative ? "./" : "", (int) path_length, spec);
+  plugin->prefix = strdup(colon + 1);
+  plugin->prefix_length = strlen(plugin->prefix);
+  while (plugin->prefix_length > 0 && plugin->prefix[plugin->prefix_length - 1] == '/')
+    plugin->prefix[--plugin->prefix_length] = '\0';
+
+  plugin->handle = dlopen(plugin->path, RTLD_NOW | RTLD_LOCAL);
+  if (!plugin->handle) {
+    fprintf(stderr, "%s\n", dlerror());
+    exit(EXIT_FAILURE);
+  }
+
+  int *abi_version = plugin_symbol(plugin, "plugin_abi_version");
+  if (*abi_version != PLUGIN_ABI_VERSION) {
+    fprintf(stderr, "Plugin %s was built for ABI version %d, not %d\n",
+        plugin->path, *abi_version, PLUGIN_ABI_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  int (*init)(const struct plugin_host *, const char *, void **) =
+      plugin_symbol(plugin, "plugin_init");
+  plugin->handle_request = plugin_symbol(plugin, "plugin_handle");
+  plugin->teardown = plugin_symbol(plugin, "plugin_teardown");
+
+  if (init(&plugin_host, colon + 1, &plugin->state) != 0) {
+    fprintf(stderr, "Plugin %s failed to initialize\n", plugin->path);
+    exit(EXIT_FAILURE);
+  }
+  num_plugins++;
+}
+
+int plugin_count(void) {
+  return num_plugins;
+}
+
+struct plugin *plugin_find(char *path) {
+  struct plugin *best = NULL;
+  int i;
+
+  for (i = 0; i < num_plugins; i++) {
+    struct plugin *plugin = &plugins[i];
+    char next = path[plugin->prefix_length];
+    if (strncmp(path, plugin->prefix, plugin->prefix_length) == 0
+        && (next == '\0' || next == '/' || next == '?')
+        && (!best || plugin->prefix_length > best->prefix_length))
+      best = plugin;
+  }
+  return best;
+}
+
+int plugin_serve(struct plugin *plugin, int fd, struct http_request *request) {
+  struct plugin_call call;
+  memset(&call, 0, sizeof(call));
+  call.request.method = request->method;
+  call.request.path = request->path;
+  call.request.path_info = request->path + plugin->prefix_length;
+  call.request.minor_version = request->minor_version;
+  call.request.state = plugin->state;
+  call.fd = fd;
+  call.http = request;
+  call.pending = request->raw + request->header_length;
+  call.pending_length = request->raw_length - request->header_length;
+
+  char *transfer_encoding = http_request_get_header(request, "Transfer-Encoding");
+  char *content_length = http_request_get_header(request, "Content-Length");
+  char *expect = http_request_get_header(request, "Expect");
+  call.expects_continue = request->minor_version >= 1 && expect
+      && strcasecmp(expect, "100-continue") == 0;
+  if (transfer_encoding && strcasecmp(transfer_encoding, "chunked") == 0) {
+    call.chunked = 1;
+    http_chunked_decoder_init(&call.decoder);
+  } else {
+    if (content_length)
+      call.remaining = strtoull(content_length, NULL, 10);
+    call.body_done = call.remaining == 0;
+  }
+
+  return plugin->handle_request(&call.request);
+}
+
+void plugin_unload_all(void) {
+  while (num_plugins > 0) {
+    struct plugin *plugin = &plugins[--num_plugins];
+    plugin->teardown(plugin->state);
+    dlclose(plugin->handle);
+  }
+}
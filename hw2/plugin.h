@@ -0,0 +1,100 @@
+/*
+ * In-process request handlers, loaded from shared objects with dlopen().
+ *
+ * A plugin serves every request whose path is at or below its prefix, on
+ * the thread (or coroutine) that accepted the connection, with no fork or
+ * exec per request. It exports three functions and its ABI version:
+ *
+ *     int plugin_abi_version = PLUGIN_ABI_VERSION;
+ *     int plugin_init(const struct plugin_host *host, const char *prefix,
+ *         void **state);
+ *     int plugin_handle(struct plugin_request *request);
+ *     void plugin_teardown(void *state);
+ *
+ * plugin_init() runs once at startup and returns 0 on success; whatever it
+ * stores in STATE is handed back in every request and to plugin_teardown(),
+ * which runs if the server shuts down cleanly (e.g. after an upgrade has
+ * drained). plugin_handle() is called concurrently from many threads, and
+ * must do its I/O through HOST so that it works under --coroutines too. It
+ * returns 0 once it has responded; otherwise the server answers 500 if
+ * nothing was sent yet. The connection is closed after each response.
+ *
+ * Usage example (see plugin_hello.c):
+ *
+ *     static const struct plugin_host *host;
+ *
+ *     int plugin_handle(struct plugin_request *request) {
+ *       host->start_response(request, 200);
+ *       host->send_header(request, "Content-Type", "text/plain");
+ *       host->end_headers(request);
+ *       host->send_data(request, "Hello\n", 6);
+ *       return 0;
+ *     }
+ *
+ *     gcc -shared -fPIC plugin_hello.c -o plugin_hello.so
+ *     ./httpserver --files files/ --plugin plugin_hello.so:/hello
+ */
+
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PLUGIN_ABI_VERSION 1
+
+/* Plugins that can be loaded at once. */
+#define PLUGIN_MAX 16
+
+struct plugin_request {
+  char *method;
+  char *path;                   /* As requested, e.g. "/api/users?id=3". */
+  char *path_info;              /* After the prefix: "/users?id=3", or "". */
+  int minor_version;            /* 1 for HTTP/1.1 and later, else 0. */
+  void *state;                  /* As set by plugin_init(). */
+};
+
+/* The server's side of the ABI, handed to plugin_init(). */
+struct plugin_host {
+  int abi_version;
+
+  /* Returns the value of the request header KEY, or NULL. */
+  char *(*get_header)(struct plugin_request *request, char *key);
+
+  /*
+   * Reads up to SIZE bytes of the request body, whether framed by
+   * Content-Length or chunked. Returns 0 at its end, or -1 if the client
+   * went away or sent a malformed body.
+   */
+  ssize_t (*read_body)(struct plugin_request *request, void *buffer, size_t size);
+
+  /* The response, as with libhttp's functions of the same names. */
+  void (*start_response)(struct plugin_request *request, int status_code);
+  void (*send_header)(struct plugin_request *request, char *key, char *value);
+  void (*end_headers)(struct plugin_request *request);
+  void (*send_data)(struct plugin_request *request, const void *data, size_t size);
+
+  /* Returns the Content-Type for a file name, e.g. "text/html". */
+  char *(*get_mime_type)(char *file_name);
+};
+
+/*
+ * For the server. plugin_load() takes "PATH.so:/PREFIX" and exits if the
+ * plugin can't be loaded or fails to initialize.
+ */
+struct http_request;
+struct plugin;
+
+void plugin_load(char *spec);
+int plugin_count(void);
+
+/* Returns the plugin with the longest prefix covering PATH, or NULL. */
+struct plugin *plugin_find(char *path);
+
+/* Has PLUGIN answer REQUEST, read from FD. Returns plugin_handle()'s result. */
+int plugin_serve(struct plugin *plugin, int fd, struct http_request *request);
+
+/* Tears down every plugin; no requests may be in progress. */
+void plugin_unload_all(void);
+
+#endif
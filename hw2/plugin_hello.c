@@ -0,0 +1,93 @@
+/*
+ * An example handler plugin (see plugin.h). GET answers with a greeting and
+ * a count of the requests served so far; POST and PUT echo the body back.
+ *
+ *     make plugin_hello.so
+ *     ./httpserver --files files/ --plugin plugin_hello.so:/hello
+ *     curl localhost:8000/hello/world
+ *     curl --data-binary @file localhost:8000/hello
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plugin.h"
+
+struct hello_state {
+  char *prefix;
+  unsigned long requests;
+};
+
+int plugin_abi_version = PLUGIN_ABI_VERSION;
+
+static const struct plugin_host *host;
+
+int plugin_init(const struct plugin_host *plugin_host, const char *prefix,
+    void **state) {
+  struct hello_state *hello = calloc(1, sizeof(struct hello_state));
+  if (!hello || !(hello->prefix = strdup(prefix))) {
+    free(hello);
+    return -1;
+  }
+  host = plugin_host;
+  *state = hello;
+  return 0;
+}
+
+static int hello_echo(struct plugin_request *request) {
+  char buffer[16384];
+  ssize_t bytes;
+  int started = 0;
+
+  /* The body's length isn't known up front; the connection close ends it. */
+  while ((bytes = host->read_body(request, buffer, sizeof(buffer))) > 0) {
+    if (!started) {
+      host->start_response(request, 200);
+      host->send_header(request, "Content-Type", "application/octet-stream");
+      host->end_headers(request);
+      started = 1;
+    }
+    host->send_data(request, buffer, bytes);
+  }
+  if (bytes < 0)
+    return started ? 0 : -1;
+  if (!started) {
+    host->start_response(request, 204);
+    host->end_headers(request);
+  }
+  return 0;
+}
+
+int plugin_handle(struct plugin_request *request) {
+  struct hello_state *hello = request->state;
+  unsigned long count = __atomic_add_fetch(&hello->requests, 1, __ATOMIC_RELAXED);
+
+  if (strcmp(request->method, "POST") == 0 || strcmp(request->method, "PUT") == 0)
+    return hello_echo(request);
+  if (strcmp(request->method, "GET") != 0)
+    return -1;
+
+  char body[1024];
+  char *agent = host->get_header(request, "User-Agent");
+  int length = snprintf(body, sizeof(body),
+      "Hello from %s, path info \"%s\", user agent \"%s\": request %lu\n",
+      hello->prefix, request->path_info, agent ? agent : "-", count);
+  if (length >= (int) sizeof(body))
+    length = sizeof(body) - 1;
+
+  char content_length[16];
+  snprintf(content_length, sizeof(content_length), "%d", length);
+  host->start_response(request, 200);
+  host->send_header(request, "Content-Type", "text/plain");
+  host->send_header(request, "Content-Length", content_length);
+  host->end_headers(request);
+  host->send_data(request, body, length);
+  return 0;
+}
+
+void plugin_teardown(void *state) {
+  struct hello_state *hello = state;
+  free(hello->prefix);
+  free(hello);
+}
@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "utlist.h"
+
+#define RATELIMIT_CONNECTION_RULE 0
+
+struct ratelimit_rule {
+  char *prefix;                 /* No trailing slash; NULL for connections. */
+  size_t prefix_length;
+  double rate;                  /* Tokens per second. */
+  double burst;
+};
+
+struct ratelimit_bucket {
+  uint32_t address;
+  uint16_t rule;
+  double tokens;
+  uint64_t updated;             /* When TOKENS was last brought up to date. */
+  struct ratelimit_bucket *hash_next;
+  struct ratelimit_bucket *prev, *next;
+};
+
+/* Padded to a cache line each, so locking one shard doesn't slow another. */
+struct ratelimit_shard {
+  pthread_mutex_t lock;
+  struct ratelimit_bucket **table;
+  size_t table_mask;
+  size_t num_buckets, max_buckets;
+  struct ratelimit_bucket *lru;  /* Most recently used first. */
+} __attribute__((aligned(64)));
+
+static struct ratelimit_rule rules[RATELIMIT_MAX_RULES];
+static int num_rules = 1;
+static int enabled;
+static struct ratelimit_shard shards[RATELIMIT_SHARDS];
+
+static uint64_t ratelimit_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t ratelimit_hash(uint32_t address, uint16_t rule) {
+  return (((uint64_t) address << 16) | rule) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Parses "RATE[/BURST]" into RULE. */
+static int ratelimit_parse_rate(char *string, struct ratelimit_rule *rule) {
+  char *end;
+  rule->rate = strtod(string, &end);
+  rule->burst = rule->rate;
+  if (*end == '/')
+    rule->burst = strtod(end + 1, &end);
+  if (*end != '\0' || !(rule->rate > 0) || rule->burst < 1)
+    return -1;
+  return 0;
+}
+
+int ratelimit_add_rule(char *spec) {
+  if (spec[0] != '/')
+    return ratelimit_parse_rate(spec, &rules[RATELIMIT_CONNECTION_RULE]);
+
+  char *equals = strchr(spec, '=');
+  if (!equals || num_rules == RATELIMIT_MAX_RULES)
+    return -1;
+
+  struct ratelimit_rule *rule = &rules[num_rules];
+  if (ratelimit_parse_rate(equals + 1, rule) == -1)
+    return -1;
+  rule->prefix = strndup(spec, equals - spec);
+  rule->prefix_length = equals - spec;
+  while (rule->prefix_length > 0 && rule->prefix[rule->prefix_length - 1] == '/')
+    rule->prefix[--rule->prefix_length] = '\0';
+  num_rules++;
+  return 0;
+}
+
+void ratelimit_init(size_t max_clients) {
+  int i;
+
+  if (rules[RATELIMIT_CONNECTION_RULE].rate == 0 && num_rules == 1)
+    return;
+
+  size_t per_shard = max_clients / RATELIMIT_SHARDS;
+  if (per_shard < 1) per_shard = 1;
+  size_t table_size = 1;
+  while (table_size < per_shard)
+    table_size <<= 1;
+
+  for (i = 0; i < RATELIMIT_SHARDS; i++) {
+    struct ratelimit_shard *shard = &shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    /* Untouched parts of the table cost no memory until they're used. */
+    shard->table = calloc(table_size, sizeof(struct ratelimit_bucket *));
+    if (!shard->table) {
+      perror("Failed to allocate rate limit table");
+      exit(errno);
+    }
+    shard->table_mask = table_size - 1;
+    shard->max_buckets = per_shard;
+  }
+  enabled = 1;
+}
+
+int ratelimit_enabled(void) {
+  return enabled;
+}
+
+/* Removes BUCKET from its hash chain. Caller holds the shard lock. */
+static void ratelimit_unlink(struct ratelimit_shard *shard,
+    struct ratelimit_bucket *bucket) {
+  uint64_t hash = ratelimit_hash(bucket->address, bucket->rule);
+  struct ratelimit_bucket **link = &shard->table[(hash >> 16) & shard->table_mask];
+  while (*link != bucket)
+    link = &(*link)->hash_next;
+  *link = bucket->hash_next;
+  DL_DELETE(shard->lru, bucket);
+}
+
+/* Takes a token from the bucket for (ADDRESS, RULE); see ratelimit.h. */
+static int ratelimit_take(uint32_t address, int rule_index) {
+  struct ratelimit_rule *rule = &rules[rule_index];
+  uint64_t hash = ratelimit_hash(address, rule_index);
+  struct ratelimit_shard *shard = &shards[hash >> 58];
+  uint64_t now = ratelimit_now();
+  int retry_after = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  struct ratelimit_bucket **slot = &shard->table[(hash >> 16) & shard->table_mask];
+  struct ratelimit_bucket *bucket;
+  for (bucket = *slot; bucket; bucket = bucket->hash_next)
+    if (bucket->address == address && bucket->rule == rule_index)
+      break;
+
+  if (bucket) {
+    double elapsed = (now - bucket->updated) / 1e9;
+    bucket->tokens += elapsed * rule->rate;
+    if (bucket->tokens > rule->burst)
+      bucket->tokens = rule->burst;
+    DL_DELETE(shard->lru, bucket);
+  } else {
+    /* A full shard recycles its least recently seen client. */
+    if (shard->num_buckets == shard->max_buckets) {
+      bucket = shard->lru->prev;
+      ratelimit_unlink(shard, bucket);
+    } else {
+      bucket = malloc(sizeof(struct ratelimit_bucket));
+      if (!bucket) {
+        /* Fail open; refusing everyone would be worse. */
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+      }
+      shard->num_buckets++;
+    }
+    bucket->address = address;
+    bucket->rule = rule_index;
+    bucket->tokens = rule->burst;
+    bucket->hash_next = *slot;
+    *slot = bucket;
+  }
+  bucket->updated = now;
+  DL_PREPEND(shard->lru, bucket);
+
+  if (bucket->tokens >= 1)
+    bucket->tokens -= 1;
+  else
+    retry_after = (int) ((1 - bucket->tokens) / rule->rate) + 1;
+  pthread_mutex_unlock(&shard->lock);
+  return retry_after;
+}
+
+int ratelimit_check_connection(struct in_addr address) {
+  if (!enabled || rules[RATELIMIT_CONNECTION_RULE].rate == 0)
+    return 0;
+  return ratelimit_take(address.s_addr, RATELIMIT_CONNECTION_RULE);
+}
+
+int ratelimit_check_request(struct in_addr address, char *path) {
+  int i, best = -1;
+
+  if (!enabled || !path)
+    return 0;
+  for (i = RATELIMIT_CONNECTION_RULE + 1; i < num_rules; i++) {
+    if (strncmp(path, rules[i].prefix, rules[i].prefix_length) != 0)
+      continue;
+    char next = path[rules[i].prefix_length];
+    if ((next == '\0' || next == '/' || next == '?')
+        && (best == -1 || rules[i].prefix_length > rules[best].prefix_length))
+      best = i;
+  }
+  return best == -1 ? 0 : ratelimit_take(address.s_addr, best);
+}
@@ -0,0 +1,54 @@
+/*
+ * Per-client token-bucket rate limiting.
+ *
+ * Every client address gets a bucket that refills at RATE tokens per second
+ * up to BURST; each connection takes one token, and a connection that finds
+ * the bucket empty is turned away with 429. Path prefixes can have buckets
+ * of their own, charged per request, on top of the per-client one.
+ *
+ * Usage example:
+ *
+ *     ratelimit_add_rule("20/40");           (per client, on accept)
+ *     ratelimit_add_rule("/api=5");          (per client and prefix)
+ *     ratelimit_init(1 << 20);
+ *
+ *     int retry_after = ratelimit_check_connection(address);
+ *     if (retry_after)
+ *       ... respond 429 with "Retry-After: retry_after" ...
+ *
+ * Buckets live in a hash table split into RATELIMIT_SHARDS independently
+ * locked shards, so threads rarely contend. Each shard holds at most its
+ * share of MAX_CLIENTS buckets and evicts the least recently used when full;
+ * an evicted client simply starts again with a full bucket.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+
+#define RATELIMIT_SHARDS 64
+#define RATELIMIT_MAX_RULES 32
+
+/*
+ * Adds a rule from SPEC, "RATE[/BURST]" for the per-client connection limit
+ * or "/PREFIX=RATE[/BURST]" for requests under PREFIX. BURST defaults to
+ * RATE. Returns -1 if SPEC is malformed or there are too many rules.
+ */
+int ratelimit_add_rule(char *spec);
+
+/* Allocates the table for up to MAX_CLIENTS buckets, once rules are added. */
+void ratelimit_init(size_t max_clients);
+
+int ratelimit_enabled(void);
+
+/*
+ * Charges one token to ADDRESS for a new connection, or for a request for
+ * PATH under the longest matching prefix rule. Return 0 if the client may
+ * go ahead, or else the number of seconds until it may retry.
+ */
+int ratelimit_check_connection(struct in_addr address);
+int ratelimit_check_request(struct in_addr address, char *path);
+
+#endif
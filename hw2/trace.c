@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+#include "trace.h"
+
+struct trace_record {
+  uint64_t id;
+  uint64_t timestamps[TRACE_PHASES];  /* Nanoseconds; 0 if not reached. */
+  uint64_t bytes_sent;
+  int status_code;
+  char method[8];
+  char path[112];
+};
+
+/* What the accepting thread knows about a connection, by descriptor. */
+struct trace_slot {
+  uint64_t id;                  /* 0 if the connection isn't sampled. */
+  uint64_t accepted;
+  uint64_t enqueued;
+};
+
+struct trace_ring {
+  struct trace_record records[TRACE_RING_SIZE];
+  unsigned long head;
+  pid_t tid;
+  pthread_mutex_t lock;         /* Only ever contended by trace_dump(). */
+  struct trace_ring *next;
+};
+
+/* The request being served on this thread (or coroutine). */
+struct trace_current {
+  int active;
+  struct trace_record record;
+};
+
+static int enabled;
+static char *trace_path;
+static int sample_every;
+/* Shared by every thread that accepts: the listener, or each core's. */
+static unsigned long connections_seen;
+static uint64_t next_id;
+static struct trace_slot *slots;
+static int num_slots;
+
+static struct trace_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct trace_ring *own_ring;
+static __thread struct trace_current current;
+
+static uint64_t trace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void trace_first_byte(void) {
+  if (current.active && !current.record.timestamps[TRACE_FIRST_BYTE])
+    current.record.timestamps[TRACE_FIRST_BYTE] = trace_now();
+}
+
+void trace_init(char *path, int every) {
+  struct rlimit limit;
+
+  trace_path = path;
+  sample_every = every > 0 ? every : 1;
+
+  /* One slot per possible descriptor, so the listener never allocates. */
+  num_slots = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    num_slots = limit.rlim_cur < (1 << 20) ? limit.rlim_cur : (1 << 20);
+  slots = calloc(num_slots, sizeof(struct trace_slot));
+  if (!slots) {
+    perror("Failed to allocate trace slots");
+    exit(errno);
+  }
+
+  http_first_byte_hook = trace_first_byte;
+  enabled = 1;
+}
+
+int trace_enabled(void) {
+  return enabled;
+}
+
+void trace_accepted(int fd) {
+  if (!enabled || fd < 0 || fd >= num_slots)
+    return;
+  struct trace_slot *slot = &slots[fd];
+  if (__atomic_fetch_add(&connections_seen, 1, __ATOMIC_RELAXED) % sample_every != 0) {
+    slot->id = 0;
+    return;
+  }
+  slot->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+  slot->accepted = trace_now();
+  slot->enqueued = 0;
+}
+
+void trace_enqueued(int fd) {
+  if (enabled && fd >= 0 && fd < num_slots && slots[fd].id)
+    slots[fd].enqueued = trace_now();
+}
+
+/* The queue's lock orders the listener's writes to the slot before this. */
+void trace_begin(int fd) {
+  current.active = 0;
+  if (!enabled || fd < 0 || fd >= num_slots || !slots[fd].id)
+    return;
+
+  struct trace_slot *slot = &slots[fd];
+  memset(&current.record, 0, sizeof(current.record));
+  current.record.id = slot->id;
+  current.record.timestamps[TRACE_ACCEPTED] = slot->accepted;
+  current.record.timestamps[TRACE_ENQUEUED] = slot->enqueued;
+  current.record.timestamps[TRACE_DEQUEUED] = trace_now();
+  slot->id = 0;
+  current.active = 1;
+}
+
+void trace_parsed(char *method, char *path) {
+  if (!current.active)
+    return;
+  current.record.timestamps[TRACE_PARSED] = trace_now();
+  strncpy(current.record.method, method ? method : "-",
+      sizeof(current.record.method) - 1);
+  strncpy(current.record.path, path ? path : "-",
+      sizeof(current.record.path) - 1);
+}
+
+void trace_phase(enum trace_phase phase) {
+  if (current.active)
+    current.record.timestamps[phase] = trace_now();
+}
+
+static struct trace_ring *trace_own_ring(void) {
+  if (own_ring)
+    return own_ring;
+  own_ring = calloc(1, sizeof(struct trace_ring));
+  if (!own_ring)
+    return NULL;
+  own_ring->tid = gettid();
+  pthread_mutex_init(&own_ring->lock, NULL);
+  pthread_mutex_lock(&rings_lock);
+  own_ring->next = rings;
+  rings = own_ring;
+  pthread_mutex_unlock(&rings_lock);
+  return own_ring;
+}
+
+void trace_end(int status_code, size_t bytes_sent) {
+  if (!current.active)
+    return;
+  current.active = 0;
+  current.record.timestamps[TRACE_LAST_BYTE] = trace_now();
+  current.record.status_code = status_code;
+  current.record.bytes_sent = bytes_sent;
+
+  struct trace_ring *ring = trace_own_ring();
+  if (!ring)
+    return;
+  /* Overwrites the oldest record once the ring is full. */
+  pthread_mutex_lock(&ring->lock);
+  ring->records[ring->head++ & (TRACE_RING_SIZE - 1)] = current.record;
+  pthread_mutex_unlock(&ring->lock);
+}
+
+void *trace_request_state(void) {
+  return &current;
+}
+
+size_t trace_request_state_size(void) {
+  return sizeof(current);
+}
+
+/* Writes STRING as the inside of a JSON string. */
+static void trace_write_escaped(FILE *out, char *string) {
+  for (; *string; string++) {
+    unsigned char c = *string;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+}
+
+/* The slices drawn inside each request, between two of its phases. */
+static struct {
+  char *name;
+  enum trace_phase from, to;
+} trace_slices[] = {
+  { "dispatch", TRACE_ACCEPTED, TRACE_ENQUEUED },
+  { "queue", TRACE_ENQUEUED, TRACE_DEQUEUED },
+  { "parse", TRACE_DEQUEUED, TRACE_PARSED },
+  { "open", TRACE_PARSED, TRACE_OPENED },
+  { "wait", TRACE_OPENED, TRACE_FIRST_BYTE },
+  { "send", TRACE_FIRST_BYTE, TRACE_LAST_BYTE },
+};
+
+/* Writes one async event; the request's opening one carries ARGS. */
+static void trace_write_event(FILE *out, int *first, char *name, char phase,
+    struct trace_record *record, pid_t tid, uint64_t timestamp, int args) {
+  fprintf(out, "%s\n{\"name\":\"", *first ? "" : ",");
+  trace_write_escaped(out, name);
+  fprintf(out, "\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":%llu,"
+      "\"pid\":%d,\"tid\":%d,\"ts\":%.3f", phase, (unsigned long long) record->id,
+      (int) getpid(), (int) tid, timestamp / 1000.0);
+  if (args)
+    fprintf(out, ",\"args\":{\"method\":\"%s\",\"status\":%d,\"bytes\":%llu}",
+        record->method, record->status_code,
+        (unsigned long long) record->bytes_sent);
+  fputs("}", out);
+  *first = 0;
+}
+
+static void trace_write_record(FILE *out, int *first, struct trace_record *record,
+    pid_t tid) {
+  uint64_t *timestamps = record->timestamps;
+  size_t i;
+
+  /* The whole request, then its phases nested inside. */
+  trace_write_event(out, first, record->path, 'b', record, tid,
+      timestamps[TRACE_ACCEPTED], 1);
+  for (i = 0; i < sizeof(trace_slices) / sizeof(trace_slices[0]); i++) {
+    enum trace_phase from = trace_slices[i].from, to = trace_slices[i].to;
+    /* Without an open phase, the wait for the first byte starts at the parse. */
+    if (from == TRACE_OPENED && !timestamps[TRACE_OPENED])
+      from = TRACE_PARSED;
+    if (!timestamps[from] || !timestamps[to] || timestamps[to] < timestamps[from])
+      continue;
+    trace_write_event(out, first, trace_slices[i].name, 'b', record, tid,
+        timestamps[from], 0);
+    trace_write_event(out, first, trace_slices[i].name, 'e', record, tid,
+        timestamps[to], 0);
+  }
+  trace_write_event(out, first, record->path, 'e', record, tid,
+      timestamps[TRACE_LAST_BYTE], 0);
+}
+
+void trace_dump(void) {
+  struct trace_ring *ring;
+  char temporary[4096];
+  int first = 1, count = 0;
+
+  if (!enabled)
+    return;
+
+  snprintf(temporary, sizeof(temporary), "%s.tmp", trace_path);
+  FILE *out = fopen(temporary, "w");
+  if (!out) {
+    fprintf(stderr, "Failed to open trace %s: %s\n", temporary, strerror(errno));
+    return;
+  }
+
+  struct trace_record *copy = malloc(sizeof(struct trace_record) * TRACE_RING_SIZE);
+  if (!copy) {
+    fclose(out);
+    return;
+  }
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+  pthread_mutex_lock(&rings_lock);
+  for (ring = rings; ring; ring = ring->next) {
+    /* Copy under the lock, so the serving thread is only held up briefly. */
+    pthread_mutex_lock(&ring->lock);
+    unsigned long head = ring->head;
+    unsigned long n = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+    unsigned long i;
+    for (i = 0; i < n; i++)
+      copy[i] = ring->records[(head - n + i) & (TRACE_RING_SIZE - 1)];
+    pthread_mutex_unlock(&ring->lock);
+
+    for (i = 0; i < n; i++)
+      trace_write_record(out, &first, &copy[i], ring->tid);
+    count += n;
+  }
+  pthread_mutex_unlock(&rings_lock);
+  fputs("\n]}\n", out);
+  free(copy);
+
+  if (fclose(out) != 0 || rename(temporary, trace_path) == -1) {
+    fprintf(stderr, "Failed to write trace %s: %s\n", trace_path, strerror(errno));
+    return;
+  }
+  printf("Wrote %d traced requests to %s\n", count, trace_path);
+  fflush(stdout);
+}
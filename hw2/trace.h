@@ -0,0 +1,72 @@
+/*
+ * Per-request phase tracing, exported as Chrome trace events.
+ *
+ * For a sample of connections the server records when each phase of the
+ * request was reached: accepted, queued for a worker, picked up, parsed,
+ * file or upstream opened, first byte sent and last byte sent. Records go to
+ * a ring per serving thread, which keeps the latest TRACE_RING_SIZE, and
+ * trace_dump() writes them all out as JSON for chrome://tracing or Perfetto.
+ * Each request is drawn as its own track, split into "queue", "parse",
+ * "open", "wait" (until the first byte) and "send" slices.
+ *
+ * Usage example:
+ *
+ *     trace_init("trace.json", 100);         (1 connection in 100)
+ *
+ *     listener:  fd = accept(...); trace_accepted(fd);
+ *                trace_enqueued(fd); wq_push(...);
+ *     worker:    trace_begin(fd);
+ *                request = http_request_parse(fd);
+ *                trace_parsed(request->method, request->path);
+ *                ...; trace_phase(TRACE_OPENED); ...
+ *                trace_end(status_code, bytes_sent);
+ *
+ *     trace_dump();
+ *
+ * Timestamps come from the vDSO clock_gettime(), so no system calls are made
+ * while tracing. All functions are no-ops for connections not sampled.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+#define TRACE_RING_SIZE 4096    /* Records kept per thread; a power of 2. */
+
+enum trace_phase {
+  TRACE_ACCEPTED,
+  TRACE_ENQUEUED,
+  TRACE_DEQUEUED,
+  TRACE_PARSED,
+  TRACE_OPENED,
+  TRACE_FIRST_BYTE,
+  TRACE_LAST_BYTE,
+  TRACE_PHASES,
+};
+
+/* Traces one connection in every SAMPLE_EVERY; trace_dump() writes to PATH. */
+void trace_init(char *path, int sample_every);
+int trace_enabled(void);
+
+/*
+ * Called by the thread that accepted FD: the listener, or with
+ * --shared-nothing the core that serves it. Safe on several threads at once.
+ */
+void trace_accepted(int fd);
+void trace_enqueued(int fd);
+
+/* Called by the thread serving FD, when it starts and finishes with it. */
+void trace_begin(int fd);
+void trace_parsed(char *method, char *path);
+void trace_phase(enum trace_phase phase);
+void trace_end(int status_code, size_t bytes_sent);
+
+/* Writes every recorded request to the trace file, replacing it. */
+void trace_dump(void);
+
+/* The calling thread's in-progress record, for coro_register_local(). */
+void *trace_request_state(void);
+size_t trace_request_state_size(void);
+
+#endif
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "upgrade.h"
+
+#define UPGRADE_MAX_SOCKETS 256
+#define UPGRADE_CHANNEL_FD 3
+
+static int channel_fd = -1;
+
+/* Closes every descriptor from LOWEST up, so the new server inherits none. */
+static void close_descriptors_from(int lowest) {
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, lowest, ~0U, 0) == 0)
+    return;
+#endif
+  int fd, max = sysconf(_SC_OPEN_MAX);
+  for (fd = lowest; fd < max; fd++)
+    close(fd);
+}
+
+static int send_sockets(int socket_fd, int *fds, int count) {
+  char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_SOCKETS)];
+  char count_byte = count;
+  struct iovec iov = { .iov_base = &count_byte, .iov_len = 1 };
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+  };
+
+  memset(control, 0, sizeof(control));
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+
+  return sendmsg(socket_fd, &message, 0) == 1 ? 0 : -1;
+}
+
+int upgrade_spawn(char **argv, int *fds, int count) {
+  int channel[2];
+
+  if (count < 1 || count > UPGRADE_MAX_SOCKETS)
+    return -1;
+
+  /*
+   * argv[0] may be a bare name found through $PATH, so exec the binary we are
+   * running from. The link is resolved rather than exec'd directly: after a
+   * rebuild it reads "PATH (deleted)", and the new binary at PATH is the one
+   * we want.
+   */
+  char path[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (length == -1) {
+    perror("Failed to find own binary");
+    return -1;
+  }
+  path[length] = '\0';
+  static const char deleted[] = " (deleted)";
+  size_t suffix = sizeof(deleted) - 1;
+  if ((size_t) length > suffix && strcmp(path + length - suffix, deleted) == 0)
+    path[length - suffix] = '\0';
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) == -1) {
+    perror("Failed to create upgrade channel");
+    return -1;
+  }
+
+  /* Set up the environment before forking; the child may only exec. */
+  char value[16];
+  snprintf(value, sizeof(value), "%d", UPGRADE_CHANNEL_FD);
+  setenv(UPGRADE_ENVIRONMENT_VARIABLE, value, 1);
+
+  pid_t pid = fork();
+  if (pid != 0)
+    unsetenv(UPGRADE_ENVIRONMENT_VARIABLE);
+  if (pid == -1) {
+    perror("Failed to fork new server");
+    close(channel[0]);
+    close(channel[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    /* Keep only stdio and our end of the channel, so that client sockets
+     * are closed as soon as the old server is done with them. */
+    if (dup2(channel[1], UPGRADE_CHANNEL_FD) == -1)
+      _exit(127);
+    close_descriptors_from(UPGRADE_CHANNEL_FD + 1);
+    execv(path, argv);
+    perror("Failed to exec new server");
+    _exit(127);
+  }
+
+  close(channel[1]);
+  if (send_sockets(channel[0], fds, count) == -1) {
+    perror("Failed to pass listening sockets to new server");
+    close(channel[0]);
+    return -1;
+  }
+
+  /* Wait for the one-byte "ready"; EOF means the new server gave up. */
+  struct pollfd pollfd = { .fd = channel[0], .events = POLLIN };
+  char ready = 0;
+  int status = -1;
+  if (poll(&pollfd, 1, UPGRADE_READY_TIMEOUT * 1000) == 1
+      && read(channel[0], &ready, 1) == 1 && ready == 'R')
+    status = 0;
+  close(channel[0]);
+
+  if (status == -1) {
+    fprintf(stderr, "New server (pid %d) did not start; not upgrading\n", pid);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+  return status;
+}
+
+int upgrade_inherit_sockets(int *fds, int max) {
+  char *value = getenv(UPGRADE_ENVIRONMENT_VARIABLE);
+  if (!value)
+    return 0;
+  channel_fd = atoi(value);
+  unsetenv(UPGRADE_ENVIRONMENT_VARIABLE);
+  fcntl(channel_fd, F_SETFD, FD_CLOEXEC);
+
+  char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_SOCKETS)];
+  char count_byte;
+  struct iovec iov = { .iov_base = &count_byte, .iov_len = 1 };
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  if (recvmsg(channel_fd, &message, 0) != 1) {
+    perror("Failed to receive listening sockets from old server");
+    exit(EXIT_FAILURE);
+  }
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (!header || header->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "Old server sent no listening sockets\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  int i, received[UPGRADE_MAX_SOCKETS];
+  memcpy(received, CMSG_DATA(header), sizeof(int) * count);
+  for (i = 0; i < count; i++) {
+    if (i < max)
+      fds[i] = received[i];
+    else
+      close(received[i]);
+  }
+  return count < max ? count : max;
+}
+
+void upgrade_notify_ready(void) {
+  if (channel_fd == -1)
+    return;
+  char ready = 'R';
+  if (write(channel_fd, &ready, 1) != 1)
+    perror("Failed to notify old server (ignoring)");
+  close(channel_fd);
+  channel_fd = -1;
+}
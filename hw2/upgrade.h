@@ -0,0 +1,51 @@
+/*
+ * Zero-downtime binary upgrades.
+ *
+ * The running server forks and execs a fresh copy of itself, then hands it
+ * the listening sockets over a UNIX socket with SCM_RIGHTS. Once the new
+ * process reports that it is serving, the old one stops accepting, drains the
+ * requests it already accepted and exits. No connection in the listen queue
+ * is lost, since the queue belongs to the socket rather than the process.
+ *
+ * Usage example, in the old process:
+ *
+ *     if (upgrade_spawn(saved_argv, listening_fds, 1) == 0) {
+ *       close(listening_fds[0]);
+ *       ... drain in-flight requests, then exit ...
+ *     }
+ *
+ * and in the new one, before creating its own listening socket:
+ *
+ *     int count = upgrade_inherit_sockets(listening_fds, MAX);
+ *     ...
+ *     upgrade_notify_ready();
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* Seconds to wait for the new process to report that it is serving. */
+#define UPGRADE_READY_TIMEOUT 10
+
+/* Environment variable telling the new process where its handoff channel is. */
+#define UPGRADE_ENVIRONMENT_VARIABLE "HTTPSERVER_UPGRADE_FD"
+
+/*
+ * Execs the running binary with ARGV as the new server and passes it the COUNT
+ * sockets in FDS. Returns 0 once the new server reports that it is serving, or
+ * -1 if the upgrade failed, in which case the caller should simply carry on
+ * serving.
+ */
+int upgrade_spawn(char **argv, int *fds, int count);
+
+/*
+ * In a server started by upgrade_spawn(), receives up to MAX inherited
+ * listening sockets into FDS and returns how many there were. Returns 0 in a
+ * server that was started normally.
+ */
+int upgrade_inherit_sockets(int *fds, int max);
+
+/* Tells the old server that this one is now accepting connections. */
+void upgrade_notify_ready(void);
+
+#endif
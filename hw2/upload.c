@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "fdcache.h"
+#include "upload.h"
+
+/* An upload in progress. Functions below return 0, or the status to fail with. */
+struct upload_stream {
+  int fd;
+  char *pending;                /* Body bytes read along with the headers. */
+  size_t pending_length;
+  int file_fd;
+  int pipe_fds[2];
+  size_t pipe_size;
+  off_t received;
+  off_t max_size;
+};
+
+static unsigned long upload_counter;
+
+static int upload_write_all(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes = write(fd, data, size);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    data += bytes;
+    size -= bytes;
+  }
+  return 0;
+}
+
+/* For descriptors splice() can't read from: through a buffer instead. */
+static int upload_copy_buffered(struct upload_stream *stream, off_t length) {
+  char buffer[16384];
+
+  while (length > 0) {
+    ssize_t bytes = coro_read(stream->fd, buffer,
+        length < (off_t) sizeof(buffer) ? (size_t) length : sizeof(buffer));
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return 400;
+    if (upload_write_all(stream->file_fd, buffer, bytes) != 0) return 500;
+    length -= bytes;
+  }
+  return 0;
+}
+
+/* Moves the next LENGTH bytes of the body into the file. */
+static int upload_copy(struct upload_stream *stream, off_t length) {
+  if (length > stream->max_size - stream->received) return 413;
+  stream->received += length;
+
+  /* Whatever arrived with the headers goes first. */
+  size_t buffered = stream->pending_length;
+  if ((off_t) buffered > length) buffered = length;
+  if (buffered) {
+    if (upload_write_all(stream->file_fd, stream->pending, buffered) != 0) return 500;
+    stream->pending += buffered;
+    stream->pending_length -= buffered;
+    length -= buffered;
+  }
+
+  while (length > 0) {
+    size_t size = length < (off_t) stream->pipe_size ? (size_t) length : stream->pipe_size;
+    ssize_t in = coro_splice(stream->fd, stream->pipe_fds[1], size, SPLICE_F_MOVE);
+    if (in < 0 && errno == EINTR) continue;
+    if (in < 0 && errno == EINVAL) return upload_copy_buffered(stream, length);
+    if (in <= 0) return 400;     /* The client went away mid-body. */
+    length -= in;
+
+    /* Drain the pipe completely, so the next splice never waits on it. */
+    while (in > 0) {
+      ssize_t out = splice(stream->pipe_fds[0], NULL, stream->file_fd, NULL,
+          in, SPLICE_F_MOVE);
+      if (out < 0 && errno == EINTR) continue;
+      if (out <= 0) return 500;
+      in -= out;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Reads one line of chunked framing into LINE, without its line ending. Socket
+ * data is peeked first and only the line itself consumed, so the chunk data
+ * after it is left for splice().
+ */
+static int upload_read_line(struct upload_stream *stream, char *line, size_t size) {
+  char peeked[UPLOAD_LINE_MAX];
+  size_t length = 0;
+
+  while (1) {
+    char *source = stream->pending;
+    size_t available = stream->pending_length;
+    int from_socket = available == 0;
+    if (from_socket) {
+      ssize_t bytes = coro_recv(stream->fd, peeked, sizeof(peeked), MSG_PEEK);
+      if (bytes < 0 && errno == EINTR) continue;
+      if (bytes <= 0) return 400;
+      source = peeked;
+      available = bytes;
+    }
+
+    char *newline = memchr(source, '\n', available);
+    size_t take = newline ? (size_t) (newline - source) + 1 : available;
+    if (length + take >= size) return 400;
+    memcpy(line + length, source, take);
+    length += take;
+
+    if (!from_socket) {
+      stream->pending += take;
+      stream->pending_length -= take;
+    } else if (coro_recv(stream->fd, peeked, take, 0) != (ssize_t) take) {
+      return 400;
+    }
+    if (newline) break;
+  }
+
+  while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    length--;
+  line[length] = '\0';
+  return 0;
+}
+
+static int upload_receive_chunked(struct upload_stream *stream) {
+  char line[UPLOAD_LINE_MAX];
+  int status;
+
+  while (1) {
+    if ((status = upload_read_line(stream, line, sizeof(line)))) return status;
+
+    /* The size in hex, then possibly ";extensions", which are ignored. */
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(line, &end, 16);
+    if (!isxdigit((unsigned char) line[0]) || errno
+        || (*end && *end != ';' && *end != ' ' && *end != '\t'))
+      return 400;
+    if (size == 0) break;
+    if (size > (unsigned long long) (stream->max_size - stream->received))
+      return 413;
+
+    if ((status = upload_copy(stream, size))) return status;
+    if ((status = upload_read_line(stream, line, sizeof(line)))) return status;
+    if (line[0]) return 400;    /* Chunk data must be followed by a CRLF. */
+  }
+
+  /* Trailer fields are ignored, up to the blank line. */
+  do {
+    if ((status = upload_read_line(stream, line, sizeof(line)))) return status;
+  } while (line[0]);
+  return 0;
+}
+
+/* Parses a Content-Length value, or returns -1. */
+static off_t upload_parse_length(char *value) {
+  off_t length = 0;
+
+  if (!isdigit((unsigned char) *value)) return -1;
+  for (; isdigit((unsigned char) *value); value++) {
+    if (length > (LLONG_MAX - 9) / 10) return -1;
+    length = length * 10 + (*value - '0');
+  }
+  while (*value == ' ' || *value == '\t') value++;
+  return *value ? -1 : length;
+}
+
+int upload_receive(int fd, struct http_request *request, char *path,
+    off_t max_size) {
+  char *transfer_encoding = http_request_get_header(request, "Transfer-Encoding");
+  char *content_length = http_request_get_header(request, "Content-Length");
+  off_t length = -1;
+
+  if (transfer_encoding) {
+    if (strcasecmp(transfer_encoding, "chunked") != 0) return 501;
+  } else if (content_length) {
+    if ((length = upload_parse_length(content_length)) < 0) return 400;
+    if (length > max_size) return 413;
+  } else {
+    return 411;
+  }
+
+  /* Split PATH into the directory to create the file in and its name. */
+  char directory[PATH_MAX];
+  char *name = strrchr(path, '/');
+  if (strcmp(path, ".") == 0) return 405;
+  if (name) {
+    snprintf(directory, sizeof(directory), "%.*s", (int) (name - path), path);
+    name++;
+  } else {
+    strcpy(directory, ".");
+    name = path;
+  }
+
+  int directory_fd = fdcache_open_directory(directory);
+  if (directory_fd == -1)
+    return errno == ENOENT || errno == ENOTDIR ? 409 : 403;
+
+  struct stat st;
+  int replacing = fstatat(directory_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+  if (replacing && !S_ISREG(st.st_mode)) {
+    close(directory_fd);
+    return 409;
+  }
+
+  /* Created beside the destination, so the rename stays on one filesystem. */
+  char temporary[64];
+  snprintf(temporary, sizeof(temporary), ".upload.%d.%lu", (int) getpid(),
+      __atomic_add_fetch(&upload_counter, 1, __ATOMIC_RELAXED));
+  struct upload_stream stream = {
+    .fd = fd,
+    .pending = request->raw + request->header_length,
+    .pending_length = request->raw_length - request->header_length,
+    .max_size = max_size,
+  };
+  stream.file_fd = openat(directory_fd, temporary,
+      O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (stream.file_fd == -1) {
+    close(directory_fd);
+    return errno == EACCES || errno == EROFS ? 403 : 500;
+  }
+  if (pipe2(stream.pipe_fds, O_CLOEXEC) == -1) {
+    close(stream.file_fd);
+    unlinkat(directory_fd, temporary, 0);
+    close(directory_fd);
+    return 500;
+  }
+  int pipe_size = fcntl(stream.pipe_fds[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+  if (pipe_size <= 0)
+    pipe_size = fcntl(stream.pipe_fds[1], F_GETPIPE_SZ);
+  stream.pipe_size = pipe_size > 0 ? pipe_size : 65536;
+
+  /* Clients that asked wait for this before sending the body. */
+  char *expect = http_request_get_header(request, "Expect");
+  if (expect && request->minor_version >= 1 && strcasecmp(expect, "100-continue") == 0)
+    http_send_string(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+
+  int status = transfer_encoding ? upload_receive_chunked(&stream)
+      : upload_copy(&stream, length);
+
+  close(stream.pipe_fds[0]);
+  close(stream.pipe_fds[1]);
+  if (close(stream.file_fd) != 0 && !status)
+    status = 500;
+  if (!status && renameat(directory_fd, temporary, directory_fd, name) != 0)
+    status = 500;
+  if (status)
+    unlinkat(directory_fd, temporary, 0);
+  close(directory_fd);
+  return status ? status : replacing ? 204 : 201;
+}
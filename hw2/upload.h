@@ -0,0 +1,45 @@
+/*
+ * Streaming PUT/POST uploads into the document root.
+ *
+ * The body of an upload, framed by Content-Length or chunked, is moved from
+ * the connection into a temporary file next to its destination with splice(),
+ * so it never passes through user space (only chunk-size lines and whatever
+ * arrived along with the headers are read). Once the whole body is in, the
+ * temporary file is renamed over the destination, so readers see either the
+ * old file or the complete new one. Memory use doesn't depend on the size
+ * of the upload.
+ *
+ * Usage example:
+ *
+ *     struct http_request *request = http_request_parse(fd);
+ *     char path[PATH_MAX];
+ *     if (fdcache_normalize_path(request->path, path, sizeof(path)) == 0) {
+ *       int status_code = upload_receive(fd, request, path, 64 << 20);
+ *       http_start_response(fd, status_code);
+ *       ...
+ *     }
+ */
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <sys/types.h>
+
+#include "libhttp.h"
+
+/* Longest chunk-size or trailer line accepted in a chunked upload. */
+#define UPLOAD_LINE_MAX 1024
+
+/* Bytes moved per splice(); the pipe in between is grown to match. */
+#define UPLOAD_PIPE_SIZE (1 << 20)
+
+/*
+ * Receives the body of REQUEST, already parsed from FD, into PATH (a
+ * normalized path beneath the document root, whose directory must exist).
+ * Bodies over MAX_SIZE bytes are refused. Returns the status to answer
+ * with: 201 if PATH was created, 204 if it was replaced, else an error.
+ */
+int upload_receive(int fd, struct http_request *request, char *path,
+    off_t max_size);
+
+#endif
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "upstream.h"
+
+#define UPSTREAM_EJECTED_FOREVER ((time_t) (~0ULL >> 1))
+
+enum upstream_policy { ROUND_ROBIN, LEAST_CONN, POWER_OF_TWO };
+
+static struct upstream *upstreams;
+static int num_upstreams;
+static enum upstream_policy policy = ROUND_ROBIN;
+static pthread_mutex_t round_robin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *health_check_path;
+static int health_check_interval;
+
+static __thread unsigned int random_seed;
+
+static int upstream_add(char *hostname, int port, int weight) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(hostname, NULL, &hints, &result) != 0) {
+    fprintf(stderr, "Cannot find host: %s\n", hostname);
+    exit(ENXIO);
+  }
+
+  upstreams = realloc(upstreams, (num_upstreams + 1) * sizeof(struct upstream));
+  if (!upstreams) {
+    perror("Failed to allocate upstream");
+    exit(errno);
+  }
+
+  struct upstream *upstream = &upstreams[num_upstreams++];
+  memset(upstream, 0, sizeof(*upstream));
+  upstream->hostname = hostname;
+  upstream->port = port;
+  upstream->weight = weight;
+  memcpy(&upstream->address, result->ai_addr, sizeof(upstream->address));
+  upstream->address.sin_port = htons(port);
+  freeaddrinfo(result);
+  return 0;
+}
+
+int upstream_parse_list(char *list) {
+  int added = 0;
+  char *item, *saveptr;
+
+  for (item = strtok_r(list, ",", &saveptr); item;
+      item = strtok_r(NULL, ",", &saveptr)) {
+    int port = 80, weight = 1;
+
+    char *equals = strchr(item, '=');
+    if (equals) {
+      *equals = '\0';
+      if ((weight = atoi(equals + 1)) < 1)
+        return -1;
+    }
+
+    char *colon = strchr(item, ':');
+    if (colon) {
+      *colon = '\0';
+      if ((port = atoi(colon + 1)) < 1)
+        return -1;
+    }
+
+    if (*item == '\0')
+      return -1;
+    upstream_add(item, port, weight);
+    added++;
+  }
+  return added;
+}
+
+struct upstream *upstream_first(void) {
+  return num_upstreams ? &upstreams[0] : NULL;
+}
+
+int upstream_set_policy(char *name) {
+  if (strcmp(name, "round-robin") == 0)
+    policy = ROUND_ROBIN;
+  else if (strcmp(name, "least-conn") == 0)
+    policy = LEAST_CONN;
+  else if (strcmp(name, "p2c") == 0)
+    policy = POWER_OF_TWO;
+  else
+    return -1;
+  return 0;
+}
+
+/*
+ * Whether upstream I may be picked. Upstreams already tried for this request
+ * are always skipped; ejected ones only while some other upstream is healthy.
+ */
+static int upstream_eligible(int i, char *tried, int ignore_ejections) {
+  if (tried[i])
+    return 0;
+  if (ignore_ejections)
+    return 1;
+  return __atomic_load_n(&upstreams[i].ejected_until, __ATOMIC_RELAXED)
+    <= time(NULL);
+}
+
+/* Whether A carries less load per unit of weight than B. */
+static int upstream_less_loaded(struct upstream *a, struct upstream *b) {
+  long load_a = __atomic_load_n(&a->active_connections, __ATOMIC_RELAXED);
+  long load_b = __atomic_load_n(&b->active_connections, __ATOMIC_RELAXED);
+  return load_a * b->weight < load_b * a->weight;
+}
+
+/* Smooth weighted round-robin, as in nginx. */
+static struct upstream *pick_round_robin(char *tried, int ignore_ejections) {
+  struct upstream *best = NULL;
+  int i, total = 0;
+
+  pthread_mutex_lock(&round_robin_lock);
+  for (i = 0; i < num_upstreams; i++) {
+    if (!upstream_eligible(i, tried, ignore_ejections))
+      continue;
+    upstreams[i].current_weight += upstreams[i].weight;
+    total += upstreams[i].weight;
+    if (!best || upstreams[i].current_weight > best->current_weight)
+      best = &upstreams[i];
+  }
+  if (best)
+    best->current_weight -= total;
+  pthread_mutex_unlock(&round_robin_lock);
+  return best;
+}
+
+static struct upstream *pick_least_conn(char *tried, int ignore_ejections) {
+  struct upstream *best = NULL;
+  int i, start = rand_r(&random_seed) % num_upstreams;
+
+  /* Start at a random offset so ties don't all land on the first upstream. */
+  for (i = 0; i < num_upstreams; i++) {
+    int index = (start + i) % num_upstreams;
+    if (!upstream_eligible(index, tried, ignore_ejections))
+      continue;
+    if (!best || upstream_less_loaded(&upstreams[index], best))
+      best = &upstreams[index];
+  }
+  return best;
+}
+
+/* Picks one eligible upstream at random, in proportion to its weight. */
+static struct upstream *pick_weighted_random(char *tried, int ignore_ejections,
+    struct upstream *other_than) {
+  int i, total = 0;
+
+  for (i = 0; i < num_upstreams; i++)
+    if (upstream_eligible(i, tried, ignore_ejections) && &upstreams[i] != other_than)
+      total += upstreams[i].weight;
+  if (total == 0)
+    return NULL;
+
+  int ticket = rand_r(&random_seed) % total;
+  for (i = 0; i < num_upstreams; i++) {
+    if (!upstream_eligible(i, tried, ignore_ejections) || &upstreams[i] == other_than)
+      continue;
+    if ((ticket -= upstreams[i].weight) < 0)
+      return &upstreams[i];
+  }
+  return NULL;
+}
+
+static struct upstream *pick_power_of_two(char *tried, int ignore_ejections) {
+  struct upstream *first = pick_weighted_random(tried, ignore_ejections, NULL);
+  if (!first)
+    return NULL;
+  struct upstream *second = pick_weighted_random(tried, ignore_ejections, first);
+  if (second && upstream_less_loaded(second, first))
+    return second;
+  return first;
+}
+
+static struct upstream *upstream_pick(char *tried) {
+  struct upstream *upstream = NULL;
+  int ignore_ejections;
+
+  if (random_seed == 0)
+    random_seed = (unsigned int) time(NULL) ^ (unsigned int) pthread_self();
+
+  for (ignore_ejections = 0; ignore_ejections < 2 && !upstream; ignore_ejections++) {
+    switch (policy) {
+      case ROUND_ROBIN:
+        upstream = pick_round_robin(tried, ignore_ejections);
+        break;
+      case LEAST_CONN:
+        upstream = pick_least_conn(tried, ignore_ejections);
+        break;
+      case POWER_OF_TWO:
+        upstream = pick_power_of_two(tried, ignore_ejections);
+        break;
+    }
+  }
+  return upstream;
+}
+
+static void upstream_failed(struct upstream *upstream) {
+  if (__atomic_add_fetch(&upstream->consecutive_failures, 1, __ATOMIC_RELAXED)
+      < UPSTREAM_MAX_FAILS)
+    return;
+
+  __atomic_store_n(&upstream->consecutive_failures, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&upstream->ejected_until, time(NULL) + UPSTREAM_EJECT_SECONDS,
+      __ATOMIC_RELAXED);
+  fprintf(stderr, "Ejecting upstream %s:%d for %d seconds\n",
+      upstream->hostname, upstream->port, UPSTREAM_EJECT_SECONDS);
+}
+
+static void upstream_succeeded(struct upstream *upstream) {
+  if (__atomic_load_n(&upstream->consecutive_failures, __ATOMIC_RELAXED))
+    __atomic_store_n(&upstream->consecutive_failures, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * connect() that gives up after UPSTREAM_CONNECT_TIMEOUT_MS. Returns -1 on
+ * failure, including running out of sockets, which the caller answers like
+ * any other unreachable upstream.
+ */
+static int upstream_connect_one(struct upstream *upstream) {
+  int socket_fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  int flags = fcntl(socket_fd, F_GETFL);
+  fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+
+  int status = connect(socket_fd, (struct sockaddr *) &upstream->address,
+      sizeof(upstream->address));
+  if (status == -1 && errno == EINPROGRESS) {
+    struct pollfd pollfd = { .fd = socket_fd, .events = POLLOUT };
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (coro_poll(&pollfd, 1, UPSTREAM_CONNECT_TIMEOUT_MS) == 1
+        && getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0
+        && error == 0)
+      status = 0;
+  }
+
+  if (status == -1) {
+    close(socket_fd);
+    return -1;
+  }
+
+  fcntl(socket_fd, F_SETFL, flags);
+  return socket_fd;
+}
+
+int upstream_connect(struct upstream **chosen) {
+  char tried[num_upstreams];
+  int attempt;
+
+  memset(tried, 0, sizeof(tried));
+  for (attempt = 0; attempt < num_upstreams; attempt++) {
+    struct upstream *upstream = upstream_pick(tried);
+    if (!upstream)
+      break;
+    tried[upstream - upstreams] = 1;
+
+    __atomic_add_fetch(&upstream->active_connections, 1, __ATOMIC_RELAXED);
+    int socket_fd = upstream_connect_one(upstream);
+    if (socket_fd >= 0) {
+      *chosen = upstream;
+      return socket_fd;
+    }
+
+    __atomic_sub_fetch(&upstream->active_connections, 1, __ATOMIC_RELAXED);
+    upstream_failed(upstream);
+  }
+  return -1;
+}
+
+void upstream_release(struct upstream *upstream, int status_code) {
+  __atomic_sub_fetch(&upstream->active_connections, 1, __ATOMIC_RELAXED);
+  if (status_code >= 500)
+    upstream_failed(upstream);
+  else
+    upstream_succeeded(upstream);
+}
+
+/* Sends one health probe to UPSTREAM. Returns 1 if it answered 2xx or 3xx. */
+static int upstream_probe(struct upstream *upstream) {
+  int socket_fd = upstream_connect_one(upstream);
+  if (socket_fd == -1)
+    return 0;
+
+  struct timeval timeout = {
+    .tv_sec = UPSTREAM_CONNECT_TIMEOUT_MS / 1000,
+    .tv_usec = (UPSTREAM_CONNECT_TIMEOUT_MS % 1000) * 1000,
+  };
+  setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  dprintf(socket_fd, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+      health_check_path, upstream->hostname);
+
+  char status_line[16];
+  size_t total = 0;
+  ssize_t bytes;
+  while (total < 12 && (bytes = read(socket_fd, status_line + total,
+          sizeof(status_line) - 1 - total)) > 0)
+    total += bytes;
+  close(socket_fd);
+
+  /* "HTTP/1.x SSS" */
+  return total >= 12 && strncmp(status_line, "HTTP/", 5) == 0
+    && (status_line[9] == '2' || status_line[9] == '3');
+}
+
+static void *upstream_health_check_main(void *argument) {
+  int i;
+
+  while (1) {
+    for (i = 0; i < num_upstreams; i++) {
+      struct upstream *upstream = &upstreams[i];
+      int was_ejected = __atomic_load_n(&upstream->ejected_until,
+          __ATOMIC_RELAXED) > time(NULL);
+
+      if (upstream_probe(upstream)) {
+        if (was_ejected)
+          fprintf(stderr, "Upstream %s:%d passed its health check\n",
+              upstream->hostname, upstream->port);
+        __atomic_store_n(&upstream->consecutive_failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&upstream->ejected_until, 0, __ATOMIC_RELAXED);
+      } else {
+        if (!was_ejected)
+          fprintf(stderr, "Upstream %s:%d failed its health check\n",
+              upstream->hostname, upstream->port);
+        /* Stays out until a probe succeeds. */
+        __atomic_store_n(&upstream->ejected_until, UPSTREAM_EJECTED_FOREVER,
+            __ATOMIC_RELAXED);
+      }
+    }
+    sleep(health_check_interval);
+  }
+  return NULL;
+}
+
+void upstream_start_health_checks(char *path, int interval) {
+  pthread_t thread;
+
+  health_check_path = path;
+  health_check_interval = interval;
+  int error = pthread_create(&thread, NULL, upstream_health_check_main, NULL);
+  if (error) {
+    fprintf(stderr, "Failed to create health check thread: %s\n", strerror(error));
+    exit(error);
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,75 @@
+/*
+ * The set of proxy targets, and how requests are spread across them.
+ *
+ * Usage example:
+ *
+ *     upstream_parse_list("10.0.0.1:8000=3,10.0.0.2:8000");
+ *     upstream_set_policy("least-conn");
+ *     upstream_start_health_checks("/", 5);
+ *
+ *     struct upstream *upstream;
+ *     int upstream_fd = upstream_connect(&upstream);
+ *     ...
+ *     upstream_release(upstream, status_code);
+ *
+ * Upstreams that fail UPSTREAM_MAX_FAILS times in a row (connect errors or
+ * 5xx responses) are ejected for UPSTREAM_EJECT_SECONDS. Active health probes,
+ * when enabled, eject an upstream as soon as a probe fails and readmit it as
+ * soon as one succeeds. If every upstream is ejected, requests are spread
+ * across all of them anyway rather than failing outright.
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <netinet/in.h>
+#include <time.h>
+
+#define UPSTREAM_MAX_FAILS 3
+#define UPSTREAM_EJECT_SECONDS 10
+#define UPSTREAM_CONNECT_TIMEOUT_MS 1000
+
+struct upstream {
+  char *hostname;
+  int port;
+  int weight;
+  struct sockaddr_in address;
+  int active_connections;
+  int consecutive_failures;
+  time_t ejected_until;
+  int current_weight;          /* Smooth weighted round-robin state. */
+};
+
+/*
+ * Adds every upstream in LIST, a comma-separated list of
+ * "hostname[:port][=weight]" items. Port defaults to 80 and weight to 1.
+ * Returns the number of upstreams added, or -1 if LIST is malformed.
+ */
+int upstream_parse_list(char *list);
+
+/* The first upstream added, or NULL if there are none. */
+struct upstream *upstream_first(void);
+
+/*
+ * Selects the balancing policy: "round-robin" (the default), "least-conn" or
+ * "p2c" (power of two random choices). Returns -1 for an unknown name.
+ */
+int upstream_set_policy(char *name);
+
+/* Starts a thread that sends "GET PATH" to every upstream every INTERVAL seconds. */
+void upstream_start_health_checks(char *path, int interval);
+
+/*
+ * Picks an upstream according to the policy and connects to it, moving on to
+ * other upstreams if the connection fails. Returns the connected socket and
+ * sets *UPSTREAM, or returns -1 if no upstream could be reached.
+ */
+int upstream_connect(struct upstream **upstream);
+
+/*
+ * Reports the end of a request on UPSTREAM. STATUS_CODE is the response
+ * status, or 0 if it is unknown.
+ */
+void upstream_release(struct upstream *upstream, int status_code);
+
+#endif
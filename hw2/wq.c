@@ -1,38 +1,70 @@
 #include <stdlib.h>
+#include <time.h>
 #include "wq.h"
 #include "utlist.h"
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
+  int i;
+  wq->size = 0;
+  for (i = 0; i < WQ_CLASSES; i++)
+    wq->heads[i] = NULL;
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->nonempty, NULL);
+}
 
-  /* TODO: Make me thread-safe! */
+static unsigned long wq_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
 
-  wq->size = 0;
-  wq->head = NULL;
+/* Maps COST to a class: one per factor of 16 above 16 KiB. */
+static int wq_class(size_t cost) {
+  int class = 0;
+  cost >>= 14;
+  while (cost && class < WQ_CLASSES - 1) {
+    cost >>= 4;
+    class++;
+  }
+  return class;
 }
 
 /* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
+ * is at least one item on the queue. The item with the earliest deadline
+ * goes first; each class is FIFO, so only the class heads need comparing. */
 int wq_pop(wq_t *wq) {
+  int i, best = -1;
 
-  /* TODO: Make me blocking and thread-safe! */
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size == 0)
+    pthread_cond_wait(&wq->nonempty, &wq->lock);
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
+  for (i = 0; i < WQ_CLASSES; i++)
+    if (wq->heads[i] && (best == -1
+          || (long) (wq->heads[i]->deadline - wq->heads[best]->deadline) < 0))
+      best = i;
+
+  wq_item_t *wq_item = wq->heads[best];
+  int client_socket_fd = wq_item->client_socket_fd;
   wq->size--;
-  DL_DELETE(wq->head, wq->head);
+  DL_DELETE(wq->heads[best], wq_item);
+  pthread_mutex_unlock(&wq->lock);
 
   free(wq_item);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
-
-  /* TODO: Make me thread-safe! */
-
+/* Add ITEM to WQ, in the class for COST. */
+void wq_push(wq_t *wq, int client_socket_fd, size_t cost) {
+  int class = wq_class(cost);
   wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
   wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
+  wq_item->deadline = wq_now_ms() + class * WQ_AGING_MS;
+
+  pthread_mutex_lock(&wq->lock);
+  DL_APPEND(wq->heads[class], wq_item);
   wq->size++;
+  pthread_cond_signal(&wq->nonempty);
+  pthread_mutex_unlock(&wq->lock);
 }
@@ -2,24 +2,41 @@
 #define __WQ__
 
 #include <pthread.h>
+#include <stddef.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * Sockets are pushed with a cost hint, roughly the bytes their response will
+ * take, and kept in WQ_CLASSES FIFO classes by cost: under 16 KiB, 256 KiB,
+ * 4 MiB, and the rest. wq_pop() serves the cheapest class first, so small
+ * requests don't wait behind big downloads when every worker is busy. To keep
+ * big requests from starving, each class up counts as having arrived
+ * WQ_AGING_MS later: once an expensive socket has waited that much longer
+ * than a cheap one, it goes first. */
+
+#define WQ_CLASSES 4
+#define WQ_AGING_MS 1000
+
+/* The hint for sockets whose cost can't be guessed. */
+#define WQ_COST_UNKNOWN (16 * 1024)
 
 typedef struct wq_item {
   int client_socket_fd; // Client socket to be served.
+  unsigned long deadline; // Enqueue time plus aging, in milliseconds.
   struct wq_item *next;
   struct wq_item *prev;
 } wq_item_t;
 
 typedef struct wq {
   int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  wq_item_t *heads[WQ_CLASSES]; // One FIFO per cost class.
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty; // Signalled whenever an item is pushed.
 } wq_t;
 
 void wq_init(wq_t *wq);
-void wq_push(wq_t *wq, int client_socket_fd);
+void wq_push(wq_t *wq, int client_socket_fd, size_t cost);
 int wq_pop(wq_t *wq);
 
 #endif
@@ -1,22 +1,772 @@
 /*
  * mm_alloc.c
  *
- * Stub implementations of the mm_* routines.
+ * A general-purpose allocator behind the mm_* routines.
+ *
+ * Memory is taken from the system with mmap() in regions of at least
+ * REGION_SIZE bytes and cut into chunks. Each chunk starts with a one-word
+ * header holding its size, a multiple of 16, and flags, and the pointer
+ * handed out follows the header, 16-byte aligned. A chunk of SIZE bytes thus
+ * holds SIZE - HEADER_SIZE bytes for the caller.
+ *
+ * The chunks of a region follow one another, and each header tells whether
+ * the chunk and the one before it are in use. A free chunk also repeats its
+ * size in its last word (a boundary tag), so that freeing a chunk can find
+ * both neighbours and merge it with those that are free. No two free chunks
+ * are ever adjacent. The free chunk at the end of the current region, the
+ * top, is where the heap grows from.
+ *
+ * Free chunks are kept on segregated free lists, one per size class: a
+ * class for every multiple of 16 up to SMALL_MAX, then four classes per
+ * power of two, each list holding the sizes from its class up to the next.
+ * Those above SMALL_MAX are kept in order of size, with one chunk of each
+ * size on the list and the others of that size hanging off it, last in
+ * first out, so that both freeing and searching take a step per distinct
+ * size. A bitmap tells which lists have any, so that the best fit (the
+ * smallest chunk large enough) is found by looking in the request's own
+ * list and then at the head of the next non-empty one. What the request doesn't
+ * need of the chunk is split off and freed again. Only when nothing fits is
+ * a chunk cut off the top.
+ *
+ * The lists above make up the shared heap, behind one lock. In front of it,
+ * every thread keeps a cache of its own with a list for each class up to
+ * CACHE_MAX_SIZE, which it allocates from and frees to without taking any
+ * lock. An empty list is refilled from the heap, and a full one flushed to
+ * it, several chunks at a time under one acquisition of the lock. A thread
+ * holds at most CACHE_MAX_COUNT chunks of a class and CACHE_MAX_BYTES in
+ * all, and gives them back when it exits.
+ *
+ * Requests of mmap_threshold bytes or more don't come from the heap at all:
+ * each gets a mapping of its own, laid out like a region holding just that
+ * chunk, and flagged MMAPPED in its header. Freeing one unmaps it, unless it
+ * fits in a small cache of mappings kept for reuse, and mm_realloc() moves
+ * it with mremap(), which never copies the contents.
+ *
+ * mm_realloc() resizes heap chunks in place where it can: it grows a chunk
+ * into the free chunk or the top right after it, and shrinks one by freeing
+ * its tail. It copies only when the chunk after it is in use or too small.
  */
 
+#define _GNU_SOURCE
+
 #include "mm_alloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ALIGNMENT 16
+#define HEADER_SIZE sizeof(size_t)
+#define MIN_CHUNK_SIZE 32
+#define REGION_SIZE (1 << 20)
+
+/* Chunk sizes up to this many bytes have a class each. */
+#define SMALL_MAX 1024
+#define NUM_SMALL_BINS (SMALL_MAX / ALIGNMENT - 1)
+/* Then four classes per power of two, up to the largest size_t. */
+#define NUM_BINS (NUM_SMALL_BINS + 4 * (64 - 10))
+
+/* Chunk sizes kept in thread caches, and how much of them. */
+#define CACHE_MAX_SIZE 4096
+#define NUM_CACHED_BINS (NUM_SMALL_BINS + 4 * (12 - 10))
+#define CACHE_MAX_COUNT 64
+#define CACHE_MAX_BYTES (1 << 20)
+/* Chunks moved to or from the heap at once: up to this many, or bytes. */
+#define CACHE_BATCH 16
+#define CACHE_BATCH_BYTES 65536
+
+/* Defaults for mm_set_mmap_threshold() and mm_set_mmap_cache_size(). */
+#define MMAP_THRESHOLD (128 * 1024)
+#define MAPPING_CACHE_SIZE (8 << 20)
+#define MAPPING_CACHE_SLOTS 8
+
+/* Flags in a chunk's size. */
+#define MMAPPED 1        /* It is a mapping of its own, not part of the heap. */
+#define PREV_IN_USE 2    /* The chunk before it is in use, or there is none. */
+#define IN_USE 4
+#define FLAGS 15
+
+struct chunk {
+    size_t size;
+    /* The rest is the caller's while the chunk is in use. */
+    struct chunk *next, *prev;    /* On its free list, or with others of its size. */
+    /* Above SMALL_MAX, for the one of each size on the list: */
+    struct chunk *next_size, *prev_size;
+    /* ... and the last word of a free chunk repeats its size. */
+};
+
+struct thread_cache {
+    struct chunk *bins[NUM_CACHED_BINS];
+    int counts[NUM_CACHED_BINS];
+    size_t bytes;
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct chunk *bins[NUM_BINS];
+static uint64_t bin_map[(NUM_BINS + 63) / 64];    /* Bit set: list not empty. */
+/* The free end of the current region, on no list; NULL before there is one. */
+static struct chunk *top;
+
+/* Initial-exec, so that reaching the cache is a plain load. */
+static __thread struct thread_cache *thread_cache
+    __attribute__((tls_model("initial-exec")));
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static size_t mmap_threshold = MMAP_THRESHOLD;
+/* Freed mappings kept for reuse, of mapping_cache_size bytes at most. */
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    char *base;
+    size_t length;
+} cached_mappings[MAPPING_CACHE_SLOTS];
+static int num_cached_mappings;
+static size_t cached_mapping_bytes;
+static size_t mapping_cache_size = MAPPING_CACHE_SIZE;
+
+static struct chunk *chunk_of(void *ptr) {
+    return (struct chunk *) ((char *) ptr - HEADER_SIZE);
+}
+
+static void *payload_of(struct chunk *chunk) {
+    return (char *) chunk + HEADER_SIZE;
+}
+
+static size_t chunk_size(struct chunk *chunk) {
+    return chunk->size & ~(size_t) FLAGS;
+}
+
+static struct chunk *next_chunk(struct chunk *chunk) {
+    return (struct chunk *) ((char *) chunk + chunk_size(chunk));
+}
+
+/* Only for a chunk whose previous one is free, and so has a boundary tag. */
+static struct chunk *prev_chunk(struct chunk *chunk) {
+    size_t prev_size = *(size_t *) ((char *) chunk - HEADER_SIZE);
+    return (struct chunk *) ((char *) chunk - prev_size);
+}
+
+/* Returns the class of chunks of SIZE bytes, or of the class they round up to. */
+static int bin_index(size_t size) {
+    if (size <= SMALL_MAX)
+        return size / ALIGNMENT - 2;
+    /* 2^shift < size <= 2^(shift + 1), in quarters. */
+    int shift = 63 - __builtin_clzl(size - 1);
+    return NUM_SMALL_BINS + 4 * (shift - 10)
+        + (int) ((size - 1 - ((size_t) 1 << shift)) >> (shift - 2));
+}
+
+static size_t bin_size(int index) {
+    if (index < NUM_SMALL_BINS)
+        return (size_t) (index + 2) * ALIGNMENT;
+    index -= NUM_SMALL_BINS;
+    int shift = index / 4 + 10;
+    return ((size_t) 1 << shift) + (size_t) (index % 4 + 1) * ((size_t) 1 << (shift - 2));
+}
+
+/*
+ * Returns the size of the chunk that serves a request for SIZE bytes, or 0
+ * if there can't be one. Sizes thread caches keep are rounded up to their
+ * class, so that any chunk on a cache's list serves any request for it.
+ */
+static size_t request_to_chunk_size(size_t size) {
+    if (size > SIZE_MAX / 2)
+        return 0;
+    size_t rounded = (size + HEADER_SIZE + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    if (rounded < MIN_CHUNK_SIZE)
+        rounded = MIN_CHUNK_SIZE;
+    if (rounded <= SMALL_MAX || rounded > CACHE_MAX_SIZE)
+        return rounded;
+    return bin_size(bin_index(rounded));
+}
+
+/* Returns the class whose list a free chunk of SIZE bytes goes on. */
+static int free_bin_index(size_t size) {
+    int index = bin_index(size);
+    /* A size between classes goes with the class below it. */
+    return bin_size(index) > size ? index - 1 : index;
+}
+
+/* Returns the first class from INDEX on with free chunks, or -1. */
+static int next_nonempty_bin(int index) {
+    while (index < NUM_BINS) {
+        uint64_t word = bin_map[index / 64] >> (index % 64);
+        if (word)
+            return index + __builtin_ctzll(word);
+        index = (index / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+/* Puts CHUNK on the list of small class INDEX, all of whose chunks are the same size. */
+static void insert_small(struct chunk *chunk, int index) {
+    chunk->prev = NULL;
+    chunk->next = bins[index];
+    if (chunk->next)
+        chunk->next->prev = chunk;
+    bins[index] = chunk;
+}
+
+/*
+ * Puts CHUNK on the list of large class INDEX. The list holds one chunk of
+ * each size, in order, and every other chunk of that size hangs off it, so
+ * finding a chunk's place takes a step per size rather than per chunk.
+ */
+static void insert_large(struct chunk *chunk, int index) {
+    size_t size = chunk_size(chunk);
+    struct chunk *prev = NULL, *at = bins[index];
+    while (at && chunk_size(at) < size) {
+        prev = at;
+        at = at->next_size;
+    }
+
+    if (at && chunk_size(at) == size) {
+        /* Same size: last in, first out, behind the one on the list. */
+        chunk->prev = at;
+        chunk->next = at->next;
+        if (chunk->next)
+            chunk->next->prev = chunk;
+        at->next = chunk;
+        return;
+    }
+
+    chunk->prev = NULL;
+    chunk->next = NULL;
+    chunk->prev_size = prev;
+    chunk->next_size = at;
+    if (prev)
+        prev->next_size = chunk;
+    else
+        bins[index] = chunk;
+    if (at)
+        at->prev_size = chunk;
+}
+
+/*
+ * Puts CHUNK, whose size and PREV_IN_USE flag are set, on its free list,
+ * and tags it as free for its neighbour.
+ */
+static void insert_free(struct chunk *chunk) {
+    size_t size = chunk_size(chunk);
+    struct chunk *next = next_chunk(chunk);
+    *(size_t *) ((char *) next - HEADER_SIZE) = size;
+    next->size &= ~(size_t) PREV_IN_USE;
+
+    int index = free_bin_index(size);
+    if (index < NUM_SMALL_BINS)
+        insert_small(chunk, index);
+    else
+        insert_large(chunk, index);
+    bin_map[index / 64] |= (uint64_t) 1 << (index % 64);
+}
+
+static void unlink_free(struct chunk *chunk) {
+    int index = free_bin_index(chunk_size(chunk));
+    if (index < NUM_SMALL_BINS) {
+        if (chunk->prev)
+            chunk->prev->next = chunk->next;
+        else
+            bins[index] = chunk->next;
+        if (chunk->next)
+            chunk->next->prev = chunk->prev;
+    } else if (chunk->prev) {
+        /* One of the chunks hanging off another of its size. */
+        chunk->prev->next = chunk->next;
+        if (chunk->next)
+            chunk->next->prev = chunk->prev;
+    } else {
+        /* On the list itself: the next of its size, if any, takes its place. */
+        struct chunk *heir = chunk->next;
+        if (heir) {
+            heir->prev = NULL;
+            heir->prev_size = chunk->prev_size;
+            heir->next_size = chunk->next_size;
+        } else {
+            heir = chunk->next_size;
+        }
+        if (chunk->prev_size)
+            chunk->prev_size->next_size = heir;
+        else
+            bins[index] = heir;
+        if (chunk->next_size)
+            chunk->next_size->prev_size = heir == chunk->next_size ? chunk->prev_size : heir;
+    }
+    if (!bins[index])
+        bin_map[index / 64] &= ~((uint64_t) 1 << (index % 64));
+}
+
+/* Returns the best free chunk for SIZE bytes, still on its list, or NULL. */
+static struct chunk *find_best_fit(size_t size) {
+    int index = free_bin_index(size);
+    struct chunk *chunk = bins[index];
+
+    /* The list's own sizes go up from SIZE's class, in order. */
+    if (index >= NUM_SMALL_BINS)
+        while (chunk && chunk_size(chunk) < size)
+            chunk = chunk->next_size;
+    else if (chunk && chunk_size(chunk) < size)
+        chunk = NULL;
+    if (!chunk) {
+        index = next_nonempty_bin(index + 1);
+        if (index == -1)
+            return NULL;
+        chunk = bins[index];
+    }
+    /* Take one hanging off it, so the list itself stays as it is. */
+    return index >= NUM_SMALL_BINS && chunk->next ? chunk->next : chunk;
+}
+
+/*
+ * Starts a new region big enough for a chunk of SIZE bytes, with its own
+ * top. The old top is kept as a free chunk.
+ */
+static int grow_heap(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    /* Room for the chunk, a top after it and the fence. */
+    size_t needed = size + MIN_CHUNK_SIZE + ALIGNMENT;
+    size_t region_size = needed < REGION_SIZE ? REGION_SIZE
+        : (needed + page_size - 1) & ~(page_size - 1);
+    char *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return -1;
+
+    if (top)
+        insert_free(top);
+    /*
+     * The first header sits just below a 16-byte boundary. The last word is
+     * a fence: the header of a chunk that is always in use, so that merging
+     * stops at the end of the region.
+     */
+    top = (struct chunk *) (region + ALIGNMENT - HEADER_SIZE);
+    top->size = (region_size - ALIGNMENT) | PREV_IN_USE;
+    next_chunk(top)->size = IN_USE;
+    return 0;
+}
+
+/* Cuts a chunk of SIZE bytes off the top, leaving it at least MIN_CHUNK_SIZE. */
+static struct chunk *split_top(size_t size) {
+    if ((!top || chunk_size(top) < size + MIN_CHUNK_SIZE) && grow_heap(size) == -1)
+        return NULL;
+    struct chunk *chunk = top;
+    top = (struct chunk *) ((char *) chunk + size);
+    top->size = (chunk_size(chunk) - size) | PREV_IN_USE;
+    chunk->size = size | (chunk->size & PREV_IN_USE) | IN_USE;
+    return chunk;
+}
+
+/*
+ * Marks the free CHUNK, off its list, in use for SIZE bytes. The rest is
+ * split off as a free chunk if it is large enough to be one.
+ */
+static void use_chunk(struct chunk *chunk, size_t size) {
+    size_t rest_size = chunk_size(chunk) - size;
+    if (rest_size >= MIN_CHUNK_SIZE) {
+        struct chunk *rest = (struct chunk *) ((char *) chunk + size);
+        rest->size = rest_size | PREV_IN_USE;
+        chunk->size = size | (chunk->size & PREV_IN_USE) | IN_USE;
+        insert_free(rest);
+    } else {
+        chunk->size |= IN_USE;
+        next_chunk(chunk)->size |= PREV_IN_USE;
+    }
+}
+
+/* Takes a chunk of SIZE bytes from the heap. Caller holds heap_lock. */
+static struct chunk *allocate_chunk(size_t size) {
+    struct chunk *chunk = find_best_fit(size);
+    if (!chunk)
+        return split_top(size);
+    unlink_free(chunk);
+    use_chunk(chunk, size);
+    return chunk;
+}
+
+/* Frees CHUNK into the heap, merging it with free neighbours. Caller holds heap_lock. */
+static void release_chunk(struct chunk *chunk) {
+    size_t size = chunk_size(chunk);
+    if (!(chunk->size & PREV_IN_USE)) {
+        struct chunk *prev = prev_chunk(chunk);
+        unlink_free(prev);
+        size += chunk_size(prev);
+        chunk = prev;
+    }
+
+    /* Whatever is before CHUNK now is in use: free chunks are never adjacent. */
+    struct chunk *next = (struct chunk *) ((char *) chunk + size);
+    if (next == top) {
+        top = chunk;
+        top->size = (size + chunk_size(next)) | PREV_IN_USE;
+        return;
+    }
+    if (!(next->size & IN_USE)) {
+        unlink_free(next);
+        size += chunk_size(next);
+    }
+    chunk->size = size | PREV_IN_USE;
+    insert_free(chunk);
+}
+
+/*
+ * Cuts the in-use CHUNK down to SIZE bytes and frees the rest, if it is
+ * large enough to be a chunk. Caller holds heap_lock.
+ */
+static void trim_chunk(struct chunk *chunk, size_t size) {
+    size_t rest_size = chunk_size(chunk) - size;
+    if (rest_size < MIN_CHUNK_SIZE)
+        return;
+    struct chunk *rest = (struct chunk *) ((char *) chunk + size);
+    rest->size = rest_size | PREV_IN_USE | IN_USE;
+    chunk->size = size | (chunk->size & PREV_IN_USE) | IN_USE;
+    release_chunk(rest);
+}
+
+/*
+ * Resizes the in-use CHUNK to SIZE bytes where it is: grows it into the
+ * free chunk or the top after it, or shrinks it by freeing its tail.
+ * Returns 0, or -1 if the chunk after it has no room to give. Caller holds
+ * heap_lock.
+ */
+static int resize_chunk(struct chunk *chunk, size_t size) {
+    size_t old_size = chunk_size(chunk);
+    if (size <= old_size) {
+        trim_chunk(chunk, size);
+        return 0;
+    }
+
+    struct chunk *next = next_chunk(chunk);
+    if (next == top) {
+        size_t total = old_size + chunk_size(top);
+        if (total < size + MIN_CHUNK_SIZE)
+            return -1;
+        top = (struct chunk *) ((char *) chunk + size);
+        top->size = (total - size) | PREV_IN_USE;
+        chunk->size = size | (chunk->size & PREV_IN_USE) | IN_USE;
+        return 0;
+    }
+    if ((next->size & IN_USE) || old_size + chunk_size(next) < size)
+        return -1;
+    unlink_free(next);
+    chunk->size += chunk_size(next);
+    next_chunk(chunk)->size |= PREV_IN_USE;
+    trim_chunk(chunk, size);
+    return 0;
+}
+
+/* How many chunks of SIZE bytes to move between a cache and the heap at once. */
+static int batch_count(size_t size) {
+    int count = CACHE_BATCH_BYTES / size;
+    return count < 1 ? 1 : count > CACHE_BATCH ? CACHE_BATCH : count;
+}
+
+/* Gives every chunk in CACHE back to the heap. */
+static void flush_cache(struct thread_cache *cache) {
+    int index;
+    pthread_mutex_lock(&heap_lock);
+    for (index = 0; index < NUM_CACHED_BINS; index++) {
+        while (cache->bins[index]) {
+            struct chunk *chunk = cache->bins[index];
+            cache->bins[index] = chunk->next;
+            release_chunk(chunk);
+        }
+        cache->counts[index] = 0;
+    }
+    cache->bytes = 0;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Runs as a thread exits: its cache goes back to the heap, itself included. */
+static void destroy_cache(void *arg) {
+    struct thread_cache *cache = arg;
+    flush_cache(cache);
+    thread_cache = NULL;
+    mm_free(cache);
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, destroy_cache);
+}
+
+/* Returns the calling thread's cache, or NULL if it can't have one. */
+static struct thread_cache *get_cache(void) {
+    if (thread_cache)
+        return thread_cache;
+
+    pthread_once(&cache_key_once, create_cache_key);
+    size_t size = request_to_chunk_size(sizeof(struct thread_cache));
+    pthread_mutex_lock(&heap_lock);
+    struct chunk *chunk = allocate_chunk(size);
+    pthread_mutex_unlock(&heap_lock);
+    if (!chunk)
+        return NULL;
+    struct thread_cache *cache = payload_of(chunk);
+    memset(cache, 0, sizeof(*cache));
+    if (pthread_setspecific(cache_key, cache) != 0) {
+        mm_free(cache);
+        return NULL;
+    }
+    return thread_cache = cache;
+}
+
+/*
+ * Takes a batch of chunks of class INDEX, SIZE bytes, from the heap: one to
+ * return, the rest for CACHE.
+ */
+static struct chunk *refill_cache(struct thread_cache *cache, int index,
+        size_t size) {
+    int count = batch_count(size);
+    pthread_mutex_lock(&heap_lock);
+    struct chunk *chunk = allocate_chunk(size);
+    while (chunk && --count > 0 && cache->counts[index] < CACHE_MAX_COUNT) {
+        struct chunk *extra = allocate_chunk(size);
+        if (!extra)
+            break;
+        extra->next = cache->bins[index];
+        cache->bins[index] = extra;
+        cache->counts[index]++;
+        cache->bytes += chunk_size(extra);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return chunk;
+}
+
+/* Moves a batch of chunks of class INDEX from CACHE to the heap. */
+static void flush_cache_bin(struct thread_cache *cache, int index) {
+    int count = batch_count(bin_size(index));
+    pthread_mutex_lock(&heap_lock);
+    while (count-- > 0 && cache->bins[index]) {
+        struct chunk *chunk = cache->bins[index];
+        cache->bins[index] = chunk->next;
+        cache->counts[index]--;
+        cache->bytes -= chunk_size(chunk);
+        release_chunk(chunk);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Returns the length of a mapping for a request of SIZE bytes, or 0 if there can't be one. */
+static size_t mapping_length(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX / 2)
+        return 0;
+    return (size + ALIGNMENT + page_size - 1) & ~(page_size - 1);
+}
+
+/* The mapping of a MMAPPED chunk starts just before it, as regions do. */
+static char *mapping_base(struct chunk *chunk) {
+    return (char *) chunk - (ALIGNMENT - HEADER_SIZE);
+}
+
+static size_t mapping_length_of(struct chunk *chunk) {
+    return chunk_size(chunk) + ALIGNMENT - HEADER_SIZE;
+}
+
+static struct chunk *chunk_in_mapping(char *base, size_t length) {
+    struct chunk *chunk = (struct chunk *) (base + ALIGNMENT - HEADER_SIZE);
+    chunk->size = (length - (ALIGNMENT - HEADER_SIZE)) | MMAPPED;
+    return chunk;
+}
+
+/*
+ * Gives a request of SIZE bytes a mapping of its own: a cached one no more
+ * than half as large again as needed, or else a new one.
+ */
+static struct chunk *map_chunk(size_t size) {
+    size_t length = mapping_length(size);
+    char *base = NULL;
+    int i, best = -1;
+
+    if (length == 0)
+        return NULL;
+    pthread_mutex_lock(&mapping_lock);
+    for (i = 0; i < num_cached_mappings; i++)
+        if (cached_mappings[i].length >= length
+                && cached_mappings[i].length - length <= length / 2
+                && (best == -1 || cached_mappings[i].length < cached_mappings[best].length))
+            best = i;
+    if (best != -1) {
+        base = cached_mappings[best].base;
+        length = cached_mappings[best].length;
+        cached_mapping_bytes -= length;
+        cached_mappings[best] = cached_mappings[--num_cached_mappings];
+    }
+    pthread_mutex_unlock(&mapping_lock);
+
+    if (!base) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+    }
+    return chunk_in_mapping(base, length);
+}
+
+/* Keeps a MMAPPED chunk's mapping for reuse if there is room, or unmaps it. */
+static void unmap_chunk(struct chunk *chunk) {
+    char *base = mapping_base(chunk);
+    size_t length = mapping_length_of(chunk);
+
+    pthread_mutex_lock(&mapping_lock);
+    if (num_cached_mappings < MAPPING_CACHE_SLOTS
+            && cached_mapping_bytes + length <= mapping_cache_size) {
+        cached_mappings[num_cached_mappings].base = base;
+        cached_mappings[num_cached_mappings].length = length;
+        num_cached_mappings++;
+        cached_mapping_bytes += length;
+        base = NULL;
+    }
+    pthread_mutex_unlock(&mapping_lock);
+    if (base)
+        munmap(base, length);
+}
+
+/* Resizes a MMAPPED chunk for SIZE bytes, moving its pages rather than their contents. */
+static struct chunk *remap_chunk(struct chunk *chunk, size_t size) {
+    size_t length = mapping_length(size);
+    if (length == 0)
+        return NULL;
+    if (length == mapping_length_of(chunk))
+        return chunk;
+    char *base = mremap(mapping_base(chunk), mapping_length_of(chunk), length,
+            MREMAP_MAYMOVE);
+    if (base == MAP_FAILED)
+        return NULL;
+    return chunk_in_mapping(base, length);
+}
+
+void mm_set_mmap_threshold(size_t threshold) {
+    __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void mm_set_mmap_cache_size(size_t size) {
+    pthread_mutex_lock(&mapping_lock);
+    mapping_cache_size = size;
+    while (cached_mapping_bytes > mapping_cache_size) {
+        num_cached_mappings--;
+        munmap(cached_mappings[num_cached_mappings].base,
+                cached_mappings[num_cached_mappings].length);
+        cached_mapping_bytes -= cached_mappings[num_cached_mappings].length;
+    }
+    pthread_mutex_unlock(&mapping_lock);
+}
+
+/* Takes the tunables from the environment when the library is loaded. */
+__attribute__((constructor)) static void read_tunables(void) {
+    char *value;
+    if ((value = getenv("MM_MMAP_THRESHOLD")) && *value)
+        mm_set_mmap_threshold(strtoull(value, NULL, 0));
+    if ((value = getenv("MM_MMAP_CACHE_SIZE")) && *value)
+        mm_set_mmap_cache_size(strtoull(value, NULL, 0));
+}
 
 void *mm_malloc(size_t size) {
-    /* YOUR CODE HERE */
-    return NULL;
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        struct chunk *chunk = map_chunk(size);
+        if (!chunk) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        return payload_of(chunk);
+    }
+
+    size_t needed = request_to_chunk_size(size);
+    if (needed == 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    int index = bin_index(needed);
+    struct chunk *chunk;
+    struct thread_cache *cache;
+    if (index < NUM_CACHED_BINS && (cache = get_cache())) {
+        chunk = cache->bins[index];
+        if (chunk) {
+            cache->bins[index] = chunk->next;
+            cache->counts[index]--;
+            cache->bytes -= chunk_size(chunk);
+        } else {
+            chunk = refill_cache(cache, index, needed);
+        }
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        chunk = allocate_chunk(needed);
+        pthread_mutex_unlock(&heap_lock);
+    }
+
+    if (!chunk) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return payload_of(chunk);
 }
 
 void *mm_realloc(void *ptr, size_t size) {
-    /* YOUR CODE HERE */
-    return NULL;
+    if (!ptr)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    struct chunk *chunk = chunk_of(ptr);
+    size_t usable = chunk_size(chunk) - HEADER_SIZE;
+    if (chunk->size & MMAPPED) {
+        /* Still large: move the pages. Otherwise it goes back to the heap. */
+        if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+            chunk = remap_chunk(chunk, size);
+            if (!chunk) {
+                errno = ENOMEM;
+                return NULL;
+            }
+            return payload_of(chunk);
+        }
+    } else {
+        size_t needed = request_to_chunk_size(size);
+        if (needed == 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        /* Too little to give back: keep the chunk as it is, without locking. */
+        if (needed <= chunk_size(chunk) && chunk_size(chunk) - needed < MIN_CHUNK_SIZE)
+            return ptr;
+        pthread_mutex_lock(&heap_lock);
+        int resized = resize_chunk(chunk, needed) == 0;
+        pthread_mutex_unlock(&heap_lock);
+        if (resized)
+            return ptr;
+    }
+
+    void *new_ptr = mm_malloc(size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, size < usable ? size : usable);
+    mm_free(ptr);
+    return new_ptr;
 }
 
 void mm_free(void *ptr) {
-    /* YOUR CODE HERE */
+    if (!ptr)
+        return;
+    struct chunk *chunk = chunk_of(ptr);
+    if (chunk->size & MMAPPED) {
+        unmap_chunk(chunk);
+        return;
+    }
+    int index = free_bin_index(chunk_size(chunk));
+    struct thread_cache *cache = thread_cache;
+    if (index < NUM_CACHED_BINS && cache) {
+        chunk->next = cache->bins[index];
+        cache->bins[index] = chunk;
+        cache->bytes += chunk_size(chunk);
+        if (++cache->counts[index] > CACHE_MAX_COUNT || cache->bytes > CACHE_MAX_BYTES)
+            flush_cache_bin(cache, index);
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    release_chunk(chunk);
+    pthread_mutex_unlock(&heap_lock);
 }
@@ -11,3 +11,17 @@
 void *mm_malloc(size_t size);
 void *mm_realloc(void *ptr, size_t size);
 void mm_free(void *ptr);
+
+/*
+ * Requests of THRESHOLD bytes or more are given a mapping of their own
+ * rather than a chunk of the heap. 128KB unless set here or by the
+ * MM_MMAP_THRESHOLD environment variable.
+ */
+void mm_set_mmap_threshold(size_t threshold);
+
+/*
+ * Up to SIZE bytes of freed mappings are kept for reuse instead of being
+ * unmapped at once; 0 keeps none. 8MB unless set here or by the
+ * MM_MMAP_CACHE_SIZE environment variable.
+ */
+void mm_set_mmap_cache_size(size_t size);
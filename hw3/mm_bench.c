@@ -0,0 +1,220 @@
+/*
+ * mm_bench.c
+ *
+ * Times the mm_* routines against the C library's malloc() on the same
+ * workloads, replayed from the same pseudo-random sequences for both.
+ *
+ *   churn: keeps SLOTS blocks live and replaces a random one at each step,
+ *          with mostly small sizes and a tail of larger ones, like the
+ *          buffers and strings of a server.
+ *   churn on N threads: the same on every thread at once, each with blocks
+ *          of its own, for as many threads as there are CPUs (or the number
+ *          given on the command line). Ideally each thread keeps its time
+ *          per operation, and the total throughput grows with N.
+ *   append: grows BUFFERS buffers at once by a few bytes at a time, calling
+ *          realloc for every append, as a string builder or a request buffer
+ *          that reallocates to the exact size would; a buffer is freed when
+ *          it reaches its final size, up to 64KB, and a new one started.
+ *          mm_realloc is timed against mm_malloc, copy and mm_free, which is
+ *          what it does when it can't resize in place.
+ *   same size: allocates SAME_SIZE_BLOCKS blocks of 6000 bytes, then frees
+ *          every other one, lowest address first, and then the rest. The
+ *          first half can't merge with their neighbours, so they pile up as
+ *          free chunks of one size; each free should still take the same time.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_alloc.h"
+
+#define SLOTS 10000
+#define CHURN_STEPS 10000000
+#define BUFFERS 8
+#define APPEND_STEPS 2000000
+#define SAME_SIZE_BLOCKS 20000
+
+struct allocator {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+};
+
+static struct allocator allocators[] = {
+    { "mm_malloc", mm_malloc, mm_realloc, mm_free },
+    { "malloc", malloc, realloc, free },
+};
+
+static unsigned long long next_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* 80% up to 256 bytes, 15% up to 4KB, 5% up to 32KB. */
+static size_t random_size(unsigned long long *state) {
+    unsigned long long r = next_random(state);
+    int kind = r % 100;
+    r >>= 8;
+    if (kind < 80)
+        return 8 + r % 249;
+    if (kind < 95)
+        return 256 + r % 3841;
+    return 4096 + r % 28673;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct churn {
+    struct allocator *allocator;
+    unsigned long long seed;
+    long steps;
+    double seconds;
+};
+
+static void *churn(void *arg) {
+    struct churn *run = arg;
+    struct allocator *allocator = run->allocator;
+    unsigned long long state = run->seed;
+    char **slots = calloc(SLOTS, sizeof(char *));
+    long i;
+
+    double start = now();
+    for (i = 0; i < run->steps; i++) {
+        int slot = next_random(&state) % SLOTS;
+        allocator->free(slots[slot]);
+        size_t size = random_size(&state);
+        slots[slot] = allocator->malloc(size);
+        slots[slot][0] = slots[slot][size - 1] = 1;
+    }
+    for (i = 0; i < SLOTS; i++)
+        allocator->free(slots[i]);
+    run->seconds = now() - start;
+    free(slots);
+    return NULL;
+}
+
+struct buffer {
+    char *data;
+    size_t length;
+    size_t final_length;
+};
+
+/*
+ * Runs append, resizing with ALLOCATOR's realloc, or with its malloc, a copy
+ * and its free if COPY is set; returns the ns per append.
+ */
+static double append(struct allocator *allocator, int copy) {
+    struct buffer buffers[BUFFERS] = { { NULL, 0, 0 } };
+    unsigned long long state = 88172645463325252ULL;
+    long i;
+
+    double start = now();
+    for (i = 0; i < APPEND_STEPS; i++) {
+        unsigned long long r = next_random(&state);
+        struct buffer *buffer = &buffers[r % BUFFERS];
+        size_t length = 1 + (r >> 8) % 64;
+        if (buffer->length == 0)
+            buffer->final_length = 1 + (r >> 16) % 65536;
+
+        char *data;
+        if (copy) {
+            data = allocator->malloc(buffer->length + length);
+            if (buffer->data)
+                memcpy(data, buffer->data, buffer->length);
+            allocator->free(buffer->data);
+        } else {
+            data = allocator->realloc(buffer->data, buffer->length + length);
+        }
+        memset(data + buffer->length, 'x', length);
+        buffer->data = data;
+        buffer->length += length;
+
+        if (buffer->length >= buffer->final_length) {
+            allocator->free(buffer->data);
+            buffer->data = NULL;
+            buffer->length = 0;
+        }
+    }
+    for (i = 0; i < BUFFERS; i++)
+        allocator->free(buffers[i].data);
+    return (now() - start) / APPEND_STEPS * 1e9;
+}
+
+static int lower_first(const void *a, const void *b) {
+    char *x = *(char **) a, *y = *(char **) b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Runs same size; returns the ns per free. */
+static double same_size(struct allocator *allocator) {
+    static char *blocks[SAME_SIZE_BLOCKS];
+    int i;
+
+    for (i = 0; i < SAME_SIZE_BLOCKS; i++) {
+        blocks[i] = allocator->malloc(6000);
+        blocks[i][0] = 1;
+    }
+    qsort(blocks, SAME_SIZE_BLOCKS, sizeof(char *), lower_first);
+
+    double start = now();
+    for (i = 0; i < SAME_SIZE_BLOCKS; i += 2)
+        allocator->free(blocks[i]);
+    for (i = 1; i < SAME_SIZE_BLOCKS; i += 2)
+        allocator->free(blocks[i]);
+    return (now() - start) / SAME_SIZE_BLOCKS * 1e9;
+}
+
+/* Runs churn on NUM_THREADS threads at once; returns the mean ns/op per thread. */
+static double churn_threads(struct allocator *allocator, int num_threads) {
+    struct churn runs[num_threads];
+    pthread_t threads[num_threads];
+    double total = 0;
+    int i;
+
+    for (i = 0; i < num_threads; i++) {
+        runs[i].allocator = allocator;
+        runs[i].seed = 88172645463325252ULL + i;
+        runs[i].steps = CHURN_STEPS / num_threads;
+        pthread_create(&threads[i], NULL, churn, &runs[i]);
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        total += runs[i].seconds / runs[i].steps * 1e9;
+    }
+    return total / num_threads;
+}
+
+int main(int argc, char **argv) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+
+    if (num_threads < 1)
+        num_threads = 1;
+    for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+        printf("churn              %-10s %7.1f ns/op\n", allocators[i].name,
+                churn_threads(&allocators[i], 1));
+    for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        double ns = churn_threads(&allocators[i], num_threads);
+        printf("churn on %2d threads %-10s %7.1f ns/op per thread, %6.1f Mops/s\n",
+                num_threads, allocators[i].name, ns, num_threads / ns * 1e3);
+    }
+    printf("append             %-10s %7.1f ns/op\n", "mm_realloc", append(&allocators[0], 0));
+    printf("append             %-10s %7.1f ns/op (malloc, copy, free)\n", "mm_malloc",
+            append(&allocators[0], 1));
+    printf("append             %-10s %7.1f ns/op\n", "realloc", append(&allocators[1], 0));
+    for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+        printf("same size          %-10s %7.1f ns/op\n", allocators[i].name,
+                same_size(&allocators[i]));
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -7,6 +8,7 @@
 void* (*mm_malloc)(size_t);
 void* (*mm_realloc)(void*, size_t);
 void (*mm_free)(void*);
+void (*mm_set_mmap_threshold)(size_t);
 
 void load_alloc_functions() {
     void *handle = dlopen("hw3lib.so", RTLD_NOW);
@@ -33,6 +35,229 @@ void load_alloc_functions() {
         fprintf(stderr, "%s\n", dlerror());
         exit(1);
     }
+
+    mm_set_mmap_threshold = dlsym(handle, "mm_set_mmap_threshold");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+}
+
+/* Allocates blocks of many sizes at once and checks they are aligned and kept apart. */
+void test_sizes() {
+    enum { COUNT = 2000 };
+    unsigned char *blocks[COUNT];
+    size_t sizes[COUNT];
+    int i;
+    size_t j;
+
+    for (i = 0; i < COUNT; i++) {
+        sizes[i] = (i * 7919) % (i % 10 == 0 ? 70000 : 600);
+        blocks[i] = mm_malloc(sizes[i]);
+        assert(blocks[i] != NULL);
+        assert((size_t) blocks[i] % 16 == 0);
+        for (j = 0; j < sizes[i]; j++)
+            blocks[i][j] = (unsigned char) i;
+    }
+    for (i = 0; i < COUNT; i++)
+        for (j = 0; j < sizes[i]; j++)
+            assert(blocks[i][j] == (unsigned char) i);
+
+    /* Freed blocks are handed out again. */
+    for (i = 0; i < COUNT; i += 2)
+        mm_free(blocks[i]);
+    for (i = 0; i < COUNT; i += 2) {
+        blocks[i] = mm_malloc(sizes[i]);
+        assert(blocks[i] != NULL);
+    }
+    for (i = 0; i < COUNT; i++)
+        mm_free(blocks[i]);
+    mm_free(NULL);
+}
+
+/* Blocks allocated on one thread and freed on another, many times over. */
+#define SHARED_BLOCKS 256
+unsigned char *shared_blocks[4][SHARED_BLOCKS];
+
+void *allocate_blocks(void *arg) {
+    unsigned char **blocks = arg;
+    int i;
+    for (i = 0; i < SHARED_BLOCKS; i++) {
+        blocks[i] = mm_malloc(i * 13 % 3000);
+        assert(blocks[i] != NULL);
+        blocks[i][0] = (unsigned char) i;
+    }
+    return NULL;
+}
+
+void *free_blocks(void *arg) {
+    unsigned char **blocks = arg;
+    int i;
+    for (i = 0; i < SHARED_BLOCKS; i++) {
+        assert(blocks[i][0] == (unsigned char) i);
+        mm_free(blocks[i]);
+    }
+    return NULL;
+}
+
+void test_threads() {
+    pthread_t threads[4];
+    int round, i;
+    for (round = 0; round < 50; round++) {
+        for (i = 0; i < 4; i++)
+            pthread_create(&threads[i], NULL, allocate_blocks, shared_blocks[i]);
+        for (i = 0; i < 4; i++)
+            pthread_join(threads[i], NULL);
+        /* Each thread frees what another one allocated. */
+        for (i = 0; i < 4; i++)
+            pthread_create(&threads[i], NULL, free_blocks, shared_blocks[(i + 1) % 4]);
+        for (i = 0; i < 4; i++)
+            pthread_join(threads[i], NULL);
+    }
+}
+
+/* Checks that the first SIZE bytes of BLOCK still count up from SEED. */
+void check_pattern(unsigned char *block, size_t size, int seed) {
+    size_t i;
+    for (i = 0; i < size; i++)
+        assert(block[i] == (unsigned char) (seed + i));
+}
+
+void fill_pattern(unsigned char *block, size_t size, int seed) {
+    size_t i;
+    for (i = 0; i < size; i++)
+        block[i] = (unsigned char) (seed + i);
+}
+
+/* Grows a block from a few bytes to several megabytes and back, across the mmap threshold. */
+void test_realloc() {
+    size_t sizes[] = { 10, 100, 5000, 200000, 3000000, 9000000, 150000, 50000, 20 };
+    size_t previous = 0;
+    unsigned char *block = NULL;
+    size_t i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        block = mm_realloc(block, sizes[i]);
+        assert(block != NULL);
+        assert((size_t) block % 16 == 0);
+        check_pattern(block, previous < sizes[i] ? previous : sizes[i], 7);
+        fill_pattern(block, sizes[i], 7);
+        previous = sizes[i];
+    }
+    assert(mm_realloc(block, 0) == NULL);
+
+    /* Large blocks come and go, and may be reused. */
+    for (i = 0; i < 20; i++) {
+        block = mm_malloc(1000000 + i * 4096);
+        assert(block != NULL);
+        fill_pattern(block, 1000000 + i * 4096, i);
+        check_pattern(block, 1000000 + i * 4096, i);
+        mm_free(block);
+    }
+
+    /* With a lower threshold, middling sizes get mappings too. */
+    mm_set_mmap_threshold(4096);
+    block = mm_malloc(8000);
+    assert(block != NULL);
+    fill_pattern(block, 8000, 3);
+    block = mm_realloc(block, 100);
+    check_pattern(block, 100, 3);
+    mm_free(block);
+    mm_set_mmap_threshold(128 * 1024);
+}
+
+/* Neighbouring blocks freed one by one merge back into room for a larger one. */
+void test_coalesce() {
+    enum { COUNT = 20, SIZE = 6000 };
+    unsigned char *blocks[COUNT];
+    unsigned char *low, *high, *block;
+    int i;
+
+    /* None of these may get a mapping of its own. */
+    mm_set_mmap_threshold(128 * 1024);
+    for (i = 0; i < COUNT; i++) {
+        blocks[i] = mm_malloc(SIZE);
+        assert(blocks[i] != NULL);
+    }
+    low = high = blocks[0];
+    for (i = 1; i < COUNT; i++) {
+        if (blocks[i] < low)
+            low = blocks[i];
+        if (blocks[i] > high)
+            high = blocks[i];
+    }
+    /* Free every other block first, so that both neighbours of the rest are free. */
+    for (i = 0; i < COUNT; i += 2)
+        mm_free(blocks[i]);
+    for (i = 1; i < COUNT; i += 2)
+        mm_free(blocks[i]);
+
+    block = mm_malloc(COUNT * SIZE / 2);
+    assert(block != NULL);
+    assert(block >= low && block <= high);
+    fill_pattern(block, COUNT * SIZE / 2, 5);
+    check_pattern(block, COUNT * SIZE / 2, 5);
+    mm_free(block);
+}
+
+/* Blocks grow into free space after them and shrink where they are. */
+void test_realloc_in_place() {
+    unsigned char *block, *next, *guard, *resized;
+
+    /* Above the sizes threads cache, so that a freed neighbour is free at once. */
+    mm_set_mmap_threshold(128 * 1024);
+    block = mm_malloc(6000);
+    next = mm_malloc(6000);
+    guard = mm_malloc(6000);
+    assert(block != NULL && next != NULL && guard != NULL);
+    fill_pattern(block, 6000, 9);
+    mm_free(next);
+
+    resized = mm_realloc(block, 11000);
+    assert(resized == block);
+    check_pattern(block, 6000, 9);
+    fill_pattern(block, 11000, 9);
+
+    resized = mm_realloc(block, 100);
+    assert(resized == block);
+    check_pattern(block, 100, 9);
+    resized = mm_realloc(block, 11000);
+    assert(resized == block);
+    check_pattern(block, 100, 9);
+
+    /* Nothing free after it: the block moves. */
+    resized = mm_realloc(block, 20000);
+    assert(resized != NULL);
+    check_pattern(resized, 100, 9);
+    mm_free(resized);
+    mm_free(guard);
+}
+
+/* Many free chunks of one size, taken and given back in any order. */
+void test_same_size() {
+    enum { COUNT = 3000, SIZE = 6000 };
+    static unsigned char *blocks[COUNT];
+    int i;
+
+    for (i = 0; i < COUNT; i++) {
+        blocks[i] = mm_malloc(SIZE);
+        assert(blocks[i] != NULL);
+        fill_pattern(blocks[i], SIZE, i);
+    }
+    /* Every other one, so that they can't merge, from either end. */
+    for (i = 0; i < COUNT / 2; i += 2) {
+        mm_free(blocks[i]);
+        mm_free(blocks[COUNT - 2 - i]);
+    }
+    for (i = 0; i < COUNT; i += 2) {
+        blocks[i] = mm_malloc(i % 4 == 0 ? SIZE : SIZE / 2);
+        assert(blocks[i] != NULL);
+        fill_pattern(blocks[i], i % 4 == 0 ? SIZE : SIZE / 2, i);
+    }
+    for (i = 0; i < COUNT; i++) {
+        check_pattern(blocks[i], i % 2 || i % 4 == 0 ? SIZE : SIZE / 2, i);
+        mm_free(blocks[i]);
+    }
 }
 
 int main() {
@@ -42,6 +267,14 @@ int main() {
     assert(data != NULL);
     data[0] = 0x162;
     mm_free(data);
+
+    /* These two want blocks allocated in turn to be neighbours: before the heap is cut up. */
+    test_coalesce();
+    test_realloc_in_place();
+    test_sizes();
+    test_same_size();
+    test_threads();
+    test_realloc();
     printf("malloc test successful!\n");
     return 0;
 }